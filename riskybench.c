@@ -0,0 +1,421 @@
+/* Microbenchmarks for Risky Chat's hot paths.
+ * Copyright (C) 2020  Jens Pitkanen <jens.pitkanen@helsinki.fi>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* This includes riskychat.c as-is, so the benchmarks call the real static
+ * functions, with no network involved. Build it with the same flags as the
+ * server, e.g.:
+ *   cc -O2 -pthread -o riskybench riskybench.c && ./riskybench
+ * Each benchmark runs for about RISKYBENCH_SECONDS. The decoders print how
+ * many bytes they got through per second, the rest how long one operation
+ * took, and how many syscalls and bytes of allocations it made. The
+ * history-size sweeps go up to 1M posts by default, pass a smaller maximum
+ * as the argument to make them quicker, e.g. ./riskybench 10000.
+ *
+ * The allocations are counted by wrapping malloc, realloc and calloc before
+ * riskychat.c is included (a realloc counts as its whole new size), and the
+ * syscalls by standing in for writev with a fake socket that takes
+ * everything it's given. So an operation that starts allocating or writing
+ * per post shows up as a number that grows with the history. */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+static unsigned long BENCH_SYSCALLS;
+static double BENCH_ALLOCATED;
+
+static void *bench_malloc(size_t len) {
+    BENCH_ALLOCATED += len;
+    return malloc(len);
+}
+
+static void *bench_realloc(void *data, size_t len) {
+    BENCH_ALLOCATED += len;
+    return realloc(data, len);
+}
+
+static void *bench_calloc(size_t count, size_t len) {
+    BENCH_ALLOCATED += (double)count * len;
+    return calloc(count, len);
+}
+
+#define malloc(len) bench_malloc(len)
+#define realloc(data, len) bench_realloc(data, len)
+#define calloc(count, len) bench_calloc(count, len)
+#ifndef _WIN32
+static ssize_t bench_writev(int fd, const struct iovec *iov, int iov_len);
+#define writev bench_writev
+#endif
+
+#define RISKYCHAT_NO_MAIN
+#include "riskychat.c"
+#undef main
+
+#define RISKYBENCH_SECONDS 0.5
+#define RISKYBENCH_FORM_LEN 10240
+#define RISKYBENCH_MAX_POSTS 1000000
+#define RISKYBENCH_MAX_USERS 1000000
+
+#ifndef _WIN32
+/* The fake socket: everything's sent in one go. */
+static ssize_t bench_writev(int fd, const struct iovec *iov, int iov_len) {
+    ssize_t sent;
+    int i;
+
+    (void)fd;
+    BENCH_SYSCALLS++;
+    for (sent = 0, i = 0; i < iov_len; i++) sent += iov[i].iov_len;
+    return sent;
+}
+#endif
+
+/* Runs op over and over in growing batches for about RISKYBENCH_SECONDS,
+ * after a warm-up run, and prints what one run cost. */
+static void run_bench(char *name, void (*op)(void)) {
+    clock_t start, elapsed;
+    unsigned long runs, batch, i;
+
+    op();
+    BENCH_SYSCALLS = 0;
+    BENCH_ALLOCATED = 0;
+    runs = 0;
+    batch = 1;
+    start = clock();
+    do {
+        for (i = 0; i < batch; i++) op();
+        runs += batch;
+        if (batch < 65536) batch *= 2;
+        elapsed = clock() - start;
+    } while (elapsed < RISKYBENCH_SECONDS * CLOCKS_PER_SEC);
+    printf("%-24s %12.1f ns/op %8.2f syscalls/op %12.1f B/op allocated\n",
+           name, (double)elapsed / CLOCKS_PER_SEC / runs * 1e9,
+           (double)BENCH_SYSCALLS / runs, BENCH_ALLOCATED / runs);
+}
+
+/* decode: The form decoder, against the one it replaced. */
+
+/* The old decoder, kept here for comparison: it parses each escape with
+ * strtol, and moves the whole rest of the buffer down for every one. */
+static void legacy_decode_percent(char *buffer, size_t *buffer_len) {
+    char tol_buf[64], c;
+    size_t i;
+    for (i = 0; i < *buffer_len; i++) {
+        if (buffer[i] == '+') buffer[i] = ' ';
+        else if (buffer[i] == '%' && i + 2 < *buffer_len) {
+            tol_buf[0] = buffer[i + 1];
+            tol_buf[1] = buffer[i + 2];
+            tol_buf[2] = '\0';
+            c = (char)strtol(tol_buf, NULL, 16);
+            buffer[i] = c;
+            memmove(&buffer[i + 1], &buffer[i + 3], *buffer_len - (i + 3));
+            *buffer_len -= 2;
+        }
+    }
+}
+
+static size_t bench_legacy(char *buf, size_t len) {
+    legacy_decode_percent(buf, &len);
+    return len;
+}
+
+static size_t bench_form_decode(char *buf, size_t len) {
+    return form_decode(buf, len);
+}
+
+static size_t bench_copy_only(char *buf, size_t len) {
+    (void)buf;
+    return len;
+}
+
+/* Fills buf with len bytes of form-encoded text, where every period'th
+ * character is escaped (0 for never). */
+static void make_form(char *buf, size_t len, int period) {
+    static char text[] = "The quick brown fox jumps over the lazy dog. ";
+    static char escaped[] = "%C3%A4";
+    size_t i, n;
+
+    for (i = 0, n = 0; i < len; n++) {
+        if (period != 0 && n % period == 0 && i + 6 <= len) {
+            memcpy(&buf[i], escaped, 6);
+            i += 6;
+        } else {
+            buf[i] = text[n % (sizeof text - 1)];
+            if (buf[i] == ' ' && period != 0) buf[i] = '+';
+            i++;
+        }
+    }
+}
+
+/* Decodes a fresh copy of input over and over, and returns the number of
+ * seconds one decode took. The copy is included, see bench_copy_only. */
+static double time_decoder(size_t (*decode)(char *, size_t), char *input,
+                           size_t len, char *scratch, size_t *decoded_len) {
+    clock_t start, elapsed;
+    unsigned long runs;
+
+    runs = 0;
+    start = clock();
+    do {
+        memcpy(scratch, input, len);
+        *decoded_len = decode(scratch, len);
+        runs++;
+        elapsed = clock() - start;
+    } while (elapsed < RISKYBENCH_SECONDS * CLOCKS_PER_SEC);
+    return (double)elapsed / CLOCKS_PER_SEC / runs;
+}
+
+static void bench_decode(char *name, int period) {
+    static char input[RISKYBENCH_FORM_LEN];
+    static char legacy[RISKYBENCH_FORM_LEN];
+    static char decoded[RISKYBENCH_FORM_LEN];
+    double copy_time, legacy_time, decode_time;
+    size_t legacy_len, decoded_len, copy_len;
+
+    make_form(input, sizeof input, period);
+    copy_time = time_decoder(bench_copy_only, input, sizeof input, decoded,
+                             &copy_len);
+    legacy_time = time_decoder(bench_legacy, input, sizeof input, legacy,
+                               &legacy_len) - copy_time;
+    decode_time = time_decoder(bench_form_decode, input, sizeof input,
+                               decoded, &decoded_len) - copy_time;
+    printf("decode %-10s legacy %9.1f MB/s, form_decode %9.1f MB/s%s\n",
+           name, sizeof input / legacy_time / 1e6,
+           sizeof input / decode_time / 1e6,
+           legacy_len != decoded_len ||
+           memcmp(legacy, decoded, decoded_len) != 0 ? " (MISMATCH)" : "");
+}
+
+/* parse: The request parser, on requests that are all in the buffer, and
+ * on one arriving a byte at a time, which should only cost about as much
+ * more as the extra calls. */
+
+static char parse_get[] = "GET /?since=10 HTTP/1.1\r\n\
+Host: 127.0.0.1:8000\r\n\
+User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:80.0) Gecko/20100101 \
+Firefox/80.0\r\n\
+Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n\
+Accept-Language: en-US,en;q=0.5\r\n\
+Accept-Encoding: gzip, deflate\r\n\
+Connection: keep-alive\r\n\
+Cookie: theme=dark; riskyid=42\r\n\
+Upgrade-Insecure-Requests: 1\r\n\
+\r\n";
+
+static char parse_post[] = "POST /post HTTP/1.1\r\n\
+Host: 127.0.0.1:8000\r\n\
+Content-Type: application/x-www-form-urlencoded\r\n\
+Content-Length: 36\r\n\
+Cookie: riskyid=42\r\n\
+\r\n\
+content=Hello+there%2C+how+are+you%3F";
+
+static struct connection_ctx PARSE_CTX;
+
+static void parse_reset(char *request, size_t len) {
+    memset(&PARSE_CTX, 0, sizeof PARSE_CTX);
+    PARSE_CTX.buffer = request;
+    PARSE_CTX.buffer_len = PARSE_CTX.read_len = len;
+}
+
+static void bench_parse_get(void) {
+    parse_reset(parse_get, sizeof parse_get - 1);
+    if (parse_request(&PARSE_CTX) != 1) printf("(parse failed) ");
+}
+
+static void bench_parse_post(void) {
+    parse_reset(parse_post, sizeof parse_post - 1);
+    if (parse_request(&PARSE_CTX) != 1) printf("(parse failed) ");
+}
+
+static void bench_parse_trickle(void) {
+    size_t len;
+
+    parse_reset(parse_get, 0);
+    for (len = 1; len < sizeof parse_get; len++) {
+        PARSE_CTX.read_len = len;
+        if (parse_request(&PARSE_CTX) == 1) break;
+    }
+    if (len != sizeof parse_get - 1) printf("(parse failed) ");
+}
+
+/* posts: Adding posts with N posts in memory (and one dropped for each one
+ * added), and sending the chat page, as-is and gzipped, which should both
+ * be the same couple of syscalls however long the page is. */
+
+static int BENCH_USER;
+static unsigned long BENCH_POSTS;
+static struct out_queue BENCH_OUT;
+
+static void bench_add_post(void) {
+    char body[128];
+    int len;
+
+    len = sprintf(body, "content=Post+number+%lu%%2C+about+as+long+as+"
+                  "a+chat+message+usually+is.", BENCH_POSTS++);
+    add_new_post(body, len, BENCH_USER);
+}
+
+static void send_page(int gzip) {
+    double sent;
+
+    queue_http_chat_response(&BENCH_OUT, &LOBBY, 0, 1, gzip);
+    sent = 0;
+    outq_flush(-1, &BENCH_OUT, &sent);
+}
+
+static void bench_send_page(void) {
+    send_page(0);
+}
+
+static void bench_send_gzip_page(void) {
+    send_page(1);
+}
+
+/* Starts over with an empty chat that keeps at most max_posts posts, and a
+ * user to post them. */
+static void reset_chat(unsigned long max_posts) {
+    char *name;
+
+    room_free(&LOBBY);
+    user_table_free(&USERS);
+    RETENTION.max_posts = max_posts;
+    RETENTION.max_bytes = 0;
+    room_init(&LOBBY, "", 0);
+    user_table_init(&USERS, RISKYBENCH_MAX_USERS);
+    name = malloc(6);
+    if (name == NULL) {
+        perror("error allocating a name");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(name, "bench");
+    BENCH_USER = add_user(name);
+}
+
+static void bench_posts(unsigned long posts_len) {
+    char name[64];
+
+    reset_chat(posts_len);
+    while (LOBBY.log.posts_len < posts_len) bench_add_post();
+    sprintf(name, "add_new_post %lu", posts_len);
+    run_bench(name, bench_add_post);
+#ifndef _WIN32
+    sprintf(name, "chat page %lu", posts_len);
+    run_bench(name, bench_send_page);
+    sprintf(name, "chat page gzip %lu", posts_len);
+    run_bench(name, bench_send_gzip_page);
+#endif
+}
+
+/* users: Checking a name, and logging in (and out again, so the count
+ * stays put), with N users in the table. */
+
+static unsigned long BENCH_NAMES;
+
+static void bench_is_name_reserved(void) {
+    char name[32];
+
+    sprintf(name, "user%lu", BENCH_NAMES++ % (USERS.users_len * 2));
+    is_name_reserved(name);
+}
+
+static void bench_add_user(void) {
+    char *name;
+    int id;
+
+    name = malloc(32);
+    if (name == NULL) {
+        perror("error allocating a name");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(name, "new%lu", BENCH_NAMES++);
+    id = add_user(name);
+    if (id <= 0) {
+        free(name);
+        return;
+    }
+    users_lock();
+    user_table_remove(&USERS, id);
+    users_unlock();
+}
+
+static void bench_users(int users_len) {
+    char name[64], *user_name;
+    int i;
+
+    reset_chat(1);
+    for (i = 1; i < users_len; i++) {
+        user_name = malloc(32);
+        if (user_name == NULL) {
+            perror("error allocating a name");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(user_name, "user%d", i);
+        if (add_user(user_name) <= 0) free(user_name);
+    }
+    BENCH_NAMES = 0;
+    sprintf(name, "is_name_reserved %d", users_len);
+    run_bench(name, bench_is_name_reserved);
+    sprintf(name, "add_user %d", users_len);
+    run_bench(name, bench_add_user);
+}
+
+int main(int argc, char **argv) {
+    unsigned long posts_len, max_posts;
+    int users_len;
+
+    max_posts = RISKYBENCH_MAX_POSTS;
+    if (argc > 1) max_posts = strtoul(argv[1], NULL, 10);
+
+    crc32_init();
+    deflate_init();
+    build_static_responses();
+    user_table_init(&USERS, RISKYBENCH_MAX_USERS);
+    room_init(&LOBBY, "", 0);
+
+    run_bench("parse GET", bench_parse_get);
+    run_bench("parse POST", bench_parse_post);
+    run_bench("parse GET byte by byte", bench_parse_trickle);
+
+#ifdef RISKYCHAT_USE_AVX2
+    printf("form_copy_plain: AVX2\n");
+#elif defined(RISKYCHAT_USE_SSE2)
+    printf("form_copy_plain: SSE2\n");
+#else
+    printf("form_copy_plain: scalar\n");
+#endif
+    bench_decode("ascii", 0);
+    bench_decode("mostly", 40);
+    bench_decode("escaped", 1);
+
+    for (posts_len = 10; posts_len <= max_posts; posts_len *= 10) {
+        bench_posts(posts_len);
+    }
+    for (users_len = 10; users_len <= RISKYBENCH_MAX_USERS;
+         users_len *= 10) {
+        bench_users(users_len);
+    }
+
+    outq_clear(&BENCH_OUT);
+    free(BENCH_OUT.chunks);
+    free(BENCH_OUT.scratch);
+    room_free(&LOBBY);
+    user_table_free(&USERS);
+    free_static_responses();
+    return 0;
+}
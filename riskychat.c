@@ -16,9 +16,9 @@
  */
 
 /* A few quick notes about reading this source code:
- * - The code is divided into four sections, which are easily findable with
+ * - The code is divided into sections, which are easily findable with
  *   any string searching tool (grep, ctrl+f):
- *   "decls:", "main:", "responses:", "privfuncs:", "pubfuncs:".
+ *   "decls:", "main:", "responses:", "parser:", "privfuncs:", "pubfuncs:".
  *   Search the text inbetween the quotes to find the section.
  * - The code should compile on any system which supports the POSIX socket API
  *   and has a C89 compiler.
@@ -33,8 +33,53 @@
 #define RISKYCHAT_MAX_CONNECTIONS 1000
 #define RISKYCHAT_MAX_USERS 1000
 #define RISKYCHAT_TIMEOUT 300
+#define RISKYCHAT_MAX_EVENTS 64
+#define RISKYCHAT_MAX_WORKERS 64
+#define RISKYCHAT_TICK_MS 1000
+#define RISKYCHAT_KEEPALIVE_REQUESTS 100
+#define RISKYCHAT_KEEPALIVE_TIMEOUT 5
+#define RISKYCHAT_SHED_LAG_MS 50
+#define RISKYCHAT_ACCESS_LOG_RECORDS 16384
+#define RISKYCHAT_ACCESS_LOG_FLUSH_MS 100
+#define RISKYCHAT_ROOM_NAME_LEN 32
+#define RISKYCHAT_MAX_ROOMS 256
+#define RISKYCHAT_ROOM_BUCKETS 256
+#define RISKYCHAT_ROOM_MAX_POSTS 1000
+#define RISKYCHAT_ROOM_MAX_POST_BYTES (1024 * 1024)
+#define RISKYCHAT_ROOM_IDLE 3600
+#define RISKYCHAT_ROOM_QUIET 10
+#define RISKYCHAT_HEADER_TIMEOUT 10
+#define RISKYCHAT_BODY_TIMEOUT 30
+#define RISKYCHAT_WRITE_TIMEOUT 30
+#define RISKYCHAT_WHEEL_SLOTS 64
+#define RISKYCHAT_HISTOGRAM_BUCKETS 100
+#define RISKYCHAT_POST_LIMIT 60
+#define RISKYCHAT_LOGIN_LIMIT 10
+#define RISKYCHAT_LIMIT_BURST 10
+#define RISKYCHAT_LIMIT_BUCKETS 4096
+#define RISKYCHAT_LIMIT_WAYS 8
+#define RISKYCHAT_BUFFER_SIZE 4096
+#define RISKYCHAT_MAX_KEPT_SCRATCH 65536
+#define RISKYCHAT_MAX_HEADER_SIZE 16384
+#define RISKYCHAT_MAX_BODY_SIZE 1048576
+#define RISKYCHAT_MAX_IOV 64
+#define RISKYCHAT_CACHE_SIZE 65536
+#define RISKYCHAT_GZIP_SEGMENT 16384
+#define RISKYCHAT_ARENA_SIZE 65536
+#define RISKYCHAT_MAX_POSTS 10000
+#define RISKYCHAT_MAX_POST_BYTES 16777216
+#define RISKYCHAT_ARCHIVE_PAGE 100
+#define RISKYCHAT_API_LIMIT 100
+#define RISKYCHAT_SSE_HEARTBEAT 15
+#define RISKYCHAT_SSE_MAX_BEHIND 262144
+#define RISKYCHAT_WAL_NAME "riskychat.%lu.wal"
+#define RISKYCHAT_SNAPSHOT_NAME "riskychat.snap"
+#define RISKYCHAT_SNAPSHOT_INTERVAL 300
+#define RISKYCHAT_SNAPSHOT_MAGIC "RSKYSNP1"
 
+#include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,57 +91,721 @@
 typedef SSIZE_T ssize_t;
 /* Sockets: */
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #define SHUT_RDWR SD_BOTH
 #define close closesocket
 #pragma comment(lib, "Ws2_32.lib")
+/* Readiness: WSAPoll is the winsock flavor of poll(), Vista and up. */
+#define poll WSAPoll
+/* Files: close is taken by the sockets. */
+#include <fcntl.h>
+#include <io.h>
+#define fsync _commit
+#define ftruncate _chsize
+#define file_close _close
 #else
 /* Sockets: */
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
+/* Files: */
+#include <sys/mman.h>
+#define O_BINARY 0
+#define file_close close
+#define RISKYCHAT_USE_MMAP
 /* Signals: */
 #include <signal.h>
+/* Worker threads: */
+#include <pthread.h>
+#define RISKYCHAT_THREADS
 #define SOCKET_ERROR (-1)
 #define INVALID_SOCKET (-1)
+/* Readiness: epoll where we have it, plain poll() everywhere else. */
+#ifdef __linux__
+#define RISKYCHAT_USE_EPOLL
+#include <sys/epoll.h>
+/* glibc hides this behind _DEFAULT_SOURCE, but it's been there since 3.9. */
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+#else
+#include <poll.h>
+#endif
+#endif
+
+/* SIMD: SSE2 is a part of x86-64, AVX2 is used if the compiler is told it
+ * can (e.g. -mavx2 or -march=native). */
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RISKYCHAT_USE_SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#define RISKYCHAT_USE_AVX2
+#endif
+
+/* riskybench.c includes this file, and brings its own main. */
+#ifdef RISKYCHAT_NO_MAIN
+#define main riskychat_main
 #endif
 
 /* decls: Declarations used by the rest of the program. */
 
 enum http_method {
-    GET, POST, HEAD /* Just the ones we care about. */
+    GET, POST, HEAD, /* Just the ones we care about. */
+    METHODS_LEN
 };
 
 enum resource {
-    UNKNOWN_RESOURCE, RESOURCE_INDEX, RESOURCE_LOGIN, RESOURCE_NEW_POST
+    UNKNOWN_RESOURCE, RESOURCE_INDEX, RESOURCE_LOGIN, RESOURCE_NEW_POST,
+    RESOURCE_ARCHIVE, RESOURCE_API_POSTS, RESOURCE_EVENTS, RESOURCE_METRICS,
+    RESOURCE_ROOM, RESOURCE_ROOM_POST, RESOURCES_LEN
+};
+
+/* The statuses responded with, as counted in the metrics. */
+enum status_code {
+    STATUS_200, STATUS_303, STATUS_400, STATUS_403, STATUS_404, STATUS_408,
+    STATUS_429, STATUS_503, STATUS_CODES_LEN
+};
+
+/* The parts of a request that are timed, see end_stage. */
+enum latency_stage {
+    LATENCY_PARSE, LATENCY_HANDLE, LATENCY_WRITE, LATENCY_STAGES_LEN
+};
+
+/* The replies that are the same every time, see build_static_responses. */
+enum static_reply {
+    REPLY_LOGIN, REPLY_REDIRECT_TO_CHAT, REPLY_SET_COOKIE, REPLY_400,
+    REPLY_403, REPLY_404, REPLY_408, REPLY_429, REPLY_503,
+    STATIC_REPLIES_LEN
+};
+
+/* What a connection's deadline is for, see set_timeout. */
+enum timeout_kind {
+    TIMEOUT_NONE, TIMEOUT_HEADER, TIMEOUT_BODY, TIMEOUT_WRITE, TIMEOUT_IDLE
+};
+
+/* What a rate limit bucket counts, see rate_limit. */
+enum limit_kind {
+    LIMIT_NONE, LIMIT_USER_POSTS, LIMIT_ADDRESS_POSTS, LIMIT_ADDRESS_LOGINS,
+    LIMIT_KINDS_LEN
+};
+
+/* Readiness interests, as passed to loop_watch(). */
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+
+/* A part of the request, as an offset from the start of the request. */
+struct slice {
+    size_t start;
+    size_t len;
+};
+
+/* A reference counted buffer, which can be appended to in place while
+ * others are reading the part that was there before. When it runs out of
+ * room, it's replaced by a bigger copy, and the old one is freed when the
+ * last reader lets go of it. */
+struct shared_buf {
+    int refs;
+    size_t len;
+    size_t allocated_len;
+    char *data;
+};
+
+/* A part of a response waiting to be sent. Owned data is freed once sent,
+ * shared data is released, and the rest is expected to outlive the
+ * response. */
+struct out_chunk {
+    char *data;
+    size_t len;
+    int owned;
+    struct shared_buf *shared;
+};
+
+/* The response being sent, as a list of chunks written out with writev.
+ * The cursor remembers how far along the sending is, so a partial write is
+ * continued exactly where it stopped. */
+struct out_queue {
+    struct out_chunk *chunks;
+    int chunks_len;
+    int allocated_chunks_len;
+    int cursor; /* The chunk that's being sent. */
+    size_t offset; /* How much of the cursor's chunk has been sent. */
+    char head[256]; /* Room for the status line and headers. */
+    char *scratch; /* Room for rendered bodies, reused between responses. */
+    size_t allocated_scratch_len;
+};
+
+/* A connection's deadline, linked into one of its worker's timer wheel
+ * slots. The slots' list heads are timers too, with no connection. */
+struct timer {
+    struct timer *next; /* NULL if the timer isn't on the wheel. */
+    struct timer *prev;
+    time_t deadline;
+    struct connection_ctx *ctx;
+};
+
+/* A hierarchical timer wheel with one second ticks. The first level has a
+ * slot for each of the next RISKYCHAT_WHEEL_SLOTS seconds, the second a
+ * slot for each of the next RISKYCHAT_WHEEL_SLOTS spans of that many
+ * seconds, which are moved down to the first level as they come up.
+ * Deadlines further out than that wait in the farthest slot and are put
+ * back when it comes up. Adding, moving and removing a timer are O(1), and
+ * a tick only looks at the timers that are due, so the deadlines cost
+ * nothing no matter how many connections are open. */
+struct timer_wheel {
+    time_t now; /* The last second that has been expired. */
+    struct timer slots[2][RISKYCHAT_WHEEL_SLOTS];
+};
+
+/* A complete response, from the status line to the end of the body. */
+struct static_response {
+    char *data;
+    size_t len;
+};
+
+/* Fixed-size request buffers, recycled between requests and connections. A
+ * connection only holds one while it has a request in it. A free buffer
+ * has the pointer to the next free one at its start. Requests that don't
+ * fit get a bigger buffer of their own, which is freed once they're done.
+ * There are never more buffers than connections, so the memory used is
+ * bounded, and the counts are printed on shutdown. */
+struct buffer_pool {
+    char *free;
+    int allocated;
+    int in_use;
+    int peak_in_use;
+    unsigned long oversized; /* How many requests needed a bigger buffer. */
+};
+
+/* Durations in log-linear buckets: each power of two microseconds is split
+ * into four equal buckets, so any duration falls into a bucket at most 25%
+ * wide, from a microsecond up to a minute, and the last bucket takes
+ * whatever is longer than that. See histogram_bucket. */
+struct histogram {
+    unsigned long buckets[RISKYCHAT_HISTOGRAM_BUCKETS];
+    unsigned long count;
+    double sum; /* In seconds. */
+};
+
+/* A request, as it goes into the access log. */
+struct access_record {
+    time_t time;
+    unsigned long addr;
+    int user_id;
+    enum http_method method;
+    enum resource resource;
+    enum status_code status;
+    unsigned long bytes; /* Of the response. */
+    double seconds; /* From the first byte of the request to the last sent. */
+};
+
+/* A worker's access log records waiting to be written out. The worker adds
+ * to records, and the log's writer swaps it with spare when it comes by to
+ * write them, so neither waits on the other for longer than that. Records
+ * that don't fit in the meantime are dropped, and counted. */
+struct access_buffer {
+    struct access_record *records; /* NULL if there's no access log. */
+    struct access_record *spare;
+    int len;
+    unsigned long dropped;
+#ifdef RISKYCHAT_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+/* A worker's counters, only ever written by the worker itself, so counting
+ * is just an increment. /metrics adds up every worker's counters without
+ * locking them, so a scrape can be a request or so behind, which is fine
+ * for monitoring. The connections by stage are tallied once per tick. */
+struct metrics {
+    unsigned long requests[RESOURCES_LEN][METHODS_LEN][STATUS_CODES_LEN];
+    unsigned long accepted;
+    unsigned long rejected; /* Connections turned away at accept. */
+    unsigned long access_dropped; /* Records the access log had no room for. */
+    double bytes_in; /* Doubles, so they don't wrap at 4 GiB anywhere. */
+    double bytes_out;
+    int stages[6];
+    struct histogram latency[LATENCY_STAGES_LEN];
+    /* How long a pass of the event loop takes, smoothed, and whether
+     * requests outside of sessions are being turned away because of it. */
+    double loop_lag;
+    int shedding;
 };
 
 struct connection_ctx {
     int connect_fd;
-    char *buffer;
+    unsigned long peer_addr; /* The client's IPv4 address. */
+    int index; /* Position in the connections array, for O(1) removal. */
+    int events; /* The EVENT_* flags this connection is waiting on. */
+    struct connection_ctx *next_free; /* The next free slot in the slab. */
+    struct buffer_pool *pool;
+    struct metrics *metrics;
+    struct access_buffer *access;
+    char *buffer; /* From the pool if buffer_len is RISKYCHAT_BUFFER_SIZE. */
     size_t buffer_len;
     size_t read_len;
-    size_t written_len;
+    /* Where the current request starts in the buffer, anything before it
+     * belongs to requests that have already been responded to. */
+    size_t request_start;
+    /* The parser state, relative to request_start: parse_len is the end of
+     * the last complete line, scan_len how far the next line has been
+     * searched for its LF. */
+    size_t parse_len;
+    size_t scan_len;
+    struct slice target; /* The path, without the query. */
+    struct slice query;
+    size_t body_start;
+    struct out_queue out;
     int user_id;
+    /* 0: request line, 1: headers, 2: body, 3: respond, 4: send response
+     * (once wal_record is synced), 5: streaming events. */
     int stage;
     enum http_method method;
     enum resource requested_resource;
     size_t expected_content_length;
+    int keep_alive; /* Whether to read another request after this one. */
+    int accept_gzip; /* Whether the response can be gzipped. */
+    int requests_handled;
+    enum status_code status; /* Of the response being sent. */
+    size_t response_len;
+    double request_time; /* When the request's first bytes were read. */
+    double stage_start; /* When the current timed stage started. */
+    /* The deadline for the current stage, and which request it was set
+     * for, so that a new request gets a new deadline. */
+    struct timer timer;
+    enum timeout_kind timeout;
+    int timeout_request;
+    unsigned long last_event_id; /* From Last-Event-ID, 0 if not given. */
+    /* When streaming, the last post sent whole, how much of the next one has
+     * been sent, and how much of a heartbeat is still to be sent. */
+    unsigned long event_seq;
+    size_t event_offset;
+    size_t heartbeat_len;
+    int subscriber_index; /* Position in the subscribers array, or -1. */
+    /* The write-ahead log record the response waits for, 0 if none, and
+     * whether the connection is in the committing array. */
+    unsigned long wal_record;
+    int committing;
 };
 
+/* A user slot. Logged in users are also in a hash bucket by name, and in a
+ * list ordered by refresh_time. */
 struct user {
-    char *name;
+    char *name; /* NULL if the slot is free. */
     time_t refresh_time;
+    /* The next user in the same bucket, or the next free slot. */
+    int hash_next;
+    int older; /* The neighbours in the refresh order, 0 at the ends. */
+    int newer;
+    int logged_out; /* Whether a sweep has found the user expired. */
+};
+
+/* The users by id, with a hash index by name. Everyone gets the same
+ * RISKYCHAT_TIMEOUT, so the users also expire in the order they were last
+ * refreshed: refreshing moves a user to the newest end of the list, and the
+ * oldest end is the next to expire. That makes logging in, checking a name
+ * and refreshing constant time, no matter how many users there are. The
+ * same order lets the users still logged in be counted as they go: a sweep
+ * walks from where it last stopped towards the newest end, past the users
+ * that have expired since, and refreshing puts a user back in front of it.
+ * Id 0 is never used, it means "no user". */
+struct user_table {
+    struct user *users;
+    int users_len; /* Slots handed out so far, including 0. */
+    int allocated_users_len;
+    int max_users;
+    int *buckets; /* The first user in each bucket, or 0. */
+    unsigned long buckets_len; /* A power of two. */
+    int oldest;
+    int newest;
+    int free; /* The first free slot, the rest follow through hash_next. */
+    int len; /* Users with a name, expired or not. */
+    int logged_in; /* Users not found expired by a sweep. */
+    int sweep; /* Where the next sweep starts, 0 if it has reached the end. */
+};
+
+/* A block of post text. Blocks are never moved or resized, so the posts can
+ * point straight into them. */
+struct arena_block {
+    struct arena_block *next;
+    size_t len;
+    size_t allocated_len;
+    char *data;
+};
+
+/* A post in the post log. The name and content are in the log's arena. */
+struct post {
+    unsigned long seq;
+    time_t time;
+    int author_id;
+    char *name;
+    size_t name_len;
+    char *content;
+    size_t content_len;
+    struct arena_block *block; /* The arena block with the name and content. */
+    size_t rendered_len; /* The length of the post in the render cache. */
+    /* The post as a server-sent event, also in the log's arena, and how many
+     * bytes of events came before it. */
+    char *event;
+    size_t event_len;
+    unsigned long event_start;
+};
+
+/* The log of the newest posts: the text goes into arena blocks, and the
+ * records into a fixed-size ring, oldest first from head. Old posts are
+ * removed from the front, and arena blocks are freed once none of the posts
+ * in the ring point into them. */
+struct post_log {
+    struct arena_block *first_block;
+    struct arena_block *last_block;
+    struct post *posts;
+    unsigned long head;
+    unsigned long posts_len;
+    unsigned long allocated_posts_len;
+    unsigned long first_seq; /* The sequence number of the oldest post. */
+    size_t text_len; /* Bytes of names and contents in the ring. */
+    size_t arena_len; /* Bytes allocated for arena blocks. */
+    unsigned long events_len; /* Bytes of events rendered, ever. */
+};
+
+/* How many posts are kept around, the limits are checked whenever a post is
+ * added, and the age once a second. Zero means no limit. */
+struct retention {
+    unsigned long max_posts;
+    size_t max_bytes;
+    long max_age;
+};
+
+/* The "<post>...</post>" elements of the chat page, rendered once when each
+ * post is added. A page view sends this as-is between the static head and
+ * tail of the page. Removing the oldest post just moves start past it, and
+ * the dropped bytes are left behind when the buffer is next replaced. */
+struct render_cache {
+    struct shared_buf *posts;
+    size_t start;
+};
+
+/* The deflate window, and the size of the compressor's match index. */
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 13
+#define DEFLATE_MAX_CHAIN 16
+
+/* Bits on their way into a deflate stream, which is written least
+ * significant bit first. Whole bytes go into data, the rest wait in bits. */
+struct bit_buffer {
+    char *data;
+    size_t len;
+    size_t allocated_len;
+    unsigned long bits;
+    int bits_len;
 };
 
-static int connect_socket(char *addr, char *port);
+/* A deflate compressor: LZ77 over the last 32 KiB with hash chains, and the
+ * fixed Huffman codes, which do fine on HTML and don't need to be sent
+ * along. The input can be fed in a piece at a time, and the matches are
+ * remembered by offset from the start of the input, since the caller's
+ * buffer may move between pieces. */
+struct deflater {
+    struct bit_buffer out;
+    unsigned long head[1 << DEFLATE_HASH_BITS]; /* Latest offset + 1. */
+    unsigned long prev[DEFLATE_WINDOW]; /* The one before, by offset. */
+};
+
+/* A sealed segment of the compressed posts: where it ends in the posts,
+ * counting every byte ever rendered, and in the compressed data. */
+struct gzip_segment {
+    unsigned long raw_end;
+    size_t end;
+};
+
+/* The posts of the chat page, gzipped, for clients that accept that. They
+ * are compressed in segments of about RISKYCHAT_GZIP_SEGMENT bytes, which
+ * only refer back within themselves. A new post is compressed into the last,
+ * open segment as a block of its own, and the open segment's last few bits
+ * are sent along with the page's tail, in a final block made for each
+ * response. When old posts are dropped, only what's left of the first
+ * segment is compressed again, and sent instead of the original. The CRC-32
+ * for the trailer is kept up to date as posts come and go. */
+struct gzip_cache {
+    struct shared_buf *data; /* The segments, back to back. */
+    size_t start; /* Where the first segment starts in data. */
+    struct shared_buf *first; /* The first segment, trimmed, or NULL. */
+    struct gzip_segment *segments; /* All but the open one. */
+    int segments_len;
+    int allocated_segments_len;
+    /* Offsets in the posts, counting every byte ever rendered: where the
+     * first and open segments start, where the page starts after the
+     * dropped posts, and where it ends. */
+    unsigned long raw_first;
+    unsigned long raw_open;
+    unsigned long raw_dropped;
+    unsigned long raw_len;
+    unsigned long crc; /* Of the posts on the page. */
+    /* Compressing the open segment, made on the first post, and let go of
+     * when the room goes quiet. The first segment is trimmed with
+     * DEFLATE_SCRATCH, so idle rooms hold on to no compressor at all. */
+    struct deflater *open;
+    /* The gzip header and the page's head, compressed. */
+    struct shared_buf *head;
+    unsigned long head_crc;
+};
+
+/* A chat room: its posts, the page rendered from them, plain and gzipped,
+ * and its own retention limits, behind its own lock, so a busy room doesn't
+ * make the others' pages any bigger or slower. The lobby at / is one, and
+ * the rest are made when someone first posts in /r/<name>. The page's head
+ * has the room's name in it, and is shared, so a response can keep sending
+ * it after the room is gone. */
+struct room {
+    char name[RISKYCHAT_ROOM_NAME_LEN + 1]; /* "" for the lobby. */
+    struct post_log log;
+    struct render_cache cache;
+    struct gzip_cache gzip;
+    struct retention retention;
+    struct shared_buf *head;
+    time_t last_active; /* When it was last looked up. */
+    int refs; /* How many are using it, it's only evicted at 0. */
+    struct room *next; /* The next room in the same bucket. */
+#ifdef RISKYCHAT_THREADS
+    pthread_rwlock_t lock;
+#endif
+};
+
+/* The rooms other than the lobby, by name. Looking one up pins it with a
+ * reference, so the room can be used without holding ROOMS_LOCK, and rooms
+ * that have been idle for long enough are evicted. */
+struct room_table {
+    struct room *buckets[RISKYCHAT_ROOM_BUCKETS];
+    int len;
+};
+
+/* The optional on-disk archive of posts that have fallen out of the post
+ * log. The log file has the posts, the index file has a fixed-width offset
+ * into the log for each post, so any page can be found with one seek. */
+struct archive {
+    char *log_path;
+    char *index_path;
+    FILE *log;
+    FILE *index;
+};
+
+enum sync_policy {
+    SYNC_BATCHED, SYNC_ALWAYS, SYNC_NONE
+};
+
+/* The optional write-ahead log in --data-dir, replayed on startup. Each new
+ * user and post is appended to buf as a record, and written out by the next
+ * worker to commit, so everything logged during a tick shares one write and
+ * one fsync. Records are counted, so a response can wait until its own
+ * record is on disk. Each record is framed by its length and a CRC-32 of
+ * it, so a torn write at the end is noticed and cut off. */
+struct wal {
+    int fd; /* -1 if there's no log. */
+    enum sync_policy sync;
+    char *dir;
+    unsigned long generation; /* Which log file is being appended to. */
+    char *buf; /* Records waiting to be written. */
+    size_t len;
+    size_t allocated_len;
+    char *spare; /* The other buffer, being written out by a commit. */
+    size_t allocated_spare_len;
+    unsigned long appended; /* Records appended, ever. */
+    unsigned long synced; /* Records written (and synced), ever. */
+};
+
+/* The sizes of a snapshot's header and index entries, see snapshot_build. */
+#define SNAPSHOT_HEADER_LEN 64
+#define SNAPSHOT_POST_LEN 40
+#define SNAPSHOT_USER_LEN 16
+
+/* Snapshots of the users and posts, which let the logs before them be
+ * deleted. Taking one starts a new log generation, and the snapshot is then
+ * built and written out by a background thread. On startup the snapshot is
+ * mapped into memory, and the posts point straight into it, so loading takes
+ * time proportional to the index, not the text, and only the parts that are
+ * actually read are paged in. The logs from its generation on are replayed
+ * on top of it. */
+struct snapshot {
+    long interval; /* Seconds between snapshots, 0 for only on shutdown. */
+    time_t last_time;
+    unsigned long last_appended; /* WAL.appended at the last snapshot. */
+    char *map; /* The snapshot loaded on startup, or NULL. */
+    size_t map_len;
+    char *image; /* The snapshot being written, and its generation. */
+    size_t image_len;
+    unsigned long generation;
+    int writing; /* Whether the snapshot's thread needs to be joined. */
+    int written; /* Set by the writer thread when it's done. */
+#ifdef RISKYCHAT_THREADS
+    pthread_t thread;
+#endif
+};
+
+/* A token bucket: requests take a token each, and are over the limit when
+ * there's none left. The tokens are only refilled when the bucket is
+ * looked at, by how long it has been since the last time. */
+struct rate_bucket {
+    enum limit_kind kind; /* LIMIT_NONE if the slot is free. */
+    unsigned long id; /* A user id or an address, depending on the kind. */
+    double tokens;
+    double last; /* When the tokens were refilled, from monotonic_time. */
+};
+
+/* How fast a kind of bucket refills, and how many tokens it holds. */
+struct rate_limit {
+    double per_second; /* 0 if there's no limit. */
+    double burst;
+};
+
+/* The access log: a line of JSON per request, batched up in the workers'
+ * access buffers and written out by a thread of its own, or by the first
+ * worker once a second where there are no threads. */
+struct access_log {
+    char *path;
+    FILE *file;
+    char *text; /* The lines being written, reused between batches. */
+    size_t allocated_text_len;
+    time_t time; /* The second formatted in time_text. */
+    char time_text[32];
+#ifdef RISKYCHAT_THREADS
+    int running;
+    pthread_t thread;
+#endif
+};
+
+/* Wraps epoll on Linux, and poll() (or WSAPoll) elsewhere. The poll()
+ * variant has no kernel-side registrations, so it rebuilds its pollfd array
+ * from the connections on every wait, which is fine at these sizes. */
+struct event_loop {
+    int listen_fd;
+    int wake_fd; /* Readable when there's something to broadcast, or -1. */
+    int accepting; /* Whether listen_fd is currently being waited on. */
+#ifdef RISKYCHAT_USE_EPOLL
+    int epoll_fd;
+    struct epoll_event events[RISKYCHAT_MAX_EVENTS];
+#else
+    struct pollfd *pollfds;
+    int pollfds_len;
+#endif
+};
+
+/* Each worker owns a listening socket (shared with the others through
+ * SO_REUSEPORT, so the kernel balances new connections between them), an
+ * event loop and the connections accepted on that socket. The connections
+ * live in a slab allocated up front, and keep their output queue's arrays
+ * when they're reused, so accepting and closing doesn't allocate. Their
+ * deadlines are kept in a timer wheel. The connections streaming /events
+ * are also listed in subscribers, and the worker is woken up through its
+ * wake pipe when there's a new post to send them. */
+struct worker {
+    int id;
+    int listen_fd;
+    int max_connections;
+    struct event_loop loop;
+    struct connection_ctx **connections;
+    int connections_len;
+    struct connection_ctx *slab;
+    struct connection_ctx *free_ctx;
+    struct buffer_pool pool;
+    struct metrics metrics;
+    struct access_buffer access;
+    struct timer_wheel wheel;
+    struct connection_ctx **subscribers;
+    int subscribers_len;
+    /* The connections with responses waiting for the write-ahead log. */
+    struct connection_ctx **committing;
+    int committing_len;
+    int wake_fds[2];
+    time_t last_heartbeat;
+#ifdef RISKYCHAT_THREADS
+    pthread_t thread;
+#endif
+};
+
+static int connect_socket(char *addr, char *port, int reuse_port);
+static int set_nonblocking(int fd);
+static int socket_would_block(void);
+static double monotonic_time(void);
+static int loop_init(struct event_loop *loop, int listen_fd, int wake_fd);
+static void loop_free(struct event_loop *loop);
+static void loop_set_accepting(struct event_loop *loop, int accepting);
+static int loop_watch(struct event_loop *loop, struct connection_ctx *ctx,
+                      int events);
+static int loop_wait(struct event_loop *loop,
+                     struct connection_ctx **connections, int connections_len,
+                     struct connection_ctx **ready, int *accept_ready,
+                     int *woken, int timeout_ms);
+static void *run_worker(void *arg);
+static struct shared_buf *shared_buf_new(size_t allocated_len);
+static void shared_buf_unref(struct shared_buf *buf);
+static void pool_free(struct buffer_pool *pool);
+static void post_log_init(struct post_log *log, unsigned long max_posts);
+static void post_log_free(struct post_log *log);
+static struct post *post_log_get(struct post_log *log, unsigned long i);
+static void user_table_init(struct user_table *table, int max_users);
+static void user_table_free(struct user_table *table);
+static void user_table_sweep(struct user_table *table, time_t now);
+static int archive_open(struct archive *archive, char *path);
+static void archive_close(struct archive *archive);
+static int wal_open(struct wal *wal, char *dir);
+static int access_log_open(struct access_log *log, char *path);
+static void access_log_close(struct access_log *log);
+static void access_log_flush(struct access_log *log);
+#ifdef RISKYCHAT_THREADS
+static void *access_log_run(void *arg);
+#endif
+static void wal_close(struct wal *wal);
+static void wal_commit(struct wal *wal);
+static int wal_rotate(struct wal *wal);
+static void snapshot_tick(struct snapshot *snapshot, time_t now);
+static void snapshot_take(struct snapshot *snapshot, int background);
+static void snapshot_finish(struct snapshot *snapshot);
+static void snapshot_unmap(struct snapshot *snapshot);
+static void crc32_init(void);
+static void deflate_init(void);
+static void room_init(struct room *room, char *name, size_t name_len);
+static void room_free(struct room *room);
+static struct room *room_open(char *name, size_t name_len, int create);
+static void room_close(struct room *room);
+static unsigned long hash_name(char *name);
+static void gzip_cache_init(struct gzip_cache *cache, struct shared_buf *head);
+static void gzip_cache_free(struct gzip_cache *cache);
+static void deflater_free(struct deflater *d);
+static void build_static_responses(void);
+static void free_static_responses(void);
+static void expire_posts(void);
+static void expire_rooms(time_t now);
 static int handle_connection(struct connection_ctx *ctx);
+static int stream_events(struct connection_ctx *ctx, int heartbeat);
+static void settle_connection(struct worker *worker,
+                              struct connection_ctx *ctx, int result);
+static void broadcast_events(struct worker *worker, int heartbeat);
+static void wake_workers(void);
+static void commit_connections(struct worker *worker);
+static void reset_connection(struct connection_ctx *ctx);
+static void wheel_init(struct timer_wheel *wheel, time_t now);
+static void set_timeout(struct worker *worker, struct connection_ctx *ctx,
+                        enum timeout_kind kind);
+static void expire_connections(struct worker *worker, time_t now);
+static void reject_connection(struct worker *worker, int connect_fd);
+static void tally_stages(struct worker *worker);
 static void cleanup_connection(struct connection_ctx *ctx);
 static void remove_connection(struct connection_ctx **contexts,
-                       int *contexts_len, int i);
+                              int *contexts_len, int i);
+static void drop_connection(struct worker *worker,
+                            struct connection_ctx *ctx);
+static struct connection_ctx *alloc_connection(struct worker *worker,
+                                               int connect_fd);
+static void free_connection(struct worker *worker,
+                            struct connection_ctx *ctx);
 #ifndef _WIN32
 static void handle_terminate(int sig);
+static void handle_hangup(int sig);
 #endif
 static void printf_clear_line(void);
 static void print_usage(char *program_name);
@@ -104,21 +813,126 @@ static void print_usage(char *program_name);
 
 /* main: The main function */
 
-static int SERVER_TERMINATED = 0;
-static struct user *USERS;
-static int USERS_LEN;
-static char *POSTS;
-static int POSTS_LEN;
+static volatile sig_atomic_t SERVER_TERMINATED = 0;
+/* Set on SIGHUP, to have the access log opened again after it's rotated. */
+static volatile sig_atomic_t ACCESS_LOG_REOPEN = 0;
+static int KEEPALIVE_REQUESTS = RISKYCHAT_KEEPALIVE_REQUESTS;
+static int KEEPALIVE_TIMEOUT = RISKYCHAT_KEEPALIVE_TIMEOUT;
+static double SHED_LAG = RISKYCHAT_SHED_LAG_MS / 1000.0;
+static struct user_table USERS;
+/* The main room at /, the only one that's logged, archived and streamed. */
+static struct room LOBBY;
+static struct room_table ROOMS;
+static struct retention RETENTION = {
+    RISKYCHAT_MAX_POSTS, RISKYCHAT_MAX_POST_BYTES, 0
+};
+/* The per-address limits are looser, a few users can share an address. */
+static struct rate_limit LIMITS[LIMIT_KINDS_LEN] = {
+    { 0, 0 },
+    { RISKYCHAT_POST_LIMIT / 60.0, RISKYCHAT_LIMIT_BURST },
+    { RISKYCHAT_POST_LIMIT * 4 / 60.0, RISKYCHAT_LIMIT_BURST * 4 },
+    { RISKYCHAT_LOGIN_LIMIT / 60.0, RISKYCHAT_LIMIT_BURST }
+};
+/* The buckets, in sets of RISKYCHAT_LIMIT_WAYS, see rate_bucket_get. */
+static struct rate_bucket RATE_BUCKETS[RISKYCHAT_LIMIT_BUCKETS];
+static struct archive ARCHIVE;
+static struct wal WAL = { -1 };
+static struct access_log ACCESS_LOG;
+static struct snapshot SNAPSHOT = { RISKYCHAT_SNAPSHOT_INTERVAL };
+static struct worker *WORKERS;
+static int WORKERS_LEN;
+/* By reply, HEAD or not, keep-alive or not, and gzipped or not. */
+static struct static_response STATIC_RESPONSES[STATIC_REPLIES_LEN][2][2][2];
+/* Room for rendering events, only used with the posts write-locked. */
+static char *EVENT_SCRATCH;
+static size_t EVENT_SCRATCH_LEN;
+/* The compressor every room trims its page with, see gzip_cache_trim. */
+static struct deflater *DEFLATE_SCRATCH;
+
+/* The chat state is shared between the workers. Posts are read on every page
+ * render and only written when someone posts, so each room's posts are
+ * behind a rwlock of the room's own. When both are needed, USERS_LOCK is
+ * taken first. ROOMS_LOCK guards the room table and the rooms' refs, and
+ * is never held while waiting for a room. WAL_LOCK guards the
+ * write-ahead log's buffer and counters, and is taken last. COMMIT_LOCK is
+ * held while writing out the log, so appending doesn't wait for the disk.
+ * SNAPSHOT_LOCK only guards SNAPSHOT.written, and LIMITS_LOCK the rate limit
+ * buckets, neither is held with any of the others. Each worker's access
+ * buffer has a lock of its own, also never held with the others. REFS_LOCK
+ * guards the reference counts of the shared buffers. A page view takes it
+ * to pin the room's page, plain or gzipped, while holding the room's read
+ * lock, and again to let go of it once it's sent, so it's held for just the
+ * count, and no other lock is ever taken inside it. DEFLATE_LOCK guards
+ * DEFLATE_SCRATCH, and is likewise taken with a room write-locked, and
+ * nothing inside it. */
+#ifdef RISKYCHAT_THREADS
+static pthread_mutex_t USERS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t REFS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t WAL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t COMMIT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t SNAPSHOT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t LIMITS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ROOMS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t DEFLATE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+#define room_read_lock(room) pthread_rwlock_rdlock(&(room)->lock)
+#define room_write_lock(room) pthread_rwlock_wrlock(&(room)->lock)
+#define room_unlock(room) pthread_rwlock_unlock(&(room)->lock)
+#define rooms_lock() pthread_mutex_lock(&ROOMS_LOCK)
+#define rooms_unlock() pthread_mutex_unlock(&ROOMS_LOCK)
+#define users_lock() pthread_mutex_lock(&USERS_LOCK)
+#define users_unlock() pthread_mutex_unlock(&USERS_LOCK)
+#define refs_lock() pthread_mutex_lock(&REFS_LOCK)
+#define refs_unlock() pthread_mutex_unlock(&REFS_LOCK)
+#define wal_lock() pthread_mutex_lock(&WAL_LOCK)
+#define wal_unlock() pthread_mutex_unlock(&WAL_LOCK)
+#define commit_lock() pthread_mutex_lock(&COMMIT_LOCK)
+#define commit_unlock() pthread_mutex_unlock(&COMMIT_LOCK)
+#define snapshot_lock() pthread_mutex_lock(&SNAPSHOT_LOCK)
+#define snapshot_unlock() pthread_mutex_unlock(&SNAPSHOT_LOCK)
+#define limits_lock() pthread_mutex_lock(&LIMITS_LOCK)
+#define limits_unlock() pthread_mutex_unlock(&LIMITS_LOCK)
+#define access_lock(buffer) pthread_mutex_lock(&(buffer)->lock)
+#define access_unlock(buffer) pthread_mutex_unlock(&(buffer)->lock)
+#define deflate_lock() pthread_mutex_lock(&DEFLATE_LOCK)
+#define deflate_unlock() pthread_mutex_unlock(&DEFLATE_LOCK)
+#else
+#define room_read_lock(room)
+#define room_write_lock(room)
+#define room_unlock(room)
+#define rooms_lock()
+#define rooms_unlock()
+#define users_lock()
+#define users_unlock()
+#define refs_lock()
+#define refs_unlock()
+#define wal_lock()
+#define wal_unlock()
+#define commit_lock()
+#define commit_unlock()
+#define snapshot_lock()
+#define snapshot_unlock()
+#define limits_lock()
+#define limits_unlock()
+#define access_lock(buffer)
+#define access_unlock(buffer)
+#define deflate_lock()
+#define deflate_unlock()
+#endif
+/* The lobby's posts are the ones most code is interested in. */
+#define posts_read_lock() room_read_lock(&LOBBY)
+#define posts_write_lock() room_write_lock(&LOBBY)
+#define posts_unlock() room_unlock(&LOBBY)
 
 int main(int argc, char **argv) {
-    int result, socket_fd, connect_fd, i;
-    int connections_len, allocated_conns_len;
-    size_t new_size;
-    char *addr, *port;
-    struct connection_ctx *connections, *new_connections;
+    int result, i, j, workers_len, positional_len;
+    long limit, limit_burst;
+    char *addr, *port, *positional[2], *end, *data_dir, *archive_path;
+    char *access_log_path;
+    struct worker *workers;
 
 #ifndef _WIN32
     struct sigaction sa;
+    sigset_t signals;
 #endif
 
 #ifdef _WIN32
@@ -132,27 +946,199 @@ int main(int argc, char **argv) {
     }
 #endif
 
-    if (argc == 1) {
+    workers_len = 1;
+    positional_len = 0;
+    data_dir = archive_path = access_log_path = NULL;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers_len = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || workers_len < 1 ||
+                workers_len > RISKYCHAT_MAX_WORKERS) {
+                fprintf(stderr, "--workers should be between 1 and %d\n",
+                        RISKYCHAT_MAX_WORKERS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--keepalive-requests") == 0 &&
+                   i + 1 < argc) {
+            KEEPALIVE_REQUESTS = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || KEEPALIVE_REQUESTS < 1) {
+                fprintf(stderr, "--keepalive-requests should be at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-posts") == 0 && i + 1 < argc) {
+            RETENTION.max_posts = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || RETENTION.max_posts < 1) {
+                fprintf(stderr, "--max-posts should be at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-post-bytes") == 0 &&
+                   i + 1 < argc) {
+            RETENTION.max_bytes = strtoul(argv[++i], &end, 10);
+            if (*end != '\0') {
+                fprintf(stderr, "--max-post-bytes should be a number\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-post-age") == 0 && i + 1 < argc) {
+            RETENTION.max_age = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || RETENTION.max_age < 0) {
+                fprintf(stderr, "--max-post-age should be at least 0\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--post-limit") == 0 && i + 1 < argc) {
+            limit = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || limit < 0) {
+                fprintf(stderr, "--post-limit should be at least 0\n");
+                return 1;
+            }
+            limit_burst = limit < RISKYCHAT_LIMIT_BURST ?
+                limit : RISKYCHAT_LIMIT_BURST;
+            LIMITS[LIMIT_USER_POSTS].per_second = limit / 60.0;
+            LIMITS[LIMIT_USER_POSTS].burst = limit_burst;
+            LIMITS[LIMIT_ADDRESS_POSTS].per_second = limit * 4 / 60.0;
+            LIMITS[LIMIT_ADDRESS_POSTS].burst = limit_burst * 4;
+        } else if (strcmp(argv[i], "--login-limit") == 0 && i + 1 < argc) {
+            limit = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || limit < 0) {
+                fprintf(stderr, "--login-limit should be at least 0\n");
+                return 1;
+            }
+            limit_burst = limit < RISKYCHAT_LIMIT_BURST ?
+                limit : RISKYCHAT_LIMIT_BURST;
+            LIMITS[LIMIT_ADDRESS_LOGINS].per_second = limit / 60.0;
+            LIMITS[LIMIT_ADDRESS_LOGINS].burst = limit_burst;
+        } else if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc) {
+            archive_path = argv[++i];
+        } else if (strcmp(argv[i], "--access-log") == 0 && i + 1 < argc) {
+            access_log_path = argv[++i];
+        } else if (strcmp(argv[i], "--data-dir") == 0 && i + 1 < argc) {
+            data_dir = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-interval") == 0 &&
+                   i + 1 < argc) {
+            SNAPSHOT.interval = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || SNAPSHOT.interval < 0) {
+                fprintf(stderr, "--snapshot-interval should be at least 0\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "batched") == 0) WAL.sync = SYNC_BATCHED;
+            else if (strcmp(argv[i], "always") == 0) WAL.sync = SYNC_ALWAYS;
+            else if (strcmp(argv[i], "none") == 0) WAL.sync = SYNC_NONE;
+            else {
+                fprintf(stderr, "--sync should be always, batched or none\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--keepalive-timeout") == 0 &&
+                   i + 1 < argc) {
+            KEEPALIVE_TIMEOUT = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || KEEPALIVE_TIMEOUT < 0) {
+                fprintf(stderr, "--keepalive-timeout should be at least 0\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shed-lag") == 0 && i + 1 < argc) {
+            limit = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || limit < 0) {
+                fprintf(stderr, "--shed-lag should be at least 0\n");
+                return 1;
+            }
+            SHED_LAG = limit / 1000.0;
+        } else if (argv[i][0] != '-' && positional_len < 2) {
+            positional[positional_len++] = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (positional_len == 0) {
         addr = RISKYCHAT_HOST;
         port = RISKYCHAT_PORT;
-    } else if (argc == 3) {
-        addr = argv[1];
-        port = argv[2];
+    } else if (positional_len == 2) {
+        addr = positional[0];
+        port = positional[1];
     } else {
         print_usage(argv[0]);
         return 1;
     }
+#ifndef RISKYCHAT_THREADS
+    if (workers_len > 1) {
+        fprintf(stderr, "--workers is not supported on this platform\n");
+        workers_len = 1;
+    }
+#endif
 
-    /* Creation of the TCP socket we will listen to HTTP connections on. */
-    socket_fd = connect_socket(addr, port);
-    if (socket_fd == -1) {
-        print_usage(argv[0]);
+    workers = malloc(workers_len * sizeof workers[0]);
+    if (workers == NULL) {
+        perror("error allocating the workers");
         return 1;
     }
-    printf("Started the Risky Chat server on http://%s:%s.\n", addr, port);
+    memset(workers, 0, workers_len * sizeof workers[0]);
+    for (i = 0; i < workers_len; i++) {
+        /* Creation of the TCP socket we will listen to HTTP connections on. */
+        workers[i].id = i;
+        workers[i].listen_fd = connect_socket(addr, port, workers_len > 1);
+        if (workers[i].listen_fd == -1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        /* Writing a byte into the wake pipe wakes up the worker's loop. */
+        workers[i].wake_fds[0] = workers[i].wake_fds[1] = -1;
+#ifndef _WIN32
+        if (pipe(workers[i].wake_fds) == -1 ||
+            set_nonblocking(workers[i].wake_fds[0]) == -1 ||
+            set_nonblocking(workers[i].wake_fds[1]) == -1) {
+            perror("error creating a wake pipe");
+            return 1;
+        }
+#endif
+        if (loop_init(&workers[i].loop, workers[i].listen_fd,
+                      workers[i].wake_fds[0]) == -1) {
+            return 1;
+        }
+        /* The connection array is allocated up front, it's just pointers. */
+        workers[i].max_connections = RISKYCHAT_MAX_CONNECTIONS / workers_len;
+        if (workers[i].max_connections < 1) workers[i].max_connections = 1;
+        workers[i].connections = malloc(workers[i].max_connections *
+                                        sizeof workers[i].connections[0]);
+        workers[i].subscribers = malloc(workers[i].max_connections *
+                                        sizeof workers[i].subscribers[0]);
+        workers[i].committing = malloc(workers[i].max_connections *
+                                       sizeof workers[i].committing[0]);
+        workers[i].slab = calloc(workers[i].max_connections,
+                                 sizeof workers[i].slab[0]);
+        if (workers[i].connections == NULL ||
+            workers[i].subscribers == NULL ||
+            workers[i].committing == NULL || workers[i].slab == NULL) {
+            perror("error allocating the connection array");
+            return 1;
+        }
+        if (access_log_path != NULL) {
+            workers[i].access.records =
+                malloc(2 * RISKYCHAT_ACCESS_LOG_RECORDS *
+                       sizeof workers[i].access.records[0]);
+            if (workers[i].access.records == NULL) {
+                perror("error allocating the access log buffers");
+                return 1;
+            }
+            workers[i].access.spare =
+                &workers[i].access.records[RISKYCHAT_ACCESS_LOG_RECORDS];
+#ifdef RISKYCHAT_THREADS
+            pthread_mutex_init(&workers[i].access.lock, NULL);
+#endif
+        }
+        wheel_init(&workers[i].wheel, time(NULL));
+        for (j = workers[i].max_connections - 1; j >= 0; j--) {
+            free_connection(&workers[i], &workers[i].slab[j]);
+        }
+    }
+    WORKERS = workers;
+    WORKERS_LEN = workers_len;
+    printf("Started the Risky Chat server on http://%s:%s", addr, port);
+    if (workers_len > 1) printf(" with %d workers", workers_len);
+    printf(".\n");
 
 #ifndef _WIN32
-    /* Setup interrupt handler. */
+    /* Setup interrupt handler. No SA_RESTART, so that the interrupt also
+     * wakes up the event loop from its wait. */
     sa.sa_handler = handle_terminate;
     sa.sa_flags = 0;
     sigemptyset(&sa.sa_mask);
@@ -165,96 +1151,260 @@ int main(int argc, char **argv) {
     if (sigaction(SIGTERM, &sa, NULL) == -1) {
         perror("could not set up a handler for SIGTERM");
     }
+    sa.sa_handler = handle_hangup;
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("could not set up a handler for SIGHUP");
+    }
 #endif
 
-    /* Let's not allocate anything before it's needed. */
-    allocated_conns_len = 0;
-    connections_len = 0;
-    connections = NULL;
-    USERS = NULL;
-    USERS_LEN = 1;
-    POSTS = malloc(1);
-    if (POSTS == NULL) {
-        perror("error allocating a single byte for posts");
+    crc32_init();
+    deflate_init();
+    build_static_responses();
+    user_table_init(&USERS, RISKYCHAT_MAX_USERS);
+    room_init(&LOBBY, "", 0);
+    /* The log is replayed before the archive is opened, so the posts that
+     * the replay drops again aren't archived twice. */
+    if (data_dir != NULL && wal_open(&WAL, data_dir) == -1) return 1;
+    if (archive_path != NULL && archive_open(&ARCHIVE, archive_path) == -1) {
+        return 1;
+    }
+    if (access_log_path != NULL &&
+        access_log_open(&ACCESS_LOG, access_log_path) == -1) {
         return 1;
     }
-    POSTS[0] = '\0';
-    POSTS_LEN = 0;
-
-    /* The main listening loop. */
-    while (!SERVER_TERMINATED) {
-        fflush(stdout);
-
-        for (i = 0; i < connections_len; i++) {
-            result = handle_connection(&connections[i]);
-            if (result == 0) {
-                remove_connection(&connections, &connections_len, i);
-                i--;
-            } else if (result == -1 &&
-#ifdef _WIN32
-                       WSAGetLastError() != 0 && WSAGetLastError() != WSAEWOULDBLOCK
-#else
-                       errno != EAGAIN && errno != EWOULDBLOCK
-#endif
-                ) {
-#ifdef _WIN32
-                fprintf(stderr, "error while handling connection: %d\n", WSAGetLastError());
-#else
-                perror("error while handling connection");
-#endif
-                cleanup_connection(&connections[i]);
-                remove_connection(&connections, &connections_len, i);
-                i--;
-            }
-        }
-
-        if (connections_len < RISKYCHAT_MAX_CONNECTIONS) {
-            connect_fd = accept(socket_fd, NULL, NULL);
-            if (connect_fd != INVALID_SOCKET) {
-                if (connections_len == allocated_conns_len) {
-                    allocated_conns_len++;
-                    new_size = allocated_conns_len * sizeof connections[0];
-                    new_connections = realloc(connections, new_size);
-                    if (new_connections == NULL) {
-                        perror("could not expand connection buffer");
-                        if (errno == ENOMEM) {
-                            continue;
-                        } else {
-                            return 1;
-                        }
-                    }
-                    connections = new_connections;
-                    if (RISKYCHAT_VERBOSE >= 1) {
-                        printf("connection buffer: %ld bytes\n", new_size);
-                    }
-                }
 
-                memset(&connections[connections_len], 0,
-                       sizeof connections[connections_len]);
-                connections[connections_len].connect_fd = connect_fd;
-                connections_len++;
-            }
+#ifdef RISKYCHAT_THREADS
+    /* The other workers run with the termination signals blocked, so they're
+     * delivered to this thread, and the others notice within a tick. */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    for (i = 1; i < workers_len; i++) {
+        result = pthread_create(&workers[i].thread, NULL,
+                                run_worker, &workers[i]);
+        if (result != 0) {
+            fprintf(stderr, "could not start worker %d: %s\n",
+                    i, strerror(result));
+            return 1;
+        }
+    }
+    if (ACCESS_LOG.file != NULL) {
+        result = pthread_create(&ACCESS_LOG.thread, NULL, access_log_run,
+                                &ACCESS_LOG);
+        if (result != 0) {
+            fprintf(stderr, "could not start the access log writer: %s\n",
+                    strerror(result));
+            return 1;
         }
+        ACCESS_LOG.running = 1;
     }
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+#endif
+
+    run_worker(&workers[0]);
 
     /* Resource cleanup. */
-    for (i = 0; i < connections_len; i++) {
-        cleanup_connection(&connections[i]);
+#ifdef RISKYCHAT_THREADS
+    for (i = 1; i < workers_len; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (ACCESS_LOG.running) pthread_join(ACCESS_LOG.thread, NULL);
+#endif
+    /* Whatever the writer didn't get to yet. */
+    if (ACCESS_LOG.file != NULL) access_log_close(&ACCESS_LOG);
+    /* A snapshot of everything makes the next startup quick. */
+    if (WAL.fd != -1) {
+        snapshot_finish(&SNAPSHOT);
+        if (WAL.appended != SNAPSHOT.last_appended) {
+            snapshot_take(&SNAPSHOT, 0);
+        }
+    }
+    for (i = 0; i < workers_len; i++) {
+        loop_free(&workers[i].loop);
+        close(workers[i].listen_fd);
+#ifndef _WIN32
+        close(workers[i].wake_fds[0]);
+        close(workers[i].wake_fds[1]);
+#endif
+        free(workers[i].connections);
+        free(workers[i].subscribers);
+        free(workers[i].committing);
+        for (j = 0; j < workers[i].max_connections; j++) {
+            free(workers[i].slab[j].out.chunks);
+            free(workers[i].slab[j].out.scratch);
+        }
+        free(workers[i].slab);
+        if (workers[i].access.records != NULL) {
+            /* The records and spare were allocated as one. */
+            if (workers[i].access.spare < workers[i].access.records) {
+                workers[i].access.records = workers[i].access.spare;
+            }
+            free(workers[i].access.records);
+#ifdef RISKYCHAT_THREADS
+            pthread_mutex_destroy(&workers[i].access.lock);
+#endif
+        }
+        if (RISKYCHAT_VERBOSE >= 1) {
+            printf_clear_line();
+            printf("\rWorker %d: %d request buffers (%d KiB), at most %d in "
+                   "use, %lu oversized requests.\n", i,
+                   workers[i].pool.allocated,
+                   workers[i].pool.allocated * RISKYCHAT_BUFFER_SIZE / 1024,
+                   workers[i].pool.peak_in_use, workers[i].pool.oversized);
+        }
+        pool_free(&workers[i].pool);
     }
-    close(socket_fd);
 #ifdef _WIN32
     /* Winsock2 cleanup. */
     WSACleanup();
 #endif
-    free(connections);
-    free(POSTS);
-    free(USERS);
+    free(workers);
+    room_free(&LOBBY);
+    expire_rooms(0);
+    free(EVENT_SCRATCH);
+    if (DEFLATE_SCRATCH != NULL) deflater_free(DEFLATE_SCRATCH);
+    user_table_free(&USERS);
+    archive_close(&ARCHIVE);
+    wal_close(&WAL);
+    free_static_responses();
+    snapshot_unmap(&SNAPSHOT);
     printf_clear_line();
     printf("\rGood night!\n");
 
     return EXIT_SUCCESS;
 }
 
+/* The event loop of a single worker, runs until the server is terminated. */
+static void *run_worker(void *arg) {
+    int connect_fd, i, ready_len, accept_ready, woken, accepted;
+    time_t last_sweep, now;
+    double busy_start;
+    struct worker *worker;
+    struct connection_ctx *ctx;
+    struct connection_ctx *ready[RISKYCHAT_MAX_EVENTS];
+    struct sockaddr_in peer;
+    socklen_t peer_len;
+#ifndef _WIN32
+    char drain[64];
+#endif
+
+    worker = arg;
+    last_sweep = worker->last_heartbeat = time(NULL);
+
+    /* Sleeps until something is readable or writable, and only touches the
+     * connections that are. Wakes up once per tick to check if it's time
+     * to stop. */
+    while (!SERVER_TERMINATED) {
+        /* Only the debugging output is printed while running. */
+        if (RISKYCHAT_VERBOSE >= 2) fflush(stdout);
+
+        ready_len = loop_wait(&worker->loop, worker->connections,
+                              worker->connections_len, ready, &accept_ready,
+                              &woken, RISKYCHAT_TICK_MS);
+        if (ready_len == -1) {
+            if (errno == EINTR) continue;
+            perror("error while waiting for events");
+            break;
+        }
+        busy_start = monotonic_time();
+
+        for (i = 0; i < ready_len; i++) {
+            ctx = ready[i];
+            settle_connection(worker, ctx, handle_connection(ctx));
+        }
+
+        if (woken) {
+#ifndef _WIN32
+            while (read(worker->wake_fds[0], drain, sizeof drain) > 0);
+#endif
+            broadcast_events(worker, 0);
+        }
+
+        /* Everything logged during this tick goes to disk in one go, and
+         * only then are the responses that depend on it sent. */
+        if (WAL.fd != -1) commit_connections(worker);
+
+        /* At capacity, connections are still accepted, but only to be told
+         * to come back later, which beats leaving them to time out in the
+         * backlog. A pass only takes so many, so that a flood of them can't
+         * keep the loop from the connections it already has. */
+        for (accepted = 0; accept_ready && accepted < RISKYCHAT_MAX_EVENTS;
+             accepted++) {
+            peer_len = sizeof peer;
+            connect_fd = accept(worker->listen_fd, (struct sockaddr *)&peer,
+                                &peer_len);
+            if (connect_fd == INVALID_SOCKET) {
+                if (!socket_would_block()) {
+                    perror("error while accepting a connection");
+                }
+                break;
+            }
+
+            if (set_nonblocking(connect_fd) == -1) {
+                perror("could not set up a new connection");
+                close(connect_fd);
+                continue;
+            }
+            if (worker->connections_len >= worker->max_connections) {
+                reject_connection(worker, connect_fd);
+                continue;
+            }
+            ctx = alloc_connection(worker, connect_fd);
+            ctx->peer_addr = (unsigned long)ntohl(peer.sin_addr.s_addr);
+            if (loop_watch(&worker->loop, ctx, EVENT_READ) == -1) {
+                perror("could not watch a new connection");
+                close(connect_fd);
+                free_connection(worker, ctx);
+                continue;
+            }
+            worker->connections[worker->connections_len++] = ctx;
+            worker->metrics.accepted++;
+            set_timeout(worker, ctx, TIMEOUT_HEADER);
+        }
+
+        /* Connections that have missed their deadlines are closed to make
+         * room, checked at most once a second. */
+        now = time(NULL);
+        if (now != last_sweep) {
+            last_sweep = now;
+            expire_connections(worker, now);
+            tally_stages(worker);
+            /* Only one worker needs to look after the posts. */
+            if (worker->id == 0) {
+                expire_posts();
+                expire_rooms(now);
+#ifndef RISKYCHAT_THREADS
+                if (ACCESS_LOG.file != NULL) access_log_flush(&ACCESS_LOG);
+#endif
+                if (WAL.fd != -1) snapshot_tick(&SNAPSHOT, now);
+            }
+            /* Without a wake pipe, this is also when new posts go out. */
+            broadcast_events(worker, now - worker->last_heartbeat >=
+                             RISKYCHAT_SSE_HEARTBEAT);
+        }
+
+        /* How long the pass kept new events waiting, on average over the
+         * last few. If that's too long, or the worker is nearly full, it
+         * starts shedding the requests that can most easily wait. */
+        worker->metrics.loop_lag +=
+            (monotonic_time() - busy_start - worker->metrics.loop_lag) / 8;
+        worker->metrics.shedding =
+            (SHED_LAG > 0 && worker->metrics.loop_lag > SHED_LAG) ||
+            worker->connections_len >=
+            worker->max_connections - worker->max_connections / 10;
+    }
+
+    for (i = 0; i < worker->connections_len; i++) {
+        cleanup_connection(worker->connections[i]);
+    }
+    worker->connections_len = 0;
+    worker->subscribers_len = 0;
+    worker->committing_len = 0;
+    return NULL;
+}
+
 
 /* responses: The static response bodies. */
 
@@ -275,9 +1425,11 @@ button{margin-top:8px;}\
 <button type=\"submit\">Login</button>\
 </form></body></html>\r\n";
 
+/* The head is a printf format, filled in with the room's title and path,
+ * see room_init. */
 static char static_response_chat_head[] = "\
 <!DOCTYPE html>\r\n\
-<html><head><meta charset=\"utf-8\"><title>Risky Chat</title>\
+<html><head><meta charset=\"utf-8\"><title>Risky Chat%s</title>\
 <style>html{\
 background-color:#EEEEE8;color:#222;\
 }\
@@ -291,7 +1443,7 @@ border-top:2px solid #DDD;\
 animation:f 0.2s;\
 }</style>\
 </head><body>\
-<form method=\"POST\" action=\"/post\">\
+<form method=\"POST\" action=\"%s/post\">\
 <input type=\"text\" id=\"content\" name=\"content\" autofocus>\
 <br>\
 <button>Post</button>\
@@ -300,9 +1452,44 @@ animation:f 0.2s;\
 
 static char static_response_chat_tail[] = "</chatbox></body></html>\r\n";
 
+static char static_response_archive_head[] = "\
+<!DOCTYPE html>\r\n\
+<html><head><meta charset=\"utf-8\"><title>Risky Chat archive</title>\
+<style>html{background-color:#EEEEE8;color:#222;}\
+chatbox{display:flex;flex-direction:column-reverse;}\
+name{font-weight:bold;}\
+nav a{margin-right:1em;}\
+post{margin:0;padding:4px;border-top:2px solid #DDD;}</style>\
+</head><body>\r\n";
+
+/* The headers of the event stream. There's no length, the stream just goes
+ * on until either side closes the connection. */
+static char static_response_events_head[] = "\
+HTTP/1.1 200 OK\r\n\
+Connection: close\r\n\
+Content-Type: text/event-stream\r\n\
+Cache-Control: no-store\r\n\
+\r\n";
+
+/* An SSE comment, sent now and then so proxies don't time out the stream,
+ * and so that a dead subscriber is noticed. */
+static char static_event_heartbeat[] = ":\n\n";
+
 static char static_response_400[] = "\
 400 Bad Request\r\n";
 
+static char static_response_403[] = "\
+403 Forbidden\r\n";
+
+static char static_response_408[] = "\
+408 Request Timeout\r\n";
+
+static char static_response_429[] = "\
+429 Too Many Requests\r\n";
+
+static char static_response_503[] = "\
+503 Service Unavailable\r\n";
+
 static char static_response_404[] = "\
 <!DOCTYPE html>\r\n\
 <html><head>\r\n\
@@ -313,408 +1500,4019 @@ static char static_response_404[] = "\
 </body></html>\r\n";
 
 
-/* privfuncs: Functions used by the functions used in main(). */
-
-/* Reads from the given file descriptor, until a newline (LF) is encountered.
- * The return value is 0 if a line was read in entirety, -1 if not.
- * This should keep getting called until it returns 0 to get the entire line. */
-static ssize_t read_line(int fd, char **buffer, size_t *buffer_len,
-                         size_t *string_len) {
-    ssize_t read_bytes = 0;
+/* parser: The incremental HTTP request parser. */
 
-    for (;;) {
-        if (*string_len >= *buffer_len) {
-            *buffer_len += 1024;
-            *buffer = realloc(*buffer, *buffer_len);
-            if (*buffer == NULL) {
-                perror("error when stretching line buffer");
-                exit(EXIT_FAILURE);
-            }
+/* Returns 1 if the len bytes at s match the lowercase string lower, ignoring
+ * the case of s. */
+static int eq_nocase(char *s, size_t len, char *lower) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (lower[i] == '\0' || tolower((unsigned char)s[i]) != lower[i]) {
+            return 0;
         }
+    }
+    return lower[len] == '\0';
+}
+
+/* Returns 1 if the lowercase string lower appears in the len bytes at s,
+ * ignoring the case of s. */
+static int contains_nocase(char *s, size_t len, char *lower) {
+    size_t i, lower_len;
+    lower_len = strlen(lower);
+    for (i = 0; i + lower_len <= len; i++) {
+        if (eq_nocase(&s[i], lower_len, lower)) return 1;
+    }
+    return 0;
+}
+
+/* Parses a non-negative decimal number. Returns -1 if there's anything else
+ * than digits, or if the number is larger than max. */
+static long parse_number(char *s, size_t len, long max) {
+    long number;
+    size_t i;
+    if (len == 0) return -1;
+    number = 0;
+    for (i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+        number = number * 10 + (s[i] - '0');
+        if (number > max) return -1;
+    }
+    return number;
+}
 
-        read_bytes = recv(fd, &(*buffer)[*string_len], 1, 0);
-        if (read_bytes == 0) {
+/* Returns the length of the room name at the start of s: letters, digits,
+ * '-' and '_', as many as there are. */
+static size_t room_name_len(char *s, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (!((s[i] >= 'a' && s[i] <= 'z') || (s[i] >= 'A' && s[i] <= 'Z') ||
+              (s[i] >= '0' && s[i] <= '9') || s[i] == '-' || s[i] == '_')) {
             break;
-        } else if (read_bytes == -1) {
-            return -1;
-        } else {
-            *string_len += read_bytes;
-            if ((*buffer)[*string_len - 1] == '\n') break;
         }
     }
+    return i;
+}
 
-    /* Add the null terminator. */
-    if (*string_len + 1 > *buffer_len) {
-        *buffer_len = *string_len + 1;
-        *buffer = realloc(*buffer, *buffer_len);
-        if (*buffer == NULL) {
-            perror("error when stretching line buffer for the NUL");
-            exit(EXIT_FAILURE);
+static enum resource parse_resource(char *path, size_t path_len) {
+    size_t name_len;
+
+    if (path_len == 1 && path[0] == '/') {
+        return RESOURCE_INDEX;
+    } else if (path_len == 5 && memcmp(path, "/post", 5) == 0) {
+        return RESOURCE_NEW_POST;
+    } else if (path_len == 6 && memcmp(path, "/login", 6) == 0) {
+        return RESOURCE_LOGIN;
+    } else if (path_len == 8 && memcmp(path, "/archive", 8) == 0) {
+        return RESOURCE_ARCHIVE;
+    } else if (path_len == 10 && memcmp(path, "/api/posts", 10) == 0) {
+        return RESOURCE_API_POSTS;
+    } else if (path_len == 7 && memcmp(path, "/events", 7) == 0) {
+        return RESOURCE_EVENTS;
+    } else if (path_len == 8 && memcmp(path, "/metrics", 8) == 0) {
+        return RESOURCE_METRICS;
+    } else if (path_len > 3 && memcmp(path, "/r/", 3) == 0) {
+        /* /r/<room> and /r/<room>/post. */
+        name_len = room_name_len(&path[3], path_len - 3);
+        if (name_len == 0 || name_len > RISKYCHAT_ROOM_NAME_LEN) {
+            return UNKNOWN_RESOURCE;
+        } else if (3 + name_len == path_len) {
+            return RESOURCE_ROOM;
+        } else if (3 + name_len + 5 == path_len &&
+                   memcmp(&path[3 + name_len], "/post", 5) == 0) {
+            return RESOURCE_ROOM_POST;
         }
+        return UNKNOWN_RESOURCE;
+    } else {
+        return UNKNOWN_RESOURCE;
     }
-    (*buffer)[*string_len] = '\0';
-
-    return 0;
 }
 
-static char http_response_head[] = "HTTP/1.1 ";
-/* Returns 0 when the entire response has been sent. */
-static ssize_t write_http_response(int fd, size_t *written_len,
-                                   char *status, size_t status_len,
-                                   char *response, size_t response_len,
-                                   int is_head, char *additional_headers) {
-    ssize_t result, target_len, section_start;
-    char buf[128];
-    int buf_len;
+/* Parses "METHOD /target HTTP/1.x". Returns -1 if it doesn't look like that,
+ * 0 otherwise. An unknown target is not an error, it'll be a 404 later. */
+static int parse_request_line(struct connection_ctx *ctx, char *request,
+                              char *line, size_t line_len) {
+    char *target, *query, *version;
+    size_t method_len, version_len;
 
-    section_start = 0;
-    target_len = sizeof http_response_head - 1;
-    while (*written_len < target_len) {
-        result = send(fd, &http_response_head[*written_len - section_start],
-                      target_len - *written_len, 0);
-        if (result == -1) return -1;
-        else *written_len += result;
+    target = memchr(line, ' ', line_len);
+    if (target == NULL) return -1;
+    method_len = target - line;
+    if (method_len == 3 && memcmp(line, "GET", 3) == 0) {
+        ctx->method = GET;
+    } else if (method_len == 4 && memcmp(line, "HEAD", 4) == 0) {
+        ctx->method = HEAD;
+    } else if (method_len == 4 && memcmp(line, "POST", 4) == 0) {
+        ctx->method = POST;
+    } else {
+        return -1;
     }
 
-    section_start = target_len;
-    target_len += status_len;
-    while (*written_len < target_len) {
-        result = send(fd, &status[*written_len - section_start],
-                      target_len - *written_len, 0);
-        if (result == -1) return -1;
-        else *written_len += result;
+    target++;
+    version = memchr(target, ' ', &line[line_len] - target);
+    if (version == NULL) return -1;
+    query = memchr(target, '?', version - target);
+    if (query == NULL) query = version;
+    ctx->target.start = target - request;
+    ctx->target.len = query - target;
+    ctx->query.start = query - request;
+    ctx->query.len = 0;
+    if (query < version) {
+        ctx->query.start++;
+        ctx->query.len = version - query - 1;
     }
+    ctx->requested_resource = parse_resource(target, ctx->target.len);
 
-    buf_len = snprintf(buf, sizeof buf,
-                       "\r\nConnection: close\r\nContent-Length: %ld\r\n%s\r\n",
-                       response_len, additional_headers);
-    section_start = target_len;
-    target_len += buf_len;
-    while (*written_len < target_len) {
-        result = send(fd, &buf[*written_len - section_start],
-                      target_len - *written_len, 0);
-        if (result == -1) return -1;
-        else *written_len += result;
-    }
+    /* HTTP/1.1 connections are persistent unless told otherwise. */
+    version++;
+    version_len = &line[line_len] - version;
+    ctx->keep_alive = version_len == 8 && memcmp(version, "HTTP/1.1", 8) == 0;
+    return 0;
+}
 
-    if (!is_head) {
-        section_start = target_len;
-        target_len += response_len;
-        while (*written_len < target_len) {
-            result = send(fd, &response[*written_len - section_start],
-                          target_len - *written_len, 0);
-            if (result == -1) return -1;
-            else *written_len += result;
+/* Finds key=123 in a "a=1&b=2" style query string. Returns the number, or
+ * fallback if it's not there or isn't a number. */
+static long parse_query_number(char *query, size_t query_len, char *key,
+                               long fallback) {
+    char *pair, *pair_end, *end, *eq;
+    long number;
+
+    end = &query[query_len];
+    for (pair = query; pair < end; pair = pair_end + 1) {
+        pair_end = memchr(pair, '&', end - pair);
+        if (pair_end == NULL) pair_end = end;
+        eq = memchr(pair, '=', pair_end - pair);
+        if (eq != NULL && eq_nocase(pair, eq - pair, key)) {
+            number = parse_number(eq + 1, pair_end - (eq + 1), 2147483647L);
+            return number == -1 ? fallback : number;
         }
+        if (pair_end == end) break;
     }
-
-    return 0;
+    return fallback;
 }
 
-static char chat_head_raw[] = "\
-HTTP/1.1 200 OK\r\n\
-Transfer-Encoding: chunked\r\n\
-\r\n";
-static ssize_t write_chunk_length(int fd, size_t len,
-                                  size_t *written_len, size_t start) {
-    int buf_len, result;
-    char buf[16];
-    buf_len = snprintf(buf, sizeof buf, "%lx\r\n", len);
-    while (*written_len < start + buf_len) {
-        result = send(fd, &buf[*written_len - start],
-                      start + buf_len - *written_len, 0);
+/* Finds the riskyid cookie in a "a=b; riskyid=123; c=d" style list. Returns
+ * the id, or 0 if there isn't one. */
+static int parse_riskyid(char *cookies, size_t cookies_len) {
+    char *pair, *pair_end, *end, *eq;
+    long id;
+
+    end = &cookies[cookies_len];
+    for (pair = cookies; pair < end; pair = pair_end + 1) {
+        while (pair < end && *pair == ' ') pair++;
+        pair_end = memchr(pair, ';', end - pair);
+        if (pair_end == NULL) pair_end = end;
+        eq = memchr(pair, '=', pair_end - pair);
+        if (eq != NULL && eq - pair == 7 && memcmp(pair, "riskyid", 7) == 0) {
+            while (pair_end > eq + 1 && pair_end[-1] == ' ') pair_end--;
+            id = parse_number(eq + 1, pair_end - (eq + 1),
+                              RISKYCHAT_MAX_USERS);
+            return id == -1 ? 0 : (int)id;
+        }
+        if (pair_end == end) break;
+    }
+    return 0;
+}
+
+/* Whether an Accept-Encoding value lists gzip (or *), without q=0. */
+static int accepts_gzip(char *value, size_t value_len) {
+    size_t start, end, token_end, q;
+
+    for (start = 0; start < value_len; start = end + 1) {
+        for (end = start; end < value_len && value[end] != ','; end++);
+        while (start < end && (value[start] == ' ' || value[start] == '\t')) {
+            start++;
+        }
+        for (token_end = start; token_end < end && value[token_end] != ';' &&
+             value[token_end] != ' ' && value[token_end] != '\t';
+             token_end++);
+        if (!eq_nocase(&value[start], token_end - start, "gzip") &&
+            !eq_nocase(&value[start], token_end - start, "x-gzip") &&
+            !eq_nocase(&value[start], token_end - start, "*")) {
+            continue;
+        }
+        /* Any weight but zero will do. */
+        for (q = token_end; q + 1 < end; q++) {
+            if ((value[q] == 'q' || value[q] == 'Q') && value[q + 1] == '=') {
+                for (q += 2; q < end && (value[q] == '0' || value[q] == '.');
+                     q++);
+                return q < end && value[q] >= '1' && value[q] <= '9';
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Picks up the headers we care about. Returns -1 if one of them is
+ * malformed, 0 otherwise. */
+static int parse_header(struct connection_ctx *ctx,
+                        char *line, size_t line_len) {
+    char *value;
+    size_t name_len, value_len;
+    long content_length;
+
+    value = memchr(line, ':', line_len);
+    if (value == NULL) return 0;
+    name_len = value - line;
+    value++;
+    value_len = &line[line_len] - value;
+    while (value_len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        value_len--;
+    }
+    while (value_len > 0 &&
+           (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+        value_len--;
+    }
+
+    if (eq_nocase(line, name_len, "content-length")) {
+        content_length = parse_number(value, value_len,
+                                      RISKYCHAT_MAX_BODY_SIZE);
+        if (content_length == -1) return -1;
+        ctx->expected_content_length = content_length;
+    } else if (eq_nocase(line, name_len, "last-event-id")) {
+        /* Only used to pick up where a stream left off, so ignore junk. */
+        content_length = parse_number(value, value_len, 2147483647L);
+        ctx->last_event_id = content_length == -1 ? 0 : content_length;
+    } else if (eq_nocase(line, name_len, "cookie")) {
+        ctx->user_id = parse_riskyid(value, value_len);
+    } else if (eq_nocase(line, name_len, "accept-encoding")) {
+        ctx->accept_gzip = accepts_gzip(value, value_len);
+    } else if (eq_nocase(line, name_len, "connection")) {
+        if (contains_nocase(value, value_len, "close")) {
+            ctx->keep_alive = 0;
+        } else if (contains_nocase(value, value_len, "keep-alive")) {
+            ctx->keep_alive = 1;
+        }
+    }
+    return 0;
+}
+
+/* Parses as much of the current request as is in the buffer, moving
+ * ctx->stage forward: stage 0 is the request line, 1 the headers, 2 the body,
+ * and 3 means the whole request is in. Nothing is copied or modified, the
+ * parts we need are left in the buffer as slices, and every byte is looked
+ * at once even if the request arrives one byte at a time.
+ * Returns 1 when the request is complete, 0 if more bytes are needed, and -1
+ * if the request is malformed or too large. */
+static int parse_request(struct connection_ctx *ctx) {
+    char *request, *line, *line_end;
+    size_t available, line_len;
+
+    request = &ctx->buffer[ctx->request_start];
+    available = ctx->read_len - ctx->request_start;
+
+    while (ctx->stage < 2) {
+        line_end = NULL;
+        if (ctx->scan_len < available) {
+            line_end = memchr(&request[ctx->scan_len], '\n',
+                              available - ctx->scan_len);
+        }
+        if (line_end == NULL) {
+            ctx->scan_len = available;
+            return ctx->scan_len > RISKYCHAT_MAX_HEADER_SIZE ? -1 : 0;
+        }
+        line = &request[ctx->parse_len];
+        line_len = line_end - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        ctx->parse_len = ctx->scan_len = line_end - request + 1;
+        if (ctx->parse_len > RISKYCHAT_MAX_HEADER_SIZE) return -1;
+
+        if (ctx->stage == 0) {
+            /* Empty lines before the request line should be ignored. */
+            if (line_len == 0) continue;
+            if (parse_request_line(ctx, request, line, line_len) == -1) {
+                return -1;
+            }
+            ctx->stage = 1;
+        } else if (line_len == 0) {
+            /* The end of the header section is marked by an empty line. */
+            ctx->body_start = ctx->parse_len;
+            ctx->stage = 2;
+        } else if (parse_header(ctx, line, line_len) == -1) {
+            return -1;
+        }
+    }
+
+    if (ctx->stage == 2) {
+        if (available - ctx->body_start < ctx->expected_content_length) {
+            return 0;
+        }
+        ctx->stage = 3;
+    }
+    return 1;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Copies the plain text starting at buf[*i] down to buf[*j], turning '+'s
+ * into spaces, until the next '%' or the end. Form bodies are mostly plain
+ * text, so this is where decoding spends its time: the vector loops do 16
+ * (or 32) bytes at a time, and leave the block with the '%' in it to the
+ * scalar loop. Since *j <= *i, each block is loaded before it's stored
+ * over. */
+static void form_copy_plain(char *buf, size_t *i, size_t *j, size_t len) {
+    size_t from, to;
+#ifdef RISKYCHAT_USE_AVX2
+    __m256i percents32, pluses32, flip32, block32, is_plus32;
+#endif
+#ifdef RISKYCHAT_USE_SSE2
+    __m128i percents, pluses, flip, block, is_plus;
+#endif
+
+    from = *i;
+    to = *j;
+#ifdef RISKYCHAT_USE_AVX2
+    percents32 = _mm256_set1_epi8('%');
+    pluses32 = _mm256_set1_epi8('+');
+    flip32 = _mm256_set1_epi8('+' ^ ' ');
+    for (; from + 32 <= len; from += 32, to += 32) {
+        block32 = _mm256_loadu_si256((__m256i *)&buf[from]);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block32, percents32))) {
+            break;
+        }
+        is_plus32 = _mm256_cmpeq_epi8(block32, pluses32);
+        block32 = _mm256_xor_si256(block32,
+                                   _mm256_and_si256(is_plus32, flip32));
+        _mm256_storeu_si256((__m256i *)&buf[to], block32);
+    }
+#endif
+#ifdef RISKYCHAT_USE_SSE2
+    percents = _mm_set1_epi8('%');
+    pluses = _mm_set1_epi8('+');
+    flip = _mm_set1_epi8('+' ^ ' ');
+    for (; from + 16 <= len; from += 16, to += 16) {
+        block = _mm_loadu_si128((__m128i *)&buf[from]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, percents))) break;
+        is_plus = _mm_cmpeq_epi8(block, pluses);
+        block = _mm_xor_si128(block, _mm_and_si128(is_plus, flip));
+        _mm_storeu_si128((__m128i *)&buf[to], block);
+    }
+#endif
+    for (; from < len && buf[from] != '%'; from++, to++) {
+        buf[to] = buf[from] == '+' ? ' ' : buf[from];
+    }
+    *i = from;
+    *j = to;
+}
+
+/* Decodes an application/x-www-form-urlencoded value in place, in one
+ * pass, and returns the decoded length. Every byte is moved at most once,
+ * so this is linear however many escapes there are. A '%' that isn't
+ * followed by two hex digits is left as it is. */
+static size_t form_decode(char *buf, size_t len) {
+    size_t i, j;
+    int high, low;
+
+    i = j = 0;
+    for (;;) {
+        form_copy_plain(buf, &i, &j, len);
+        if (i >= len) break;
+        if (i + 2 < len && (high = hex_value(buf[i + 1])) != -1 &&
+            (low = hex_value(buf[i + 2])) != -1) {
+            buf[j++] = (char)(high << 4 | low);
+            i += 3;
+        } else {
+            buf[j++] = buf[i++];
+        }
+    }
+    return j;
+}
+
+/* Finds key's value in a form body, decodes it in place, and returns it
+ * with its decoded length in *value_len, or returns NULL if the key isn't
+ * there. The body isn't NUL-terminated, it might be followed by the next
+ * pipelined request, so only body_len bytes are touched. Keys are compared
+ * as they are, which is fine for the plain ASCII ones looked up here. */
+static char *form_value(char *body, size_t body_len, char *key,
+                        size_t *value_len) {
+    size_t key_len, start, end;
+    char *amp;
+
+    key_len = strlen(key);
+    for (start = 0; start < body_len; start = end + 1) {
+        amp = memchr(&body[start], '&', body_len - start);
+        end = amp == NULL ? body_len : (size_t)(amp - body);
+        if (end - start > key_len && body[start + key_len] == '=' &&
+            memcmp(&body[start], key, key_len) == 0) {
+            start += key_len + 1;
+            *value_len = form_decode(&body[start], end - start);
+            return &body[start];
+        }
+    }
+    return NULL;
+}
+
+/* Returns a buffer of RISKYCHAT_BUFFER_SIZE bytes, only allocating one if
+ * all the buffers allocated so far are in use. */
+static char *pool_get(struct buffer_pool *pool) {
+    char *buffer;
+
+    buffer = pool->free;
+    if (buffer != NULL) {
+        memcpy(&pool->free, buffer, sizeof pool->free);
+    } else {
+        buffer = malloc(RISKYCHAT_BUFFER_SIZE);
+        if (buffer == NULL) {
+            perror("error when allocating a request buffer");
+            exit(EXIT_FAILURE);
+        }
+        pool->allocated++;
+    }
+    pool->in_use++;
+    if (pool->in_use > pool->peak_in_use) pool->peak_in_use = pool->in_use;
+    return buffer;
+}
+
+static void pool_put(struct buffer_pool *pool, char *buffer) {
+    memcpy(buffer, &pool->free, sizeof pool->free);
+    pool->free = buffer;
+    pool->in_use--;
+}
+
+static void pool_free(struct buffer_pool *pool) {
+    char *buffer;
+
+    while (pool->free != NULL) {
+        buffer = pool->free;
+        memcpy(&pool->free, buffer, sizeof pool->free);
+        free(buffer);
+    }
+}
+
+/* Gives the request buffer back, to the pool if it came from there. */
+static void release_buffer(struct connection_ctx *ctx) {
+    if (ctx->buffer_len == RISKYCHAT_BUFFER_SIZE) {
+        pool_put(ctx->pool, ctx->buffer);
+    } else {
+        free(ctx->buffer);
+    }
+    ctx->buffer = NULL;
+    ctx->buffer_len = 0;
+}
+
+/* Receives whatever is available with a single recv, making room in the
+ * buffer first if it's full. Returns the amount of bytes read, 0 if the peer
+ * hung up, or -1 on error. */
+static ssize_t fill_buffer(struct connection_ctx *ctx) {
+    size_t new_len, request_end;
+    ssize_t result;
+    char *new_buffer;
+
+    /* Drop the requests that have already been handled, if that helps. */
+    if (ctx->read_len == ctx->buffer_len && ctx->request_start > 0) {
+        memmove(ctx->buffer, &ctx->buffer[ctx->request_start],
+                ctx->read_len - ctx->request_start);
+        ctx->read_len -= ctx->request_start;
+        ctx->request_start = 0;
+    }
+
+    if (ctx->buffer == NULL) {
+        ctx->buffer = pool_get(ctx->pool);
+        ctx->buffer_len = RISKYCHAT_BUFFER_SIZE;
+    } else if (ctx->read_len == ctx->buffer_len) {
+        new_len = ctx->buffer_len * 2;
+        /* When reading the body, its length is known, so make room for the
+         * whole thing at once. */
+        if (ctx->stage == 2) {
+            request_end = ctx->body_start + ctx->expected_content_length;
+            if (new_len < request_end) new_len = request_end;
+        }
+        /* Outgrowing the pooled buffer means moving to one of our own. */
+        if (ctx->buffer_len == RISKYCHAT_BUFFER_SIZE) {
+            new_buffer = malloc(new_len);
+            if (new_buffer != NULL) {
+                memcpy(new_buffer, ctx->buffer, ctx->read_len);
+                pool_put(ctx->pool, ctx->buffer);
+                ctx->pool->oversized++;
+            }
+        } else {
+            new_buffer = realloc(ctx->buffer, new_len);
+        }
+        if (new_buffer == NULL) {
+            perror("error when stretching the request buffer");
+            exit(EXIT_FAILURE);
+        }
+        ctx->buffer = new_buffer;
+        ctx->buffer_len = new_len;
+    }
+
+    result = recv(ctx->connect_fd, &ctx->buffer[ctx->read_len],
+                  ctx->buffer_len - ctx->read_len, 0);
+    if (result > 0) {
+        ctx->read_len += result;
+        ctx->metrics->bytes_in += result;
+    }
+    return result;
+}
+
+
+/* privfuncs: Functions used by the functions used in main(). */
+
+/* Returns a new shared buffer with room for allocated_len bytes, with one
+ * reference, owned by the caller. */
+static struct shared_buf *shared_buf_new(size_t allocated_len) {
+    struct shared_buf *buf;
+
+    buf = malloc(sizeof *buf + allocated_len);
+    if (buf == NULL) {
+        perror("error when allocating a shared buffer");
+        exit(EXIT_FAILURE);
+    }
+    buf->refs = 1;
+    buf->len = 0;
+    buf->allocated_len = allocated_len;
+    buf->data = (char *)(buf + 1);
+    return buf;
+}
+
+static void shared_buf_ref(struct shared_buf *buf) {
+    refs_lock();
+    buf->refs++;
+    refs_unlock();
+}
+
+static void shared_buf_unref(struct shared_buf *buf) {
+    int refs;
+
+    refs_lock();
+    refs = --buf->refs;
+    refs_unlock();
+    if (refs == 0) free(buf);
+}
+
+/* CRC-32 of the gzip trailers, and the records in the log and snapshots. */
+static unsigned long CRC_TABLE[256];
+/* x^(2^k) modulo the CRC-32 polynomial, for shifting CRCs, see
+ * crc32_shift. */
+static unsigned long CRC_POWERS[32];
+
+/* Multiplies two polynomials modulo the CRC-32 polynomial. The bits are
+ * reflected, like everything else in CRC-32, so x^0 is 0x80000000. */
+static unsigned long crc32_multiply(unsigned long a, unsigned long b) {
+    unsigned long m, p;
+
+    m = 0x80000000UL;
+    p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xEDB88320UL : b >> 1;
+    }
+    return p;
+}
+
+static void crc32_init(void) {
+    unsigned long crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320UL : crc >> 1;
+        }
+        CRC_TABLE[i] = crc;
+    }
+    CRC_POWERS[0] = 0x40000000UL;
+    for (i = 1; i < 32; i++) {
+        CRC_POWERS[i] = crc32_multiply(CRC_POWERS[i - 1], CRC_POWERS[i - 1]);
+    }
+}
+
+/* Continues a CRC-32 (the zlib one), start with 0. */
+static unsigned long crc32_update(unsigned long crc, char *data, size_t len) {
+    size_t i;
+
+    crc = ~crc & 0xFFFFFFFFUL;
+    for (i = 0; i < len; i++) {
+        crc = CRC_TABLE[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc & 0xFFFFFFFFUL;
+}
+
+/* Returns x^(8 * len) modulo the CRC-32 polynomial: multiplying a CRC by
+ * it is what len more bytes of zeros would do to it. */
+static unsigned long crc32_shift(unsigned long len) {
+    unsigned long p;
+    int k;
+
+    p = 0x80000000UL;
+    for (k = 3; len != 0; len >>= 1, k++) {
+        if (len & 1) p = crc32_multiply(CRC_POWERS[k & 31], p);
+    }
+    return p;
+}
+
+/* Returns the CRC-32 of a followed by b, from their CRCs, in O(log b_len)
+ * like zlib's crc32_combine. */
+static unsigned long crc32_combine(unsigned long a, unsigned long b,
+                                   unsigned long b_len) {
+    return crc32_multiply(crc32_shift(b_len), a) ^ b;
+}
+
+/* Integers in the log, snapshots and gzip trailers are 32 bits,
+ * little-endian. */
+static void put_u32(char *p, unsigned long n) {
+    p[0] = (char)(n & 0xFF);
+    p[1] = (char)((n >> 8) & 0xFF);
+    p[2] = (char)((n >> 16) & 0xFF);
+    p[3] = (char)((n >> 24) & 0xFF);
+}
+
+static unsigned long get_u32(char *p) {
+    return (unsigned long)(unsigned char)p[0] |
+        (unsigned long)(unsigned char)p[1] << 8 |
+        (unsigned long)(unsigned char)p[2] << 16 |
+        (unsigned long)(unsigned char)p[3] << 24;
+}
+
+/* The fixed Huffman codes of deflate, bit-reversed, since the stream is
+ * written least significant bit first but the codes most significant bit
+ * first. */
+static unsigned short LITERAL_CODES[288];
+static unsigned char LITERAL_CODE_LENS[288];
+static unsigned short DISTANCE_CODES[30];
+
+/* A gzip header with no name or time, from an unknown OS. */
+static char gzip_header[] = "\037\213\010\0\0\0\0\0\0\377";
+
+static unsigned short reverse_bits(unsigned int code, int len) {
+    unsigned int reversed;
+
+    for (reversed = 0; len > 0; len--, code >>= 1) {
+        reversed = reversed << 1 | (code & 1);
+    }
+    return (unsigned short)reversed;
+}
+
+static void deflate_init(void) {
+    int i;
+
+    for (i = 0; i < 288; i++) {
+        if (i < 144) {
+            LITERAL_CODES[i] = reverse_bits(0x30 + i, 8);
+            LITERAL_CODE_LENS[i] = 8;
+        } else if (i < 256) {
+            LITERAL_CODES[i] = reverse_bits(0x190 + i - 144, 9);
+            LITERAL_CODE_LENS[i] = 9;
+        } else if (i < 280) {
+            LITERAL_CODES[i] = reverse_bits(i - 256, 7);
+            LITERAL_CODE_LENS[i] = 7;
+        } else {
+            LITERAL_CODES[i] = reverse_bits(0xC0 + i - 280, 8);
+            LITERAL_CODE_LENS[i] = 8;
+        }
+    }
+    for (i = 0; i < 30; i++) DISTANCE_CODES[i] = reverse_bits(i, 5);
+}
+
+/* Makes room for len more bytes, bits_put doesn't check. */
+static void bits_reserve(struct bit_buffer *b, size_t len) {
+    char *new_data;
+    size_t new_len;
+
+    if (b->len + len <= b->allocated_len) return;
+    new_len = (b->len + len) * 2;
+    new_data = realloc(b->data, new_len);
+    if (new_data == NULL) {
+        perror("error when allocating compressed data");
+        exit(EXIT_FAILURE);
+    }
+    b->data = new_data;
+    b->allocated_len = new_len;
+}
+
+/* Appends the len lowest bits of value, at most 16 at a time. */
+static void bits_put(struct bit_buffer *b, unsigned long value, int len) {
+    b->bits |= value << b->bits_len;
+    b->bits_len += len;
+    while (b->bits_len >= 8) {
+        b->data[b->len++] = (char)(b->bits & 0xFF);
+        b->bits >>= 8;
+        b->bits_len -= 8;
+    }
+}
+
+/* Pads the stream to a whole byte, for the end of the last block. */
+static void bits_flush(struct bit_buffer *b) {
+    bits_reserve(b, 1);
+    if (b->bits_len > 0) bits_put(b, 0, 8 - b->bits_len);
+}
+
+/* Ends the stream so far on a byte boundary with an empty stored block,
+ * like zlib's Z_SYNC_FLUSH, so whatever comes next can start on a byte of
+ * its own. */
+static void bits_sync(struct bit_buffer *b) {
+    bits_reserve(b, 6);
+    bits_put(b, 0, 3);
+    if (b->bits_len > 0) bits_put(b, 0, 8 - b->bits_len);
+    bits_put(b, 0, 16);
+    bits_put(b, 0xFFFF, 16);
+}
+
+static void deflate_literal(struct bit_buffer *b, int literal) {
+    bits_put(b, LITERAL_CODES[literal], LITERAL_CODE_LENS[literal]);
+}
+
+static int floor_log2(unsigned long x) {
+    int k;
+
+    for (k = 0; x > 1; x >>= 1) k++;
+    return k;
+}
+
+/* Writes a match of 3 to 258 bytes, dist bytes back. */
+static void deflate_match(struct bit_buffer *b, size_t len, size_t dist) {
+    unsigned long x;
+    int k, symbol, extra;
+
+    x = len - 3;
+    if (len == 258) {
+        symbol = 285;
+        extra = 0;
+    } else if (x < 8) {
+        symbol = 257 + (int)x;
+        extra = 0;
+    } else {
+        k = floor_log2(x);
+        symbol = 257 + 4 * (k - 1) + (int)((x >> (k - 2)) & 3);
+        extra = k - 2;
+    }
+    deflate_literal(b, symbol);
+    if (extra > 0) bits_put(b, x & ((1UL << extra) - 1), extra);
+
+    x = dist - 1;
+    if (x < 4) {
+        symbol = (int)x;
+        extra = 0;
+    } else {
+        k = floor_log2(x);
+        symbol = 2 * k + (int)((x >> (k - 1)) & 1);
+        extra = k - 1;
+    }
+    bits_put(b, DISTANCE_CODES[symbol], 5);
+    if (extra > 0) bits_put(b, x & ((1UL << extra) - 1), extra);
+}
+
+static struct deflater *deflater_new(void) {
+    struct deflater *d;
+
+    d = calloc(1, sizeof *d);
+    if (d == NULL) {
+        perror("error when allocating a compressor");
+        exit(EXIT_FAILURE);
+    }
+    return d;
+}
+
+static void deflater_free(struct deflater *d) {
+    free(d->out.data);
+    free(d);
+}
+
+/* Starts a new stream, forgetting the previous input. */
+static void deflate_reset(struct deflater *d) {
+    memset(d->head, 0, sizeof d->head);
+    d->out.len = 0;
+    d->out.bits = 0;
+    d->out.bits_len = 0;
+}
+
+static unsigned long deflate_hash(char *p) {
+    unsigned long x;
+
+    x = (unsigned long)(unsigned char)p[0] << 16 |
+        (unsigned long)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+    return (x * 2654435761UL & 0xFFFFFFFFUL) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static void deflate_insert(struct deflater *d, char *data, size_t i) {
+    unsigned long hash;
+
+    hash = deflate_hash(&data[i]);
+    d->prev[i % DEFLATE_WINDOW] = d->head[hash];
+    d->head[hash] = i + 1;
+}
+
+/* Compresses data[from..to) into a block of its own, the last one of the
+ * stream if final. Matches can reach back into data[0..from), which should
+ * have gone through this deflater since the last reset. Greedy, taking the
+ * longest match among the last DEFLATE_MAX_CHAIN with the same hash. */
+static void deflate_block(struct deflater *d, char *data, size_t from,
+                          size_t to, int final) {
+    struct bit_buffer *out;
+    unsigned long candidate, next;
+    size_t i, j, len, max_len, best_len, best_dist;
+    int chain;
+
+    out = &d->out;
+    /* A literal is at most 9 bits, and a match is never worse than that
+     * per byte. */
+    bits_reserve(out, to - from + (to - from) / 8 + 8);
+    bits_put(out, final ? 3 : 2, 3);
+    for (i = from; i < to;) {
+        best_len = best_dist = 0;
+        if (to - i >= 3) {
+            max_len = to - i < 258 ? to - i : 258;
+            candidate = d->head[deflate_hash(&data[i])];
+            for (chain = DEFLATE_MAX_CHAIN; candidate != 0 && chain > 0;
+                 chain--) {
+                j = candidate - 1;
+                if (i - j > DEFLATE_WINDOW) break;
+                if (data[j + best_len] == data[i + best_len]) {
+                    for (len = 0; len < max_len &&
+                         data[j + len] == data[i + len]; len++);
+                    if (len > best_len) {
+                        best_len = len;
+                        best_dist = i - j;
+                        if (len == max_len) break;
+                    }
+                }
+                next = d->prev[j % DEFLATE_WINDOW];
+                if (next >= candidate) break;
+                candidate = next;
+            }
+            deflate_insert(d, data, i);
+        }
+        if (best_len >= 3) {
+            deflate_match(out, best_len, best_dist);
+            for (j = i + 1; j < i + best_len && to - j >= 3; j++) {
+                deflate_insert(d, data, j);
+            }
+            i += best_len;
+        } else {
+            deflate_literal(out, (unsigned char)data[i]);
+            i++;
+        }
+    }
+    deflate_literal(out, 256);
+}
+
+/* Returns data gzipped into a new buffer, its length in *gzip_len. */
+static char *gzip_compress(struct deflater *d, char *data, size_t len,
+                           size_t *gzip_len) {
+    char *gzip;
+
+    deflate_reset(d);
+    bits_reserve(&d->out, sizeof gzip_header - 1);
+    memcpy(d->out.data, gzip_header, sizeof gzip_header - 1);
+    d->out.len = sizeof gzip_header - 1;
+    deflate_block(d, data, 0, len, 1);
+    bits_flush(&d->out);
+    bits_reserve(&d->out, 8);
+    put_u32(&d->out.data[d->out.len], crc32_update(0, data, len));
+    put_u32(&d->out.data[d->out.len + 4], len);
+    d->out.len += 8;
+
+    gzip = d->out.data;
+    *gzip_len = d->out.len;
+    d->out.data = NULL;
+    d->out.len = d->out.allocated_len = 0;
+    return gzip;
+}
+
+/* Returns DEFLATE_SCRATCH, made the first time it's needed. Should be
+ * called with DEFLATE_LOCK held. */
+static struct deflater *deflate_scratch(void) {
+    if (DEFLATE_SCRATCH == NULL) DEFLATE_SCRATCH = deflater_new();
+    return DEFLATE_SCRATCH;
+}
+
+static void gzip_cache_init(struct gzip_cache *cache,
+                            struct shared_buf *head) {
+    struct deflater *d;
+
+    memset(cache, 0, sizeof *cache);
+    cache->data = shared_buf_new(RISKYCHAT_CACHE_SIZE);
+
+    /* The page's head is compressed once, and ends on a byte boundary so
+     * the posts can follow it. */
+    deflate_lock();
+    d = deflate_scratch();
+    deflate_reset(d);
+    bits_reserve(&d->out, sizeof gzip_header - 1);
+    memcpy(d->out.data, gzip_header, sizeof gzip_header - 1);
+    d->out.len = sizeof gzip_header - 1;
+    deflate_block(d, head->data, 0, head->len, 0);
+    bits_sync(&d->out);
+    cache->head = shared_buf_new(d->out.len);
+    memcpy(cache->head->data, d->out.data, d->out.len);
+    cache->head->len = d->out.len;
+    cache->head_crc = crc32_update(0, head->data, head->len);
+    d->out.len = 0;
+    deflate_unlock();
+}
+
+static void gzip_cache_free(struct gzip_cache *cache) {
+    shared_buf_unref(cache->data);
+    if (cache->first != NULL) shared_buf_unref(cache->first);
+    if (cache->open != NULL) deflater_free(cache->open);
+    free(cache->segments);
+    shared_buf_unref(cache->head);
+}
+
+/* Moves the open segment's finished bytes onto the end of the compressed
+ * posts, in place if there's room, like render_cache_append. */
+static void gzip_cache_take(struct gzip_cache *cache) {
+    struct shared_buf *buf, *new_buf;
+    struct bit_buffer *out;
+    size_t live_len, new_len;
+    int i;
+
+    out = &cache->open->out;
+    buf = cache->data;
+    if (buf->len + out->len > buf->allocated_len) {
+        live_len = buf->len - cache->start;
+        new_len = (live_len + out->len) * 2;
+        if (new_len < RISKYCHAT_CACHE_SIZE) new_len = RISKYCHAT_CACHE_SIZE;
+        new_buf = shared_buf_new(new_len);
+        memcpy(new_buf->data, &buf->data[cache->start], live_len);
+        new_buf->len = live_len;
+        for (i = 0; i < cache->segments_len; i++) {
+            cache->segments[i].end -= cache->start;
+        }
+        shared_buf_unref(buf);
+        cache->data = buf = new_buf;
+        cache->start = 0;
+    }
+    memcpy(&buf->data[buf->len], out->data, out->len);
+    buf->len += out->len;
+    out->len = 0;
+}
+
+/* Ends the open segment on a byte boundary, and starts a new one. */
+static void gzip_cache_seal(struct gzip_cache *cache) {
+    struct gzip_segment *new_segments;
+    int new_len;
+
+    bits_sync(&cache->open->out);
+    gzip_cache_take(cache);
+    if (cache->segments_len == cache->allocated_segments_len) {
+        new_len = cache->allocated_segments_len * 2;
+        if (new_len == 0) new_len = 16;
+        new_segments = realloc(cache->segments,
+                               new_len * sizeof cache->segments[0]);
+        if (new_segments == NULL) {
+            perror("error when allocating compressed segments");
+            exit(EXIT_FAILURE);
+        }
+        cache->segments = new_segments;
+        cache->allocated_segments_len = new_len;
+    }
+    cache->segments[cache->segments_len].raw_end = cache->raw_len;
+    cache->segments[cache->segments_len].end = cache->data->len;
+    cache->segments_len++;
+    deflate_reset(cache->open);
+    cache->raw_open = cache->raw_len;
+}
+
+/* Compresses the post that was just rendered onto the end of the page into
+ * the open segment, and seals the segment once it's big enough. Should be
+ * called with the posts write-locked, like the rest of these. */
+static void gzip_cache_add(struct gzip_cache *cache,
+                           struct render_cache *page, size_t rendered_len) {
+    char *window;
+    size_t from;
+
+    if (cache->open == NULL) cache->open = deflater_new();
+    window = &page->posts->data[page->start +
+                                (cache->raw_open - cache->raw_dropped)];
+    from = cache->raw_len - cache->raw_open;
+    deflate_block(cache->open, window, from, from + rendered_len, 0);
+    cache->crc = crc32_update(cache->crc, &window[from], rendered_len);
+    cache->raw_len += rendered_len;
+    if (cache->raw_len - cache->raw_open < RISKYCHAT_GZIP_SEGMENT) {
+        gzip_cache_take(cache);
+        return;
+    }
+    gzip_cache_seal(cache);
+}
+
+/* Seals the open segment early and lets go of its compressor, once the
+ * room has gone quiet. The next post starts a new segment. */
+static void gzip_cache_quiet(struct gzip_cache *cache) {
+    if (cache->open == NULL) return;
+    if (cache->raw_len > cache->raw_open) gzip_cache_seal(cache);
+    deflater_free(cache->open);
+    cache->open = NULL;
+}
+
+/* Takes the oldest post, which is about to be dropped from the start of
+ * the page, out of the CRC. The compressed data is fixed up afterwards by
+ * gzip_cache_trim, once for all the posts dropped at once. */
+static void gzip_cache_drop(struct gzip_cache *cache,
+                            struct render_cache *page, size_t rendered_len) {
+    unsigned long dropped_crc;
+
+    dropped_crc = crc32_update(0, &page->posts->data[page->start],
+                               rendered_len);
+    cache->raw_dropped += rendered_len;
+    cache->crc ^= crc32_multiply(crc32_shift(cache->raw_len -
+                                             cache->raw_dropped),
+                                 dropped_crc);
+}
+
+/* Forgets the segments whose posts have all been dropped, and recompresses
+ * what's left of the first one, so only one segment's worth of posts is
+ * compressed again, however long the page is. */
+static void gzip_cache_trim(struct gzip_cache *cache,
+                            struct render_cache *page) {
+    struct shared_buf *first;
+    struct deflater *d;
+    char *window;
+
+    while (cache->segments_len > 0 &&
+           cache->segments[0].raw_end <= cache->raw_dropped) {
+        cache->start = cache->segments[0].end;
+        cache->raw_first = cache->segments[0].raw_end;
+        cache->segments_len--;
+        memmove(cache->segments, &cache->segments[1],
+                cache->segments_len * sizeof cache->segments[0]);
+        if (cache->first != NULL) shared_buf_unref(cache->first);
+        cache->first = NULL;
+    }
+    if (cache->raw_dropped == cache->raw_first) return;
+
+    window = &page->posts->data[page->start];
+    if (cache->segments_len > 0) {
+        /* Sent in place of the first segment. */
+        deflate_lock();
+        d = deflate_scratch();
+        deflate_reset(d);
+        deflate_block(d, window, 0,
+                      cache->segments[0].raw_end - cache->raw_dropped, 0);
+        bits_sync(&d->out);
+        first = shared_buf_new(d->out.len);
+        memcpy(first->data, d->out.data, d->out.len);
+        first->len = d->out.len;
+        deflate_unlock();
+        if (cache->first != NULL) shared_buf_unref(cache->first);
+        cache->first = first;
+    } else {
+        /* The open segment is the only one, so it starts over. */
+        shared_buf_unref(cache->data);
+        cache->data = shared_buf_new(RISKYCHAT_CACHE_SIZE);
+        cache->start = 0;
+        cache->raw_first = cache->raw_open = cache->raw_dropped;
+        if (cache->open != NULL) deflate_reset(cache->open);
+        if (cache->raw_len > cache->raw_dropped) {
+            if (cache->open == NULL) cache->open = deflater_new();
+            deflate_block(cache->open, window, 0,
+                          cache->raw_len - cache->raw_dropped, 0);
+        }
+        if (cache->open != NULL) gzip_cache_take(cache);
+    }
+}
+
+/* Compresses the whole page again, after it's been loaded from a
+ * snapshot. */
+static void gzip_cache_rebuild(struct gzip_cache *cache,
+                               struct render_cache *page,
+                               struct post_log *log) {
+    unsigned long i;
+
+    shared_buf_unref(cache->data);
+    cache->data = shared_buf_new(RISKYCHAT_CACHE_SIZE);
+    if (cache->first != NULL) shared_buf_unref(cache->first);
+    cache->first = NULL;
+    cache->start = 0;
+    cache->segments_len = 0;
+    cache->raw_first = cache->raw_dropped = cache->raw_len = 0;
+    cache->raw_open = 0;
+    cache->crc = 0;
+    if (cache->open != NULL) deflate_reset(cache->open);
+    for (i = 0; i < log->posts_len; i++) {
+        gzip_cache_add(cache, page, post_log_get(log, i)->rendered_len);
+    }
+}
+
+/* Adds a chunk to the end of the queue. If owned, the data is freed after
+ * it's sent. */
+static void outq_push(struct out_queue *q, char *data, size_t len, int owned) {
+    struct out_chunk *new_chunks;
+    int new_len;
+
+    if (len == 0) {
+        if (owned) free(data);
+        return;
+    }
+    if (q->chunks_len == q->allocated_chunks_len) {
+        new_len = q->allocated_chunks_len == 0 ?
+            8 : q->allocated_chunks_len * 2;
+        new_chunks = realloc(q->chunks, new_len * sizeof q->chunks[0]);
+        if (new_chunks == NULL) {
+            perror("error when expanding an output queue");
+            exit(EXIT_FAILURE);
+        }
+        q->chunks = new_chunks;
+        q->allocated_chunks_len = new_len;
+    }
+    q->chunks[q->chunks_len].data = data;
+    q->chunks[q->chunks_len].len = len;
+    q->chunks[q->chunks_len].owned = owned;
+    q->chunks[q->chunks_len].shared = NULL;
+    q->chunks_len++;
+}
+
+/* Adds len bytes of the shared buffer to the end of the queue. The queue
+ * takes over the caller's reference to the buffer. */
+static void outq_push_shared(struct out_queue *q, struct shared_buf *buf,
+                             size_t offset, size_t len) {
+    outq_push(q, &buf->data[offset], len, 0);
+    if (len == 0) {
+        shared_buf_unref(buf);
+    } else {
+        q->chunks[q->chunks_len - 1].shared = buf;
+    }
+}
+
+/* Lets go of whatever the chunk holds onto. */
+static void outq_release(struct out_chunk *chunk) {
+    if (chunk->owned) free(chunk->data);
+    if (chunk->shared != NULL) shared_buf_unref(chunk->shared);
+}
+
+/* Releases the chunks that haven't been sent, and empties the queue. */
+static void outq_clear(struct out_queue *q) {
+    for (; q->cursor < q->chunks_len; q->cursor++) {
+        outq_release(&q->chunks[q->cursor]);
+    }
+    q->chunks_len = 0;
+    q->cursor = 0;
+    q->offset = 0;
+}
+
+/* Sends as much of the queue as the socket takes, RISKYCHAT_MAX_IOV chunks
+ * per syscall, adding the bytes sent to *bytes_out. Returns 0 when the
+ * entire queue has been sent, -1 otherwise. This should keep getting called
+ * until it returns 0. */
+static ssize_t outq_flush(int fd, struct out_queue *q, double *bytes_out) {
+    ssize_t result;
+    size_t sent;
+    int i, iov_len;
+#ifdef _WIN32
+    WSABUF iov[RISKYCHAT_MAX_IOV];
+    DWORD wsa_sent;
+#else
+    struct iovec iov[RISKYCHAT_MAX_IOV];
+#endif
+
+    while (q->cursor < q->chunks_len) {
+        iov_len = 0;
+        for (i = q->cursor; i < q->chunks_len &&
+                 iov_len < RISKYCHAT_MAX_IOV; i++) {
+            sent = i == q->cursor ? q->offset : 0;
+#ifdef _WIN32
+            iov[iov_len].buf = &q->chunks[i].data[sent];
+            iov[iov_len].len = (ULONG)(q->chunks[i].len - sent);
+#else
+            iov[iov_len].iov_base = &q->chunks[i].data[sent];
+            iov[iov_len].iov_len = q->chunks[i].len - sent;
+#endif
+            iov_len++;
+        }
+
+#ifdef _WIN32
+        if (WSASend(fd, iov, iov_len, &wsa_sent, 0, NULL, NULL) != 0) {
+            return -1;
+        }
+        result = wsa_sent;
+#else
+        result = writev(fd, iov, iov_len);
+        if (result == -1) return -1;
+#endif
+
+        /* Move the cursor past whatever got sent. */
+        sent = result;
+        *bytes_out += sent;
+        while (sent > 0) {
+            if (sent < q->chunks[q->cursor].len - q->offset) {
+                q->offset += sent;
+                break;
+            }
+            sent -= q->chunks[q->cursor].len - q->offset;
+            outq_release(&q->chunks[q->cursor]);
+            q->cursor++;
+            q->offset = 0;
+        }
+    }
+
+    outq_clear(q);
+    return 0;
+}
+
+/* Queues a response with the given status (e.g. "200 OK") and body. The
+ * body isn't copied, so it should outlive the response. With is_head, only
+ * the status line and headers are queued, and the body can be NULL. */
+static void queue_http_response(struct out_queue *q, char *status,
+                                char *response, size_t response_len,
+                                int is_head, int keep_alive,
+                                char *additional_headers) {
+    int head_len;
+
+    head_len = snprintf(q->head, sizeof q->head,
+                        "HTTP/1.1 %s\r\nConnection: %s\r\n"
+                        "Content-Length: %ld\r\n%s\r\n",
+                        status, keep_alive ? "keep-alive" : "close",
+                        response_len, additional_headers);
+    outq_push(q, q->head, head_len, 0);
+    if (!is_head) {
+        outq_push(q, response, response_len, 0);
+    }
+}
+
+/* Renders the complete responses for the replies that never change, in
+ * each variant, so sending one is a single chunk with no formatting. The
+ * only reply with something that changes is the one setting the cookie, so
+ * it's rendered up to the cookie's value, see queue_set_cookie_response. */
+static void build_static_responses(void) {
+    static struct {
+        char *status;
+        char *body;
+        size_t body_len;
+        char *headers;
+    } replies[STATIC_REPLIES_LEN] = {
+        { "200 OK", static_response_login,
+          sizeof static_response_login - 1, "" },
+        { "303 See Other", "", 0, "Location: /\r\n" },
+        { "303 See Other", "", 0, "Location: /\r\nSet-Cookie: riskyid=" },
+        { "400 Bad Request", static_response_400,
+          sizeof static_response_400 - 1, "" },
+        { "403 Forbidden", static_response_403,
+          sizeof static_response_403 - 1, "" },
+        { "404 Not Found", static_response_404,
+          sizeof static_response_404 - 1, "" },
+        { "408 Request Timeout", static_response_408,
+          sizeof static_response_408 - 1, "" },
+        { "429 Too Many Requests", static_response_429,
+          sizeof static_response_429 - 1, "" },
+        { "503 Service Unavailable", static_response_503,
+          sizeof static_response_503 - 1, "Retry-After: 5\r\n" }
+    };
+    struct static_response *response;
+    struct deflater *d;
+    char head[256], *body, *gzip_body, *encoding;
+    size_t head_len, body_len, gzip_len;
+    int reply, is_head, keep_alive, gzip;
+
+    d = deflater_new();
+    for (reply = 0; reply < STATIC_REPLIES_LEN; reply++) {
+        /* Bodies too small to gain anything from gzip are sent as-is. */
+        gzip_body = NULL;
+        gzip_len = 0;
+        if (replies[reply].body_len > 0) {
+            gzip_body = gzip_compress(d, replies[reply].body,
+                                      replies[reply].body_len, &gzip_len);
+            if (gzip_len >= replies[reply].body_len) {
+                free(gzip_body);
+                gzip_body = NULL;
+            }
+        }
+        for (is_head = 0; is_head < 2; is_head++) {
+            for (keep_alive = 0; keep_alive < 2; keep_alive++) {
+                for (gzip = 0; gzip < 2; gzip++) {
+                    body = replies[reply].body;
+                    body_len = replies[reply].body_len;
+                    encoding = "";
+                    if (gzip_body != NULL && gzip) {
+                        body = gzip_body;
+                        body_len = gzip_len;
+                        encoding = "Content-Encoding: gzip\r\n"
+                            "Vary: Accept-Encoding\r\n";
+                    } else if (gzip_body != NULL) {
+                        encoding = "Vary: Accept-Encoding\r\n";
+                    }
+                    head_len = sprintf(head, "HTTP/1.1 %s\r\n"
+                                       "Connection: %s\r\n"
+                                       "Content-Length: %lu\r\n%s%s\r\n",
+                                       replies[reply].status,
+                                       keep_alive ? "keep-alive" : "close",
+                                       (unsigned long)body_len, encoding,
+                                       replies[reply].headers);
+                    /* The cookie's value and the end of the headers are
+                     * added when it's sent. */
+                    if (reply == REPLY_SET_COOKIE) head_len -= 2;
+                    if (is_head) body_len = 0;
+                    response =
+                        &STATIC_RESPONSES[reply][is_head][keep_alive][gzip];
+                    response->len = head_len + body_len;
+                    response->data = malloc(response->len);
+                    if (response->data == NULL) {
+                        perror("error when allocating the static responses");
+                        exit(EXIT_FAILURE);
+                    }
+                    memcpy(response->data, head, head_len);
+                    memcpy(&response->data[head_len], body, body_len);
+                }
+            }
+        }
+        free(gzip_body);
+    }
+    deflater_free(d);
+}
+
+static void free_static_responses(void) {
+    int reply, is_head, keep_alive, gzip;
+
+    for (reply = 0; reply < STATIC_REPLIES_LEN; reply++) {
+        for (is_head = 0; is_head < 2; is_head++) {
+            for (keep_alive = 0; keep_alive < 2; keep_alive++) {
+                for (gzip = 0; gzip < 2; gzip++) {
+                    free(STATIC_RESPONSES[reply][is_head][keep_alive][gzip]
+                         .data);
+                }
+            }
+        }
+    }
+}
+
+static void queue_static_response(struct out_queue *q,
+                                  enum static_reply reply, int is_head,
+                                  int keep_alive, int gzip) {
+    struct static_response *response;
+
+    response =
+        &STATIC_RESPONSES[reply][is_head != 0][keep_alive != 0][gzip != 0];
+    outq_push(q, response->data, response->len, 0);
+}
+
+/* Queues the login redirect, with the user's id patched into the cookie. */
+static void queue_set_cookie_response(struct out_queue *q, int user_id,
+                                      int keep_alive) {
+    struct static_response *response;
+    int len;
+
+    response = &STATIC_RESPONSES[REPLY_SET_COOKIE][0][keep_alive != 0][0];
+    memcpy(q->head, response->data, response->len);
+    len = sprintf(&q->head[response->len], "%d\r\n\r\n", user_id);
+    outq_push(q, q->head, response->len + len, 0);
+}
+
+/* Renders the head of a room's chat page, with its name in the title and
+ * the form posting to it. The lobby's name is "". */
+static struct shared_buf *render_chat_head(char *name) {
+    struct shared_buf *head;
+    char title[RISKYCHAT_ROOM_NAME_LEN + 3], path[RISKYCHAT_ROOM_NAME_LEN + 4];
+
+    title[0] = path[0] = '\0';
+    if (name[0] != '\0') {
+        sprintf(title, ": %s", name);
+        sprintf(path, "/r/%s", name);
+    }
+    head = shared_buf_new(sizeof static_response_chat_head + sizeof title +
+                          sizeof path);
+    head->len = sprintf(head->data, static_response_chat_head, title, path);
+    return head;
+}
+
+/* Queues the chat page gzipped: the head and the posts come compressed from
+ * the cache, and only the final block, with the open segment's last bits
+ * and the page's tail, and the trailer are made here. */
+static void queue_http_chat_gzip_response(struct out_queue *q,
+                                          struct room *room, int is_head,
+                                          int keep_alive) {
+    struct gzip_cache *cache;
+    struct shared_buf *first, *data;
+    struct bit_buffer tail;
+    size_t data_start, data_len, i;
+    unsigned long raw_len, crc;
+
+    cache = &room->gzip;
+    tail.data = q->scratch;
+    tail.len = 0;
+    tail.allocated_len = q->allocated_scratch_len;
+
+    room_read_lock(room);
+    first = cache->first;
+    data = cache->data;
+    data_start = first != NULL ? cache->segments[0].end : cache->start;
+    data_len = data->len - data_start;
+    raw_len = cache->raw_len - cache->raw_dropped;
+    crc = cache->crc;
+    tail.bits = 0;
+    tail.bits_len = 0;
+    if (cache->open != NULL) {
+        tail.bits = cache->open->out.bits;
+        tail.bits_len = cache->open->out.bits_len;
+    }
+    if (!is_head) {
+        if (first != NULL) shared_buf_ref(first);
+        shared_buf_ref(data);
+        shared_buf_ref(cache->head);
+    }
+    room_unlock(room);
+
+    bits_reserve(&tail, sizeof static_response_chat_tail * 2 + 16);
+    bits_put(&tail, 3, 3);
+    for (i = 0; i < sizeof static_response_chat_tail - 1; i++) {
+        deflate_literal(&tail, (unsigned char)static_response_chat_tail[i]);
+    }
+    deflate_literal(&tail, 256);
+    bits_flush(&tail);
+    crc = crc32_combine(cache->head_crc, crc, raw_len);
+    crc = crc32_update(crc, static_response_chat_tail,
+                       sizeof static_response_chat_tail - 1);
+    put_u32(&tail.data[tail.len], crc);
+    put_u32(&tail.data[tail.len + 4], room->head->len + raw_len +
+            sizeof static_response_chat_tail - 1);
+    tail.len += 8;
+    q->scratch = tail.data;
+    q->allocated_scratch_len = tail.allocated_len;
+
+    queue_http_response(q, "200 OK", NULL,
+                        cache->head->len + (first != NULL ? first->len : 0) +
+                        data_len + tail.len, 1, keep_alive,
+                        "Content-Encoding: gzip\r\n"
+                        "Vary: Accept-Encoding\r\n");
+    if (is_head) return;
+    outq_push_shared(q, cache->head, 0, cache->head->len);
+    if (first != NULL) outq_push_shared(q, first, 0, first->len);
+    outq_push_shared(q, data, data_start, data_len);
+    outq_push(q, tail.data, tail.len, 0);
+}
+
+/* Queues the room's chat page: the head, the cached posts, and the static
+ * tail, so a page view doesn't render or copy anything, however many posts
+ * there are. The cache can be appended to by other workers while this is
+ * being sent, so the page is pinned to the posts that were there when it
+ * was queued. Clients that accept gzip get the compressed page instead. */
+static void queue_http_chat_response(struct out_queue *q, struct room *room,
+                                     int is_head, int keep_alive, int gzip) {
+    struct shared_buf *posts;
+    size_t posts_start, posts_len;
+
+    if (gzip) {
+        queue_http_chat_gzip_response(q, room, is_head, keep_alive);
+        return;
+    }
+    room_read_lock(room);
+    posts = room->cache.posts;
+    posts_start = room->cache.start;
+    posts_len = posts->len - posts_start;
+    if (!is_head) shared_buf_ref(posts);
+    room_unlock(room);
+
+    queue_http_response(q, "200 OK", NULL,
+                        room->head->len + posts_len +
+                        sizeof static_response_chat_tail - 1,
+                        1, keep_alive, "Vary: Accept-Encoding\r\n");
+    if (is_head) return;
+    shared_buf_ref(room->head);
+    outq_push_shared(q, room->head, 0, room->head->len);
+    outq_push_shared(q, posts, posts_start, posts_len);
+    outq_push(q, static_response_chat_tail,
+              sizeof static_response_chat_tail - 1, 0);
+}
+
+/* Queues the page of a room that doesn't exist, because nobody's posted in
+ * it yet, or not for a while. The room is only made when someone does. */
+static void queue_http_empty_room_response(struct out_queue *q, char *name,
+                                           size_t name_len, int is_head,
+                                           int keep_alive) {
+    struct shared_buf *head;
+    char key[RISKYCHAT_ROOM_NAME_LEN + 1];
+
+    memcpy(key, name, name_len);
+    key[name_len] = '\0';
+    head = render_chat_head(key);
+    queue_http_response(q, "200 OK", NULL,
+                        head->len + sizeof static_response_chat_tail - 1,
+                        1, keep_alive, "");
+    if (is_head) {
+        shared_buf_unref(head);
+        return;
+    }
+    outq_push_shared(q, head, 0, head->len);
+    outq_push(q, static_response_chat_tail,
+              sizeof static_response_chat_tail - 1, 0);
+}
+
+/* Appends to a growing buffer owned by the caller. */
+static void append_bytes(char **buf, size_t *len, size_t *allocated_len,
+                         char *data, size_t data_len) {
+    char *new_buf;
+    size_t new_len;
+
+    if (*len + data_len > *allocated_len) {
+        new_len = *allocated_len == 0 ? 4096 : *allocated_len * 2;
+        if (new_len < *len + data_len) new_len = *len + data_len;
+        new_buf = realloc(*buf, new_len);
+        if (new_buf == NULL) {
+            perror("error when expanding a buffer");
+            exit(EXIT_FAILURE);
+        }
+        *buf = new_buf;
+        *allocated_len = new_len;
+    }
+    memcpy(&(*buf)[*len], data, data_len);
+    *len += data_len;
+}
+
+/* Renders a page of RISKYCHAT_ARCHIVE_PAGE archived posts, page 0 being the
+ * most recently archived, into the queue's scratch buffer. This reads the
+ * archive files straight from the worker, but paging through old posts
+ * should be rare enough for that. Returns the page, with its length in
+ * *len, or NULL if there's no archive. */
+static char *render_archive_page(struct archive *archive, long page,
+                                 struct out_queue *q, size_t *len) {
+    FILE *log, *index;
+    char **buf, *text, line[32];
+    size_t *allocated_len;
+    long count, first, last, i;
+    unsigned long offset, seq, name_len, content_len;
+    long post_time;
+    int author_id, ok;
+
+    if (archive->log_path == NULL) return NULL;
+    log = fopen(archive->log_path, "rb");
+    index = fopen(archive->index_path, "rb");
+    if (log == NULL || index == NULL) {
+        if (log != NULL) fclose(log);
+        if (index != NULL) fclose(index);
+        return NULL;
+    }
+
+    /* The archive is written oldest first, and each index line is 16 bytes,
+     * so the page's posts can be found from the index's length. */
+    count = 0;
+    if (fseek(index, 0, SEEK_END) == 0) count = ftell(index) / 16;
+    /* The pages past the oldest are all empty, and multiplying them out
+     * could overflow. */
+    if (page > count / RISKYCHAT_ARCHIVE_PAGE + 1) {
+        page = count / RISKYCHAT_ARCHIVE_PAGE + 1;
+    }
+    last = count - page * RISKYCHAT_ARCHIVE_PAGE;
+    first = last - RISKYCHAT_ARCHIVE_PAGE;
+    if (first < 0) first = 0;
+
+    buf = &q->scratch;
+    *len = 0;
+    allocated_len = &q->allocated_scratch_len;
+    append_bytes(buf, len, allocated_len, static_response_archive_head,
+                 sizeof static_response_archive_head - 1);
+    append_bytes(buf, len, allocated_len, "<nav><a href=\"/\">Chat</a>",
+                 sizeof "<nav><a href=\"/\">Chat</a>" - 1);
+    if (first > 0) {
+        sprintf(line, "%ld\">Older</a>", page + 1);
+        append_bytes(buf, len, allocated_len, "<a href=\"/archive?page=",
+                     sizeof "<a href=\"/archive?page=" - 1);
+        append_bytes(buf, len, allocated_len, line, strlen(line));
+    }
+    if (page > 0) {
+        sprintf(line, "%ld\">Newer</a>", page - 1);
+        append_bytes(buf, len, allocated_len, "<a href=\"/archive?page=",
+                     sizeof "<a href=\"/archive?page=" - 1);
+        append_bytes(buf, len, allocated_len, line, strlen(line));
+    }
+    append_bytes(buf, len, allocated_len, "</nav><chatbox>\r\n",
+                 sizeof "</nav><chatbox>\r\n" - 1);
+
+    for (i = first; i < last; i++) {
+        ok = fseek(index, i * 16, SEEK_SET) == 0 &&
+            fgets(line, sizeof line, index) != NULL &&
+            sscanf(line, "%lx", &offset) == 1 &&
+            fseek(log, (long)offset, SEEK_SET) == 0 &&
+            fscanf(log, "%lu %ld %d %lu %lu", &seq, &post_time, &author_id,
+                   &name_len, &content_len) == 5 &&
+            fgetc(log) == '\n' &&
+            name_len + content_len <= RISKYCHAT_MAX_BODY_SIZE;
+        if (!ok) break;
+        text = malloc(name_len + content_len + 1);
+        if (text == NULL) {
+            perror("error when allocating an archived post");
+            exit(EXIT_FAILURE);
+        }
+        if (fread(text, 1, name_len + content_len, log) ==
+            name_len + content_len) {
+            append_bytes(buf, len, allocated_len, "<post><name>[",
+                         sizeof "<post><name>[" - 1);
+            append_bytes(buf, len, allocated_len, text, name_len);
+            append_bytes(buf, len, allocated_len, "]: </name>",
+                         sizeof "]: </name>" - 1);
+            append_bytes(buf, len, allocated_len, &text[name_len],
+                         content_len);
+            append_bytes(buf, len, allocated_len, "</post>",
+                         sizeof "</post>" - 1);
+        }
+        free(text);
+    }
+
+    append_bytes(buf, len, allocated_len, static_response_chat_tail,
+                 sizeof static_response_chat_tail - 1);
+    fclose(log);
+    fclose(index);
+    return *buf;
+}
+
+/* Queues a page of the archive, or a 404 if there's no archive. Returns
+ * the status responded with. */
+static enum status_code queue_http_archive_response(struct out_queue *q,
+                                                    long page, int is_head,
+                                                    int keep_alive) {
+    char *body;
+    size_t body_len;
+
+    body = render_archive_page(&ARCHIVE, page, q, &body_len);
+    if (body == NULL) {
+        queue_static_response(q, REPLY_404, is_head, keep_alive, 0);
+        return STATUS_404;
+    }
+    queue_http_response(q, "200 OK", body, body_len, is_head, keep_alive, "");
+    return STATUS_200;
+}
+
+/* Appends s as the contents of a JSON string, escaping quotes, backslashes
+ * and control characters. Runs of plain characters are copied in one go. */
+static void append_json_string(char **buf, size_t *len, size_t *allocated_len,
+                               char *s, size_t s_len) {
+    char escaped[8];
+    size_t i, run_start;
+    unsigned char c;
+
+    run_start = 0;
+    for (i = 0; i < s_len; i++) {
+        c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        append_bytes(buf, len, allocated_len, &s[run_start], i - run_start);
+        if (c == '"' || c == '\\') sprintf(escaped, "\\%c", c);
+        else sprintf(escaped, "\\u%04x", c);
+        append_bytes(buf, len, allocated_len, escaped, strlen(escaped));
+        run_start = i + 1;
+    }
+    append_bytes(buf, len, allocated_len, &s[run_start], s_len - run_start);
+}
+
+/* Appends the post as a JSON object, as in render_api_posts. */
+static void append_post_json(char **buf, size_t *len, size_t *allocated_len,
+                             struct post *post) {
+    char line[96];
+
+    sprintf(line, "{\"seq\":%lu,\"time\":%ld,\"name\":\"",
+            post->seq, (long)post->time);
+    append_bytes(buf, len, allocated_len, line, strlen(line));
+    append_json_string(buf, len, allocated_len, post->name, post->name_len);
+    append_bytes(buf, len, allocated_len, "\",\"content\":\"",
+                 sizeof "\",\"content\":\"" - 1);
+    append_json_string(buf, len, allocated_len,
+                       post->content, post->content_len);
+    append_bytes(buf, len, allocated_len, "\"}", 2);
+}
+
+/* Renders up to limit posts newer than since as JSON into the queue's
+ * scratch buffer:
+ *   {"oldest":3,"latest":5,"posts":[{"seq":4,"time":1600000000,
+ *   "name":"a","content":"b"},...]}
+ * The first post after since is found by its position in the ring, so this
+ * only touches the posts it returns. A client that's behind by more than
+ * limit posts can continue from the last seq it got, and one that sees
+ * oldest > since + 1 knows it missed some. Returns the JSON, with its length
+ * in *len. */
+static char *render_api_posts(struct out_queue *q, unsigned long since,
+                              long limit, size_t *len) {
+    char **buf, line[96];
+    size_t *allocated_len;
+    unsigned long i, latest;
+
+    buf = &q->scratch;
+    *len = 0;
+    allocated_len = &q->allocated_scratch_len;
+
+    posts_read_lock();
+    latest = LOBBY.log.first_seq + LOBBY.log.posts_len - 1;
+    sprintf(line, "{\"oldest\":%lu,\"latest\":%lu,\"posts\":[",
+            LOBBY.log.first_seq, latest);
+    append_bytes(buf, len, allocated_len, line, strlen(line));
+    i = since < LOBBY.log.first_seq ? 0 : since + 1 - LOBBY.log.first_seq;
+    for (; i < LOBBY.log.posts_len && limit > 0; i++, limit--) {
+        if ((*buf)[*len - 1] != '[') {
+            append_bytes(buf, len, allocated_len, ",", 1);
+        }
+        append_post_json(buf, len, allocated_len, post_log_get(&LOBBY.log, i));
+    }
+    posts_unlock();
+
+    append_bytes(buf, len, allocated_len, "]}\r\n", 4);
+    return *buf;
+}
+
+/* Queues the posts newer than since as JSON, see render_api_posts. */
+static void queue_http_api_posts_response(struct out_queue *q,
+                                          unsigned long since, long limit,
+                                          int is_head, int keep_alive) {
+    char *body;
+    size_t body_len;
+
+    body = render_api_posts(q, since, limit, &body_len);
+    queue_http_response(q, "200 OK", body, body_len, is_head, keep_alive,
+                        "Content-Type: application/json\r\n"
+                        "Cache-Control: no-store\r\n");
+}
+
+static char *RESOURCE_NAMES[RESOURCES_LEN] = {
+    "unknown", "index", "login", "post", "archive", "api_posts", "events",
+    "metrics", "room", "room_post"
+};
+static char *METHOD_NAMES[METHODS_LEN] = { "GET", "POST", "HEAD" };
+static int STATUS_CODES[STATUS_CODES_LEN] = {
+    200, 303, 400, 403, 404, 408, 429, 503
+};
+static char *STAGE_NAMES[6] = {
+    "request_line", "headers", "body", "respond", "send", "streaming"
+};
+static char *LATENCY_NAMES[LATENCY_STAGES_LEN] = {
+    "parse", "handle", "write"
+};
+
+/* Returns the seconds since some fixed point, for timing things. */
+static double monotonic_time(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+/* Returns the bucket for a duration of us microseconds: the first four are
+ * 0-3 us, and after that, the two bits after the leading one pick one of
+ * four buckets between each power of two and the next. */
+static int histogram_bucket(unsigned long us) {
+    int k, bucket;
+
+    if (us < 4) return (int)us;
+    k = floor_log2(us);
+    bucket = ((k - 1) << 2) + (int)((us >> (k - 2)) & 3);
+    return bucket < RISKYCHAT_HISTOGRAM_BUCKETS ?
+        bucket : RISKYCHAT_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Returns the upper bound of the bucket in microseconds, the inverse of
+ * histogram_bucket. */
+static double histogram_bound(int bucket) {
+    if (bucket < 4) return bucket + 1;
+    return (double)(5 + (bucket & 3)) * (1UL << ((bucket >> 2) - 1));
+}
+
+static void histogram_observe(struct histogram *h, double seconds) {
+    if (seconds < 0) seconds = 0;
+    h->buckets[histogram_bucket(seconds >= 4e9 ? 4000000000UL :
+                                (unsigned long)(seconds * 1e6))]++;
+    h->count++;
+    h->sum += seconds;
+}
+
+/* Records how long the timed stage that just ended took, and starts the
+ * next one: parsing starts when the first bytes of a request are in,
+ * handling when it's parsed, and writing when the response is queued, so
+ * writing includes waiting for the write-ahead log. */
+static void end_stage(struct connection_ctx *ctx, enum latency_stage stage) {
+    double now;
+
+    now = monotonic_time();
+    histogram_observe(&ctx->metrics->latency[stage], now - ctx->stage_start);
+    ctx->stage_start = now;
+}
+
+/* Counts the response that was just queued, in ctx->status. */
+static void count_response(struct connection_ctx *ctx) {
+    int i;
+
+    ctx->metrics->requests[ctx->requested_resource][ctx->method]
+        [ctx->status]++;
+    ctx->response_len = 0;
+    for (i = 0; i < ctx->out.chunks_len; i++) {
+        ctx->response_len += ctx->out.chunks[i].len;
+    }
+    end_stage(ctx, LATENCY_HANDLE);
+}
+
+/* Adds the request that was just responded to to the worker's access
+ * buffer, if there's an access log and room. */
+static void log_access(struct connection_ctx *ctx) {
+    struct access_buffer *access;
+    struct access_record record;
+
+    access = ctx->access;
+    if (access->records == NULL) return;
+    record.time = time(NULL);
+    record.addr = ctx->peer_addr;
+    record.user_id = ctx->user_id;
+    record.method = ctx->method;
+    record.resource = ctx->requested_resource;
+    record.status = ctx->status;
+    record.bytes = (unsigned long)ctx->response_len;
+    record.seconds = monotonic_time() - ctx->request_time;
+    access_lock(access);
+    if (access->len < RISKYCHAT_ACCESS_LOG_RECORDS) {
+        access->records[access->len++] = record;
+    } else {
+        access->dropped++;
+        ctx->metrics->access_dropped++;
+    }
+    access_unlock(access);
+}
+
+/* Appends lines of the metrics, formatted with printf. They should fit in
+ * 512 bytes. */
+static void append_metric(char **buf, size_t *len, size_t *allocated_len,
+                          char *format, ...) {
+    char line[512];
+    va_list args;
+
+    va_start(args, format);
+    vsprintf(line, format, args);
+    va_end(args);
+    append_bytes(buf, len, allocated_len, line, strlen(line));
+}
+
+/* Renders every worker's metrics, added up, in the Prometheus text format
+ * into the queue's scratch buffer. Only the request counts that aren't zero
+ * are listed. Returns the metrics, with their length in *len. */
+static char *render_metrics(struct out_queue *q, size_t *len) {
+    struct metrics total, *m;
+    char **buf;
+    size_t *allocated_len, text_len;
+    unsigned long posts_len, cumulative, max_posts;
+    int w, i, j, k, users_len, users_in, rooms_len;
+
+    buf = &q->scratch;
+    *len = 0;
+    allocated_len = &q->allocated_scratch_len;
+
+    memset(&total, 0, sizeof total);
+    for (w = 0; w < WORKERS_LEN; w++) {
+        m = &WORKERS[w].metrics;
+        for (i = 0; i < RESOURCES_LEN; i++) {
+            for (j = 0; j < METHODS_LEN; j++) {
+                for (k = 0; k < STATUS_CODES_LEN; k++) {
+                    total.requests[i][j][k] += m->requests[i][j][k];
+                }
+            }
+        }
+        total.accepted += m->accepted;
+        total.rejected += m->rejected;
+        total.access_dropped += m->access_dropped;
+        total.bytes_in += m->bytes_in;
+        total.bytes_out += m->bytes_out;
+        for (i = 0; i < 6; i++) total.stages[i] += m->stages[i];
+        for (i = 0; i < LATENCY_STAGES_LEN; i++) {
+            for (j = 0; j < RISKYCHAT_HISTOGRAM_BUCKETS; j++) {
+                total.latency[i].buckets[j] += m->latency[i].buckets[j];
+            }
+            total.latency[i].count += m->latency[i].count;
+            total.latency[i].sum += m->latency[i].sum;
+        }
+    }
+    posts_read_lock();
+    posts_len = LOBBY.log.posts_len;
+    text_len = LOBBY.log.text_len;
+    max_posts = RETENTION.max_posts;
+    posts_unlock();
+    rooms_lock();
+    rooms_len = ROOMS.len;
+    rooms_unlock();
+
+    users_lock();
+    user_table_sweep(&USERS, time(NULL));
+    users_len = USERS.len;
+    users_in = USERS.logged_in;
+    users_unlock();
+
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_requests_total Responses, by resource, "
+                  "method and status.\n"
+                  "# TYPE riskychat_requests_total counter\n");
+    for (i = 0; i < RESOURCES_LEN; i++) {
+        for (j = 0; j < METHODS_LEN; j++) {
+            for (k = 0; k < STATUS_CODES_LEN; k++) {
+                if (total.requests[i][j][k] == 0) continue;
+                append_metric(buf, len, allocated_len,
+                              "riskychat_requests_total{resource=\"%s\","
+                              "method=\"%s\",status=\"%d\"} %lu\n",
+                              RESOURCE_NAMES[i], METHOD_NAMES[j],
+                              STATUS_CODES[k], total.requests[i][j][k]);
+            }
+        }
+    }
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_connections Open connections, by stage, "
+                  "as of the last tick.\n"
+                  "# TYPE riskychat_connections gauge\n");
+    for (i = 0; i < 6; i++) {
+        append_metric(buf, len, allocated_len,
+                      "riskychat_connections{stage=\"%s\"} %d\n",
+                      STAGE_NAMES[i], total.stages[i]);
+    }
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_accepted_connections_total Connections "
+                  "accepted.\n"
+                  "# TYPE riskychat_accepted_connections_total counter\n"
+                  "riskychat_accepted_connections_total %lu\n",
+                  total.accepted);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_rejected_connections_total Connections "
+                  "turned away with a 503 at capacity.\n"
+                  "# TYPE riskychat_rejected_connections_total counter\n"
+                  "riskychat_rejected_connections_total %lu\n",
+                  total.rejected);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_access_log_dropped_total Requests left "
+                  "out of the access log for lack of room.\n"
+                  "# TYPE riskychat_access_log_dropped_total counter\n"
+                  "riskychat_access_log_dropped_total %lu\n",
+                  total.access_dropped);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_loop_lag_seconds How long each worker's "
+                  "event loop takes to get back to waiting, smoothed.\n"
+                  "# TYPE riskychat_loop_lag_seconds gauge\n");
+    for (w = 0; w < WORKERS_LEN; w++) {
+        append_metric(buf, len, allocated_len,
+                      "riskychat_loop_lag_seconds{worker=\"%d\"} %.6f\n", w,
+                      WORKERS[w].metrics.loop_lag);
+    }
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_shedding Whether each worker is turning "
+                  "away requests outside of sessions.\n"
+                  "# TYPE riskychat_shedding gauge\n");
+    for (w = 0; w < WORKERS_LEN; w++) {
+        append_metric(buf, len, allocated_len,
+                      "riskychat_shedding{worker=\"%d\"} %d\n", w,
+                      WORKERS[w].metrics.shedding);
+    }
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_received_bytes_total Bytes received.\n"
+                  "# TYPE riskychat_received_bytes_total counter\n"
+                  "riskychat_received_bytes_total %.0f\n", total.bytes_in);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_sent_bytes_total Bytes sent.\n"
+                  "# TYPE riskychat_sent_bytes_total counter\n"
+                  "riskychat_sent_bytes_total %.0f\n", total.bytes_out);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_posts Posts kept in memory.\n"
+                  "# TYPE riskychat_posts gauge\n"
+                  "riskychat_posts %lu\n"
+                  "# HELP riskychat_posts_max Posts kept in memory at most.\n"
+                  "# TYPE riskychat_posts_max gauge\n"
+                  "riskychat_posts_max %lu\n", posts_len, max_posts);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_post_bytes Bytes of names and contents "
+                  "of the posts in memory.\n"
+                  "# TYPE riskychat_post_bytes gauge\n"
+                  "riskychat_post_bytes %lu\n", (unsigned long)text_len);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_users Users in the user table, including "
+                  "expired ones not yet reused.\n"
+                  "# TYPE riskychat_users gauge\n"
+                  "riskychat_users %d\n"
+                  "# HELP riskychat_users_logged_in Users logged in.\n"
+                  "# TYPE riskychat_users_logged_in gauge\n"
+                  "riskychat_users_logged_in %d\n", users_len, users_in);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_rooms Rooms kept in memory, besides the "
+                  "lobby.\n"
+                  "# TYPE riskychat_rooms gauge\n"
+                  "riskychat_rooms %d\n", rooms_len);
+    append_metric(buf, len, allocated_len,
+                  "# HELP riskychat_stage_seconds How long requests spent "
+                  "being parsed, handled and written.\n"
+                  "# TYPE riskychat_stage_seconds histogram\n");
+    for (i = 0; i < LATENCY_STAGES_LEN; i++) {
+        cumulative = 0;
+        for (j = 0; j < RISKYCHAT_HISTOGRAM_BUCKETS - 1; j++) {
+            cumulative += total.latency[i].buckets[j];
+            append_metric(buf, len, allocated_len,
+                          "riskychat_stage_seconds_bucket{stage=\"%s\","
+                          "le=\"%g\"} %lu\n", LATENCY_NAMES[i],
+                          histogram_bound(j) / 1e6, cumulative);
+        }
+        append_metric(buf, len, allocated_len,
+                      "riskychat_stage_seconds_bucket{stage=\"%s\","
+                      "le=\"+Inf\"} %lu\n"
+                      "riskychat_stage_seconds_sum{stage=\"%s\"} %.9g\n"
+                      "riskychat_stage_seconds_count{stage=\"%s\"} %lu\n",
+                      LATENCY_NAMES[i], total.latency[i].count,
+                      LATENCY_NAMES[i], total.latency[i].sum,
+                      LATENCY_NAMES[i], total.latency[i].count);
+    }
+    return *buf;
+}
+
+/* Queues the metrics, see render_metrics. */
+static void queue_http_metrics_response(struct out_queue *q, int is_head,
+                                        int keep_alive) {
+    char *body;
+    size_t body_len;
+
+    body = render_metrics(q, &body_len);
+    queue_http_response(q, "200 OK", body, body_len, is_head, keep_alive,
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Cache-Control: no-store\r\n");
+}
+
+/* Opens the access log for appending, once on startup and again on
+ * SIGHUP, so the file can be moved away and a new one started. */
+static int access_log_open(struct access_log *log, char *path) {
+    log->path = path;
+    log->file = fopen(path, "ab");
+    if (log->file == NULL) {
+        fprintf(stderr, "could not open the access log %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes out what's left in the access buffers and closes the log. */
+static void access_log_close(struct access_log *log) {
+    access_log_flush(log);
+    fclose(log->file);
+    log->file = NULL;
+    free(log->text);
+    log->text = NULL;
+    log->allocated_text_len = 0;
+}
+
+/* Returns the time as text, formatting it only once per second. */
+static char *access_log_time(struct access_log *log, time_t t) {
+    if (t != log->time) {
+        log->time = t;
+        strftime(log->time_text, sizeof log->time_text,
+                 "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    }
+    return log->time_text;
+}
+
+/* Appends a record to the text as a line of JSON. */
+static void access_log_append(struct access_log *log, size_t *len,
+                              struct access_record *record) {
+    char line[256];
+    size_t line_len;
+
+    line_len = sprintf(line, "{\"time\":\"%s\",\"addr\":\"%lu.%lu.%lu.%lu\","
+                       "\"user\":%d,\"method\":\"%s\",\"resource\":\"%s\","
+                       "\"status\":%d,\"bytes\":%lu,\"seconds\":%.6f}\n",
+                       access_log_time(log, record->time),
+                       (record->addr >> 24) & 0xFF,
+                       (record->addr >> 16) & 0xFF, (record->addr >> 8) & 0xFF,
+                       record->addr & 0xFF, record->user_id,
+                       METHOD_NAMES[record->method],
+                       RESOURCE_NAMES[record->resource],
+                       STATUS_CODES[record->status], record->bytes,
+                       record->seconds);
+    append_bytes(&log->text, len, &log->allocated_text_len, line, line_len);
+}
+
+/* Takes every worker's waiting records, and writes them out in one go, with
+ * a line for how many were dropped since the last time, if any were. If
+ * SIGHUP has asked for it, the file is opened again first. */
+static void access_log_flush(struct access_log *log) {
+    struct access_buffer *access;
+    struct access_record *records;
+    unsigned long dropped;
+    size_t len;
+    int w, i, records_len;
+    char line[128];
+
+    if (ACCESS_LOG_REOPEN) {
+        ACCESS_LOG_REOPEN = 0;
+        fclose(log->file);
+        if (access_log_open(log, log->path) == -1) return;
+    }
+    if (log->file == NULL) return;
+
+    len = 0;
+    for (w = 0; w < WORKERS_LEN; w++) {
+        access = &WORKERS[w].access;
+        if (access->records == NULL) continue;
+        access_lock(access);
+        records = access->records;
+        records_len = access->len;
+        dropped = access->dropped;
+        access->records = access->spare;
+        access->spare = records;
+        access->len = 0;
+        access->dropped = 0;
+        access_unlock(access);
+
+        for (i = 0; i < records_len; i++) {
+            access_log_append(log, &len, &records[i]);
+        }
+        if (dropped > 0) {
+            sprintf(line, "{\"time\":\"%s\",\"dropped\":%lu}\n",
+                    access_log_time(log, time(NULL)), dropped);
+            append_bytes(&log->text, &len, &log->allocated_text_len, line,
+                         strlen(line));
+        }
+    }
+    if (len == 0) return;
+    if (fwrite(log->text, 1, len, log->file) != len ||
+        fflush(log->file) != 0) {
+        perror("error writing the access log");
+    }
+}
+
+#ifdef RISKYCHAT_THREADS
+/* The access log's writer: writes out the records every
+ * RISKYCHAT_ACCESS_LOG_FLUSH_MS, until the server is terminated. */
+static void *access_log_run(void *arg) {
+    struct timespec interval;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = RISKYCHAT_ACCESS_LOG_FLUSH_MS * 1000000L;
+    while (!SERVER_TERMINATED) {
+        nanosleep(&interval, NULL);
+        access_log_flush(arg);
+    }
+    return NULL;
+}
+#endif
+
+/* Starts an event stream: queues the headers, and picks the post to start
+ * from. A client resuming with Last-Event-ID gets the posts it missed, at
+ * most RISKYCHAT_API_LIMIT of them, the rest it can get from /api/posts.
+ * Others only get the posts from now on. */
+static void start_event_stream(struct connection_ctx *ctx) {
+    unsigned long latest, after;
+
+    outq_push(&ctx->out, static_response_events_head,
+              sizeof static_response_events_head - 1, 0);
+    posts_read_lock();
+    latest = LOBBY.log.first_seq + LOBBY.log.posts_len - 1;
+    after = ctx->last_event_id;
+    if (after == 0 || after > latest) after = latest;
+    if (latest - after > RISKYCHAT_API_LIMIT) {
+        after = latest - RISKYCHAT_API_LIMIT;
+    }
+    if (after + 1 < LOBBY.log.first_seq) after = LOBBY.log.first_seq - 1;
+    posts_unlock();
+    ctx->event_seq = after;
+    ctx->event_offset = 0;
+    ctx->heartbeat_len = 0;
+}
+
+/* Writes the pending heartbeat and the events after ctx->event_seq to the
+ * subscriber, RISKYCHAT_MAX_IOV per syscall, until it's caught up or the
+ * socket is full. Should be called with the posts read-locked, which keeps
+ * the events in place while they're written. Returns 1 when caught up, -1
+ * on error (including would-block), and 0 if the subscriber has fallen more
+ * than RISKYCHAT_SSE_MAX_BEHIND bytes behind, or so far behind that the
+ * posts it needs are gone. */
+static int write_events(struct connection_ctx *ctx) {
+    struct post *post;
+    unsigned long i, j;
+    ssize_t result;
+    size_t sent, left;
+    int iov_len;
+#ifdef _WIN32
+    WSABUF iov[RISKYCHAT_MAX_IOV];
+    DWORD wsa_sent;
+#else
+    struct iovec iov[RISKYCHAT_MAX_IOV];
+#endif
+
+    for (;;) {
+        if (ctx->event_seq + 1 < LOBBY.log.first_seq) return 0;
+        i = ctx->event_seq + 1 - LOBBY.log.first_seq;
+        if (i >= LOBBY.log.posts_len && ctx->heartbeat_len == 0) return 1;
+        if (i < LOBBY.log.posts_len &&
+            LOBBY.log.events_len - post_log_get(&LOBBY.log, i)->event_start -
+            ctx->event_offset > RISKYCHAT_SSE_MAX_BEHIND) {
+            return 0;
+        }
+
+        iov_len = 0;
+        if (ctx->heartbeat_len > 0) {
+#ifdef _WIN32
+            iov[0].buf = &static_event_heartbeat[
+                sizeof static_event_heartbeat - 1 - ctx->heartbeat_len];
+            iov[0].len = (ULONG)ctx->heartbeat_len;
+#else
+            iov[0].iov_base = &static_event_heartbeat[
+                sizeof static_event_heartbeat - 1 - ctx->heartbeat_len];
+            iov[0].iov_len = ctx->heartbeat_len;
+#endif
+            iov_len++;
+        }
+        for (j = i; j < LOBBY.log.posts_len && iov_len < RISKYCHAT_MAX_IOV;
+             j++) {
+            post = post_log_get(&LOBBY.log, j);
+            sent = j == i ? ctx->event_offset : 0;
+#ifdef _WIN32
+            iov[iov_len].buf = &post->event[sent];
+            iov[iov_len].len = (ULONG)(post->event_len - sent);
+#else
+            iov[iov_len].iov_base = &post->event[sent];
+            iov[iov_len].iov_len = post->event_len - sent;
+#endif
+            iov_len++;
+        }
+
+#ifdef _WIN32
+        if (WSASend(ctx->connect_fd, iov, iov_len, &wsa_sent, 0,
+                    NULL, NULL) != 0) {
+            return -1;
+        }
+        result = wsa_sent;
+#else
+        result = writev(ctx->connect_fd, iov, iov_len);
         if (result == -1) return -1;
-        else *written_len += result;
+#endif
+
+        /* Move past whatever got sent, the heartbeat first. */
+        sent = result;
+        ctx->metrics->bytes_out += sent;
+        left = sent < ctx->heartbeat_len ? sent : ctx->heartbeat_len;
+        ctx->heartbeat_len -= left;
+        sent -= left;
+        for (j = i; sent > 0; j++) {
+            post = post_log_get(&LOBBY.log, j);
+            left = post->event_len - ctx->event_offset;
+            if (sent < left) {
+                ctx->event_offset += sent;
+                break;
+            }
+            sent -= left;
+            ctx->event_seq = post->seq;
+            ctx->event_offset = 0;
+        }
+    }
+}
+
+/* Sets up an empty log with room for max_posts posts. */
+static void post_log_init(struct post_log *log, unsigned long max_posts) {
+    memset(log, 0, sizeof *log);
+    log->first_seq = 1;
+    log->allocated_posts_len = max_posts;
+    log->posts = malloc(max_posts * sizeof log->posts[0]);
+    if (log->posts == NULL) {
+        perror("error when allocating the post log");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void post_log_free(struct post_log *log) {
+    struct arena_block *block, *next;
+
+    for (block = log->first_block; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(log->posts);
+    memset(log, 0, sizeof *log);
+}
+
+/* Returns the i:th post in the log, counting from the oldest. */
+static struct post *post_log_get(struct post_log *log, unsigned long i) {
+    return &log->posts[(log->head + i) % log->allocated_posts_len];
+}
+
+/* Returns room for len bytes at the end of the log's arena, starting a new
+ * block if the last one doesn't have enough. The new block is written into
+ * *block. */
+static char *post_log_alloc(struct post_log *log, size_t len,
+                            struct arena_block **blockp) {
+    struct arena_block *block;
+    size_t block_len;
+
+    block = log->last_block;
+    if (block == NULL || block->allocated_len - block->len < len) {
+        block_len = len > RISKYCHAT_ARENA_SIZE ? len : RISKYCHAT_ARENA_SIZE;
+        block = malloc(sizeof *block + block_len);
+        if (block == NULL) {
+            perror("error when allocating a post arena block");
+            exit(EXIT_FAILURE);
+        }
+        block->next = NULL;
+        block->len = 0;
+        block->allocated_len = block_len;
+        block->data = (char *)(block + 1);
+        if (log->last_block == NULL) log->first_block = block;
+        else log->last_block->next = block;
+        log->last_block = block;
+        log->arena_len += block_len;
+    }
+    block->len += len;
+    *blockp = block;
+    return &block->data[block->len - len];
+}
+
+/* Appends a post to the log, copying the name and content. The log should
+ * have room for it, see post_log_remove_oldest. Takes time proportional to
+ * the length of the post, not the log. Returns the new post, which stays
+ * valid until it's removed. */
+static struct post *post_log_append(struct post_log *log, int author_id,
+                                    char *name, size_t name_len,
+                                    char *content, size_t content_len,
+                                    time_t now) {
+    struct post *post;
+    struct arena_block *block;
+    char *text;
+
+    text = post_log_alloc(log, name_len + content_len, &block);
+    memcpy(text, name, name_len);
+    memcpy(&text[name_len], content, content_len);
+
+    post = post_log_get(log, log->posts_len);
+    post->seq = log->first_seq + log->posts_len;
+    post->time = now;
+    post->author_id = author_id;
+    post->name = text;
+    post->name_len = name_len;
+    post->content = &text[name_len];
+    post->content_len = content_len;
+    post->block = block;
+    post->rendered_len = 0;
+    post->event = NULL;
+    post->event_len = 0;
+    post->event_start = log->events_len;
+    log->posts_len++;
+    log->text_len += name_len + content_len;
+    return post;
+}
+
+/* Drops the oldest post from the log, along with any arena blocks that
+ * aren't needed anymore. */
+static void post_log_remove_oldest(struct post_log *log) {
+    struct post *oldest;
+    struct arena_block *block;
+
+    oldest = post_log_get(log, 0);
+    log->text_len -= oldest->name_len + oldest->content_len;
+    log->head = (log->head + 1) % log->allocated_posts_len;
+    log->posts_len--;
+    log->first_seq++;
+
+    if (log->posts_len == 0) {
+        /* Everything's gone, the last block can be reused from the start. */
+        while (log->first_block != log->last_block) {
+            block = log->first_block;
+            log->first_block = block->next;
+            log->arena_len -= block->allocated_len;
+            free(block);
+        }
+        if (log->last_block != NULL) log->last_block->len = 0;
+    } else {
+        oldest = post_log_get(log, 0);
+        while (log->first_block != oldest->block) {
+            block = log->first_block;
+            log->first_block = block->next;
+            log->arena_len -= block->allocated_len;
+            free(block);
+        }
+    }
+}
+
+/* Appends to the cache, in place if there's room. If there isn't, the
+ * buffer is replaced with a copy of the posts still in the cache, with room
+ * to grow, so the buffer stays proportional to the posts kept around. */
+static void render_cache_append(struct render_cache *cache,
+                                char *data, size_t len) {
+    struct shared_buf *buf, *new_buf;
+    size_t live_len, new_len;
+
+    buf = cache->posts;
+    if (buf->len + len > buf->allocated_len) {
+        live_len = buf->len - cache->start;
+        new_len = (live_len + len) * 2;
+        if (new_len < RISKYCHAT_CACHE_SIZE) new_len = RISKYCHAT_CACHE_SIZE;
+        new_buf = shared_buf_new(new_len);
+        memcpy(new_buf->data, &buf->data[cache->start], live_len);
+        new_buf->len = live_len;
+        shared_buf_unref(buf);
+        cache->posts = buf = new_buf;
+        cache->start = 0;
+    }
+    memcpy(&buf->data[buf->len], data, len);
+    buf->len += len;
+}
+
+/* Renders the post onto the end of the cached page. */
+static void render_post(struct render_cache *cache, struct post *post) {
+    size_t start_len;
+
+    start_len = cache->posts->len - cache->start;
+    render_cache_append(cache, "<post><name>[", sizeof "<post><name>[" - 1);
+    render_cache_append(cache, post->name, post->name_len);
+    render_cache_append(cache, "]: </name>", sizeof "]: </name>" - 1);
+    render_cache_append(cache, post->content, post->content_len);
+    render_cache_append(cache, "</post>", sizeof "</post>" - 1);
+    post->rendered_len = cache->posts->len - cache->start - start_len;
+}
+
+/* Renders the post as a server-sent event, "id: <seq>" and "data: <the post
+ * as JSON>", into the log's arena. It's rendered once, and every subscriber
+ * is sent the same bytes straight from the arena. Should be called with the
+ * posts write-locked. */
+static void render_post_event(struct post_log *log, struct post *post) {
+    struct arena_block *block;
+    size_t len;
+    char line[32];
+
+    len = 0;
+    sprintf(line, "id: %lu\ndata: ", post->seq);
+    append_bytes(&EVENT_SCRATCH, &len, &EVENT_SCRATCH_LEN,
+                 line, strlen(line));
+    append_post_json(&EVENT_SCRATCH, &len, &EVENT_SCRATCH_LEN, post);
+    append_bytes(&EVENT_SCRATCH, &len, &EVENT_SCRATCH_LEN, "\n\n", 2);
+    /* The event may land in a newer block than the post's text, which is
+     * fine, the blocks are freed oldest first. */
+    post->event = post_log_alloc(log, len, &block);
+    memcpy(post->event, EVENT_SCRATCH, len);
+    post->event_len = len;
+    log->events_len += len;
+}
+
+/* Returns 0 on success, -1 on error. */
+static int archive_open(struct archive *archive, char *path) {
+    size_t path_len;
+
+    path_len = strlen(path);
+    archive->log_path = path;
+    archive->index_path = malloc(path_len + sizeof ".idx");
+    if (archive->index_path == NULL) {
+        perror("error when allocating the archive index path");
+        return -1;
+    }
+    memcpy(archive->index_path, path, path_len);
+    memcpy(&archive->index_path[path_len], ".idx", sizeof ".idx");
+
+    archive->log = fopen(archive->log_path, "ab");
+    if (archive->log == NULL) {
+        perror("could not open the archive");
+        return -1;
+    }
+    archive->index = fopen(archive->index_path, "ab");
+    if (archive->index == NULL) {
+        perror("could not open the archive index");
+        return -1;
+    }
+    return 0;
+}
+
+static void archive_close(struct archive *archive) {
+    if (archive->log != NULL) fclose(archive->log);
+    if (archive->index != NULL) fclose(archive->index);
+    free(archive->index_path);
+    memset(archive, 0, sizeof *archive);
+}
+
+/* Writes the post at the end of the archive. Each post is a header line
+ * with the sequence number, time, author and lengths, followed by the name
+ * and the content, and a newline. The index gets a line with the offset of
+ * the header, in 15 hex digits, so every index line is the same length. */
+static void archive_post(struct archive *archive, struct post *post) {
+    long offset;
+
+    if (archive->log == NULL) return;
+    offset = ftell(archive->log);
+    if (offset == -1 ||
+        fprintf(archive->log, "%lu %ld %d %lu %lu\n", post->seq,
+                (long)post->time, post->author_id,
+                (unsigned long)post->name_len,
+                (unsigned long)post->content_len) < 0 ||
+        fwrite(post->name, 1, post->name_len, archive->log) !=
+        post->name_len ||
+        fwrite(post->content, 1, post->content_len, archive->log) !=
+        post->content_len ||
+        fputc('\n', archive->log) == EOF ||
+        fprintf(archive->index, "%015lx\n", (unsigned long)offset) < 0) {
+        perror("error when archiving a post");
+    }
+}
+
+/* Appends a record to the log's buffer: the payload's length and CRC-32,
+ * and then the payload, which is head followed by the two texts. Should be
+ * called with the users locked, so the records are in the same order as the
+ * changes they describe. */
+static void wal_append(struct wal *wal, char *head, size_t head_len,
+                       char *a, size_t a_len, char *b, size_t b_len) {
+    char frame[8];
+    unsigned long crc;
+
+    if (wal->fd == -1) return;
+    crc = crc32_update(0, head, head_len);
+    crc = crc32_update(crc, a, a_len);
+    crc = crc32_update(crc, b, b_len);
+    put_u32(frame, head_len + a_len + b_len);
+    put_u32(&frame[4], crc);
+    wal_lock();
+    append_bytes(&wal->buf, &wal->len, &wal->allocated_len, frame, 8);
+    append_bytes(&wal->buf, &wal->len, &wal->allocated_len, head, head_len);
+    append_bytes(&wal->buf, &wal->len, &wal->allocated_len, a, a_len);
+    append_bytes(&wal->buf, &wal->len, &wal->allocated_len, b, b_len);
+    wal->appended++;
+    wal_unlock();
+}
+
+/* A new user: 'U', the id and the time, then the name. */
+static void wal_log_user(struct wal *wal, int id, time_t now, char *name) {
+    char head[9];
+
+    head[0] = 'U';
+    put_u32(&head[1], id);
+    put_u32(&head[5], (unsigned long)now);
+    wal_append(wal, head, sizeof head, name, strlen(name), "", 0);
+}
+
+/* A new post: 'P', the author's id, the time and the name's length, then
+ * the name and the content. The sequence number follows from the order. */
+static void wal_log_post(struct wal *wal, int author_id, time_t now,
+                         char *name, size_t name_len,
+                         char *content, size_t content_len) {
+    char head[13];
+
+    head[0] = 'P';
+    put_u32(&head[1], author_id);
+    put_u32(&head[5], (unsigned long)now);
+    put_u32(&head[9], name_len);
+    wal_append(wal, head, sizeof head, name, name_len, content, content_len);
+}
+
+/* Returns the record that a response should wait for, after its request has
+ * been logged, or 0 if it doesn't need to wait: with SYNC_ALWAYS the log is
+ * committed right here, and with SYNC_NONE no one waits for the disk. */
+static unsigned long wal_wait_record(struct wal *wal) {
+    unsigned long record;
+
+    if (wal->fd == -1 || wal->sync == SYNC_NONE) return 0;
+    if (wal->sync == SYNC_ALWAYS) {
+        wal_commit(wal);
+        return 0;
+    }
+    wal_lock();
+    record = wal->appended;
+    wal_unlock();
+    return record;
+}
+
+static int wal_is_synced(struct wal *wal, unsigned long record) {
+    int synced;
+
+    wal_lock();
+    synced = wal->synced >= record;
+    wal_unlock();
+    return synced;
+}
+
+/* Writes out the records appended so far, and syncs them unless the policy
+ * is SYNC_NONE. One commit covers every worker's records, so a worker that
+ * finds its records already committed by another is done right away. The
+ * buffers are swapped for the write, so appending can go on meanwhile. */
+static void wal_commit(struct wal *wal) {
+    char *data;
+    size_t len, allocated_len, written;
+    ssize_t result;
+    unsigned long target;
+
+    if (wal->fd == -1) return;
+    commit_lock();
+    wal_lock();
+    if (wal->synced == wal->appended) {
+        wal_unlock();
+        commit_unlock();
+        return;
+    }
+    data = wal->buf;
+    len = wal->len;
+    allocated_len = wal->allocated_len;
+    wal->buf = wal->spare;
+    wal->allocated_len = wal->allocated_spare_len;
+    wal->len = 0;
+    wal->spare = data;
+    wal->allocated_spare_len = allocated_len;
+    target = wal->appended;
+    wal_unlock();
+
+    for (written = 0; written < len; written += result) {
+        result = write(wal->fd, &data[written], len - written);
+        if (result == -1 && errno == EINTR) {
+            result = 0;
+        } else if (result == -1) {
+            perror("error when writing the write-ahead log");
+            break;
+        }
+    }
+    if (wal->sync != SYNC_NONE && fsync(wal->fd) == -1) {
+        perror("error when syncing the write-ahead log");
+    }
+
+    /* Even if the write failed, the responses waiting for it go out, the
+     * error has been reported and the server keeps running. */
+    wal_lock();
+    wal->synced = target;
+    wal_unlock();
+    commit_unlock();
+}
+
+/* Removes the room's oldest posts until it's within its retention limits,
+ * with room for a new post of new_len bytes if adding. The lobby's removed
+ * posts are archived, if there's an archive. Should be called with the
+ * room write-locked. */
+static void enforce_retention(struct room *room, int adding, size_t new_len,
+                              time_t now) {
+    struct retention *retention;
+    struct post *oldest;
+    int removed;
+
+    retention = &room->retention;
+    removed = 0;
+    while (room->log.posts_len > 0) {
+        oldest = post_log_get(&room->log, 0);
+        if (room->log.posts_len + adding <= retention->max_posts &&
+            (retention->max_bytes == 0 ||
+             room->log.text_len + new_len <= retention->max_bytes) &&
+            (retention->max_age == 0 ||
+             now - oldest->time <= retention->max_age)) {
+            break;
+        }
+        if (room == &LOBBY) archive_post(&ARCHIVE, oldest);
+        gzip_cache_drop(&room->gzip, &room->cache, oldest->rendered_len);
+        room->cache.start += oldest->rendered_len;
+        post_log_remove_oldest(&room->log);
+        removed = 1;
+    }
+    if (removed) gzip_cache_trim(&room->gzip, &room->cache);
+    if (removed && room == &LOBBY && ARCHIVE.log != NULL) {
+        fflush(ARCHIVE.log);
+        fflush(ARCHIVE.index);
+    }
+}
+
+/* Removes the posts that are older than the retention allows, in the lobby
+ * and the other rooms, and lets go of the compressors of the rooms that
+ * haven't been posted in for RISKYCHAT_ROOM_QUIET seconds. The rooms are
+ * pinned while it's done, so that ROOMS_LOCK isn't held while waiting for
+ * each one. */
+static void expire_posts(void) {
+    struct room *rooms[RISKYCHAT_MAX_ROOMS], *room;
+    time_t now;
+    int i, rooms_len;
+
+    now = time(NULL);
+    if (RETENTION.max_age != 0) {
+        posts_write_lock();
+        enforce_retention(&LOBBY, 0, 0, now);
+        posts_unlock();
+    }
+
+    rooms_len = 0;
+    rooms_lock();
+    for (i = 0; i < RISKYCHAT_ROOM_BUCKETS; i++) {
+        for (room = ROOMS.buckets[i]; room != NULL; room = room->next) {
+            room->refs++;
+            rooms[rooms_len++] = room;
+        }
+    }
+    rooms_unlock();
+    for (i = 0; i < rooms_len; i++) {
+        room = rooms[i];
+        room_write_lock(room);
+        if (RETENTION.max_age != 0) enforce_retention(room, 0, 0, now);
+        if (room->log.posts_len == 0 ||
+            now - post_log_get(&room->log, room->log.posts_len - 1)->time >=
+            RISKYCHAT_ROOM_QUIET) {
+            gzip_cache_quiet(&room->gzip);
+        }
+        room_unlock(room);
+        room_close(room);
+    }
+}
+
+/* Adds a post to the room's log and renders it. The lobby's posts are also
+ * rendered as events. Should be called with the room write-locked. */
+static void append_post(struct room *room, int author_id, char *name,
+                        size_t name_len, char *content, size_t content_len,
+                        time_t now) {
+    struct post *post;
+
+    enforce_retention(room, 1, name_len + content_len, now);
+    post = post_log_append(&room->log, author_id, name, name_len,
+                           content, content_len, now);
+    render_post(&room->cache, post);
+    gzip_cache_add(&room->gzip, &room->cache, post->rendered_len);
+    if (room == &LOBBY) render_post_event(&room->log, post);
+}
+
+/* Posts the form's content in the room as the user, if they're logged in.
+ * Only the lobby's posts are logged, and sent to the subscribers. The log
+ * has to be in the same order as the posts, so the users stay locked while
+ * posting in the lobby. The other rooms just take a copy of the name, so
+ * posting in them doesn't hold up logins or the other rooms. */
+static void post_to_room(struct room *room, char *buffer, size_t buffer_len,
+                         int user_id) {
+    char *name;
+    size_t name_len;
+    time_t now;
+
+    buffer = form_value(buffer, buffer_len, "content", &buffer_len);
+    if (buffer == NULL) return;
+
+    users_lock();
+    if (user_id <= 0 || user_id >= USERS.users_len ||
+        USERS.users[user_id].name == NULL) {
+        users_unlock();
+        return;
+    }
+
+    name_len = strlen(USERS.users[user_id].name);
+    now = time(NULL);
+    if (room == &LOBBY) {
+        room_write_lock(room);
+        append_post(room, user_id, USERS.users[user_id].name, name_len,
+                    buffer, buffer_len, now);
+        wal_log_post(&WAL, user_id, now, USERS.users[user_id].name, name_len,
+                     buffer, buffer_len);
+        room_unlock(room);
+        users_unlock();
+        wake_workers();
+        return;
+    }
+
+    name = malloc(name_len + 1);
+    if (name == NULL) {
+        perror("error when allocating name");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(name, USERS.users[user_id].name, name_len);
+    users_unlock();
+    room_write_lock(room);
+    append_post(room, user_id, name, name_len, buffer, buffer_len, now);
+    room_unlock(room);
+    free(name);
+}
+
+void add_new_post(char *buffer, size_t buffer_len, int user_id) {
+    post_to_room(&LOBBY, buffer, buffer_len, user_id);
+}
+
+/* Sets up an empty room, with the retention limits from the options, though
+ * the rooms other than the lobby are kept smaller, since there can be many
+ * of them. */
+static void room_init(struct room *room, char *name, size_t name_len) {
+    memset(room, 0, sizeof *room);
+    memcpy(room->name, name, name_len);
+    room->name[name_len] = '\0';
+    room->retention = RETENTION;
+    if (name_len > 0) {
+        if (room->retention.max_posts > RISKYCHAT_ROOM_MAX_POSTS) {
+            room->retention.max_posts = RISKYCHAT_ROOM_MAX_POSTS;
+        }
+        if (room->retention.max_bytes == 0 ||
+            room->retention.max_bytes > RISKYCHAT_ROOM_MAX_POST_BYTES) {
+            room->retention.max_bytes = RISKYCHAT_ROOM_MAX_POST_BYTES;
+        }
+    }
+    room->head = render_chat_head(room->name);
+    post_log_init(&room->log, room->retention.max_posts);
+    room->cache.posts = shared_buf_new(RISKYCHAT_CACHE_SIZE);
+    gzip_cache_init(&room->gzip, room->head);
+#ifdef RISKYCHAT_THREADS
+    pthread_rwlock_init(&room->lock, NULL);
+#endif
+}
+
+/* Frees what the room holds, but not the room. The responses still being
+ * sent from it hold on to the buffers they need. */
+static void room_free(struct room *room) {
+    post_log_free(&room->log);
+    shared_buf_unref(room->cache.posts);
+    gzip_cache_free(&room->gzip);
+    shared_buf_unref(room->head);
+#ifdef RISKYCHAT_THREADS
+    pthread_rwlock_destroy(&room->lock);
+#endif
+}
+
+/* Unlinks the room from the table and frees it. Should be called with
+ * ROOMS_LOCK held, and the room unused. */
+static void room_evict(struct room *room) {
+    struct room **link;
+
+    link = &ROOMS.buckets[hash_name(room->name) % RISKYCHAT_ROOM_BUCKETS];
+    while (*link != room) link = &(*link)->next;
+    *link = room->next;
+    ROOMS.len--;
+    room_free(room);
+    free(room);
+}
+
+/* Returns the room with the name, pinned until room_close, or the lobby if
+ * the name is empty. If there's no such room, it's made if create is set,
+ * evicting the least recently used room if there are too many already.
+ * Returns NULL if there's no room, or no room for it. */
+static struct room *room_open(char *name, size_t name_len, int create) {
+    struct room *room, *oldest;
+    char key[RISKYCHAT_ROOM_NAME_LEN + 1];
+    unsigned long bucket;
+    int i;
+
+    if (name_len == 0) return &LOBBY;
+    if (name_len > RISKYCHAT_ROOM_NAME_LEN) return NULL;
+    memcpy(key, name, name_len);
+    key[name_len] = '\0';
+    bucket = hash_name(key) % RISKYCHAT_ROOM_BUCKETS;
+
+    rooms_lock();
+    for (room = ROOMS.buckets[bucket]; room != NULL; room = room->next) {
+        if (strcmp(room->name, key) == 0) break;
+    }
+    if (room == NULL && create) {
+        if (ROOMS.len >= RISKYCHAT_MAX_ROOMS) {
+            oldest = NULL;
+            for (i = 0; i < RISKYCHAT_ROOM_BUCKETS; i++) {
+                for (room = ROOMS.buckets[i]; room != NULL;
+                     room = room->next) {
+                    if (room->refs == 0 && (oldest == NULL ||
+                        room->last_active < oldest->last_active)) {
+                        oldest = room;
+                    }
+                }
+            }
+            if (oldest != NULL) room_evict(oldest);
+        }
+        if (ROOMS.len < RISKYCHAT_MAX_ROOMS) {
+            room = malloc(sizeof *room);
+            if (room == NULL) {
+                perror("error when allocating a room");
+                exit(EXIT_FAILURE);
+            }
+            room_init(room, key, name_len);
+            room->next = ROOMS.buckets[bucket];
+            ROOMS.buckets[bucket] = room;
+            ROOMS.len++;
+        }
     }
-    return buf_len;
+    if (room != NULL) {
+        room->refs++;
+        room->last_active = time(NULL);
+    }
+    rooms_unlock();
+    return room;
 }
 
-static char chunk_terminator[] = "\r\n";
-static ssize_t write_chunk_terminator(int fd, size_t *written_len,
-                                      size_t start) {
-    int len, result;
-    len = sizeof chunk_terminator - 1;
-    while (*written_len < start + len) {
-        result = send(fd, &chunk_terminator[*written_len - start],
-                      start + len - *written_len, 0);
-        if (result == -1) return -1;
-        else *written_len += result;
+/* Unpins a room from room_open. */
+static void room_close(struct room *room) {
+    if (room == &LOBBY) return;
+    rooms_lock();
+    room->refs--;
+    rooms_unlock();
+}
+
+/* Evicts the rooms that haven't been looked at in RISKYCHAT_ROOM_IDLE
+ * seconds, or all of them if now is 0, on shutdown. */
+static void expire_rooms(time_t now) {
+    struct room *room, *next;
+    int i;
+
+    rooms_lock();
+    for (i = 0; i < RISKYCHAT_ROOM_BUCKETS; i++) {
+        for (room = ROOMS.buckets[i]; room != NULL; room = next) {
+            next = room->next;
+            if (now == 0 || (room->refs == 0 &&
+                             now - room->last_active > RISKYCHAT_ROOM_IDLE)) {
+                room_evict(room);
+            }
+        }
     }
-    return len;
+    rooms_unlock();
 }
 
-static char post_head[] = "<post>";
-static char post_tail[] = "</post>";
+/* Sets up an empty table, which hands out ids up to max_users - 1. The
+ * slots are allocated as they're needed, the buckets up front. */
+static void user_table_init(struct user_table *table, int max_users) {
+    memset(table, 0, sizeof *table);
+    table->users_len = 1;
+    table->max_users = max_users;
+    table->buckets_len = 1;
+    while (table->buckets_len < (unsigned long)max_users) {
+        table->buckets_len *= 2;
+    }
+    table->buckets = calloc(table->buckets_len, sizeof table->buckets[0]);
+    if (table->buckets == NULL) {
+        perror("error when allocating the user index");
+        exit(EXIT_FAILURE);
+    }
+}
 
-/* Returns 0 when the entire response has been sent.
- * This is separate from write_http_response because of the chat rendering. */
-static ssize_t write_http_chat_response(int fd, size_t *written_len,
-                                        int is_head) {
-    ssize_t result, section_start, target_len, posts_index, post_start;
+static void user_table_free(struct user_table *table) {
+    int i;
 
-    section_start = 0;
-    target_len = sizeof chat_head_raw - 1;
-    while (*written_len < target_len) {
-        result = send(fd, &chat_head_raw[*written_len - section_start],
-                      target_len - *written_len, 0);
-        if (result == -1) return -1;
-        else *written_len += result;
+    for (i = 1; i < table->users_len; i++) {
+        free(table->users[i].name);
     }
+    free(table->users);
+    free(table->buckets);
+    memset(table, 0, sizeof *table);
+}
 
-    if (!is_head) {
-        /* Chunk length: 123\r\n */
-        section_start = target_len;
-        result = write_chunk_length(fd, sizeof static_response_chat_head - 1,
-                                    written_len, section_start);
-        if (result == -1) return -1;
-        target_len += result;
-
-        /* Chunk body: ... */
-        section_start = target_len;
-        target_len += sizeof static_response_chat_head - 1;
-        while (*written_len < target_len) {
-            result = send(fd, &static_response_chat_head[*written_len -
-                                                         section_start],
-                          target_len - *written_len, 0);
-            if (result == -1) return -1;
-            else *written_len += result;
+/* FNV-1a, plenty for names. */
+static unsigned long hash_name(char *name) {
+    unsigned long hash;
+
+    hash = 2166136261UL;
+    for (; *name != '\0'; name++) {
+        hash = ((hash ^ (unsigned char)*name) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return hash;
+}
+
+static int is_expired_user_locked(struct user *user, time_t now) {
+    return user->name == NULL || now - user->refresh_time > RISKYCHAT_TIMEOUT;
+}
+
+/* Returns the id of the user with the name, expired or not, or 0. */
+static int user_table_find(struct user_table *table, char *name) {
+    int id;
+
+    id = table->buckets[hash_name(name) & (table->buckets_len - 1)];
+    for (; id != 0; id = table->users[id].hash_next) {
+        if (strcmp(table->users[id].name, name) == 0) return id;
+    }
+    return 0;
+}
+
+/* Takes the user out of the refresh order. */
+static void user_table_unlink_order(struct user_table *table, int id) {
+    struct user *user;
+
+    user = &table->users[id];
+    if (user->older != 0) table->users[user->older].newer = user->newer;
+    else table->oldest = user->newer;
+    if (user->newer != 0) table->users[user->newer].older = user->older;
+    else table->newest = user->older;
+    user->older = user->newer = 0;
+}
+
+/* Makes the user the most recently refreshed one. */
+static void user_table_touch(struct user_table *table, int id, time_t now) {
+    struct user *user;
+
+    user = &table->users[id];
+    if (table->newest != id) {
+        if (table->sweep == id) table->sweep = user->newer;
+        if (user->older != 0 || table->oldest == id) {
+            user_table_unlink_order(table, id);
         }
+        user->older = table->newest;
+        if (table->newest != 0) table->users[table->newest].newer = id;
+        else table->oldest = id;
+        table->newest = id;
+    }
+    if (table->sweep == 0) table->sweep = id;
+    if (user->logged_out) {
+        user->logged_out = 0;
+        table->logged_in++;
+    }
+    user->refresh_time = now;
+}
 
-        /* Chunk terminator: \r\n */
-        section_start = target_len;
-        result = write_chunk_terminator(fd, written_len, section_start);
-        if (result == -1) return -1;
-        target_len += result;
-
-        post_start = 0;
-        for (posts_index = post_start; posts_index <= POSTS_LEN; posts_index++) {
-            if (posts_index == POSTS_LEN ||
-                (POSTS[posts_index] == ';' &&
-                 POSTS[posts_index + 1] == ';' &&
-                 POSTS[posts_index + 2] == ';' &&
-                 posts_index > post_start)) {
-                /* Chunk length: 123\r\n */
-                section_start = target_len;
-                result = write_chunk_length(fd,
-                                            posts_index - post_start +
-                                            sizeof post_head - 1 +
-                                            sizeof post_tail - 1,
-                                            written_len, section_start);
-                if (result == -1) return -1;
-                target_len += result;
-
-                /* Post opening tag: */
-                section_start = target_len;
-                target_len += sizeof post_head - 1;
-                while (*written_len < target_len) {
-                    result = send(fd, &post_head[*written_len - section_start],
-                                  target_len - *written_len, 0);
-                    if (result == -1) return -1;
-                    else *written_len += result;
-                }
+/* Frees the user's slot, forgetting the name. */
+static void user_table_remove(struct user_table *table, int id) {
+    struct user *user;
+    int *link;
 
-                /* Write out this post: */
-                section_start = target_len;
-                target_len += posts_index - post_start;
-                while (*written_len < target_len) {
-                    result = send(fd, &POSTS[*written_len -
-                                             (section_start -post_start)],
-                                  target_len - *written_len, 0);
-                    if (result == -1) return -1;
-                    else *written_len += result;
-                }
+    user = &table->users[id];
+    link = &table->buckets[hash_name(user->name) & (table->buckets_len - 1)];
+    while (*link != id) link = &table->users[*link].hash_next;
+    *link = user->hash_next;
+    if (table->sweep == id) table->sweep = user->newer;
+    user_table_unlink_order(table, id);
+    table->len--;
+    if (!user->logged_out) table->logged_in--;
+    free(user->name);
+    user->name = NULL;
+    user->hash_next = table->free;
+    table->free = id;
+}
 
-                /* Post closing tag: */
-                section_start = target_len;
-                target_len += sizeof post_tail - 1;
-                while (*written_len < target_len) {
-                    result = send(fd, &post_tail[*written_len - section_start],
-                                  target_len - *written_len, 0);
-                    if (result == -1) return -1;
-                    else *written_len += result;
-                }
+/* Makes room for at least len slots. */
+static void user_table_grow(struct user_table *table, int len) {
+    struct user *new_users;
+    int new_len;
+
+    new_len = table->allocated_users_len == 0 ?
+        64 : table->allocated_users_len;
+    while (new_len < len) new_len *= 2;
+    if (new_len > table->max_users) new_len = table->max_users;
+    new_users = realloc(table->users, new_len * sizeof new_users[0]);
+    if (new_users == NULL) {
+        perror("error when allocating users");
+        exit(EXIT_FAILURE);
+    }
+    table->users = new_users;
+    table->allocated_users_len = new_len;
+}
+
+/* Returns a free slot, or 0 if the table is full. The oldest user's slot is
+ * freed first if it has expired, so expired users are cleared out as new
+ * ones come in. */
+static int user_table_alloc(struct user_table *table, time_t now) {
+    int id;
+
+    if (table->oldest != 0 &&
+        is_expired_user_locked(&table->users[table->oldest], now)) {
+        user_table_remove(table, table->oldest);
+    }
+    if (table->free != 0) {
+        id = table->free;
+        table->free = table->users[id].hash_next;
+        return id;
+    }
+    if (table->users_len >= table->max_users) return 0;
+    if (table->users_len >= table->allocated_users_len) {
+        user_table_grow(table, table->users_len + 1);
+    }
+    return table->users_len++;
+}
+
+/* Gives the free slot to the named user, refreshed at now. */
+static void user_table_insert(struct user_table *table, int id, char *name,
+                              time_t now) {
+    struct user *user;
+    unsigned long bucket;
+
+    user = &table->users[id];
+    user->name = name;
+    bucket = hash_name(name) & (table->buckets_len - 1);
+    user->hash_next = table->buckets[bucket];
+    table->buckets[bucket] = id;
+    user->older = user->newer = 0;
+    user->logged_out = 0;
+    table->len++;
+    table->logged_in++;
+    user_table_touch(table, id, now);
+}
+
+/* Counts the users that have expired since the last sweep as logged out. */
+static void user_table_sweep(struct user_table *table, time_t now) {
+    struct user *user;
+
+    while (table->sweep != 0) {
+        user = &table->users[table->sweep];
+        if (now - user->refresh_time <= RISKYCHAT_TIMEOUT) break;
+        user->logged_out = 1;
+        table->logged_in--;
+        table->sweep = user->newer;
+    }
+}
+
+/* Puts the user back in the slot it had when it was logged, replacing
+ * whoever was there or had the name since. The free list is left as it is,
+ * and has to be rebuilt with user_table_rebuild_free afterwards. */
+static void user_table_restore(struct user_table *table, int id, char *name,
+                               time_t now) {
+    int other;
+
+    other = user_table_find(table, name);
+    if (other != 0) user_table_remove(table, other);
+    if (id < table->users_len && table->users[id].name != NULL) {
+        user_table_remove(table, id);
+    }
+    if (id >= table->allocated_users_len) user_table_grow(table, id + 1);
+    for (; table->users_len <= id; table->users_len++) {
+        table->users[table->users_len].name = NULL;
+    }
+    user_table_insert(table, id, name, now);
+}
+
+static void user_table_rebuild_free(struct user_table *table) {
+    int id;
+
+    table->free = 0;
+    for (id = table->users_len - 1; id > 0; id--) {
+        if (table->users[id].name == NULL) {
+            table->users[id].hash_next = table->free;
+            table->free = id;
+        }
+    }
+}
+
+static int is_name_reserved_locked(char *name) {
+    int id;
+    id = user_table_find(&USERS, name);
+    return id != 0 && !is_expired_user_locked(&USERS.users[id], time(NULL));
+}
+
+/* Returns the id of the new user, 0 if there's no room for more users, or -1
+ * if the name is already taken. The name is owned by the user table if the
+ * returned id is positive. Checking and reserving the name is done in one go,
+ * so two workers can't give out the same name. */
+int add_user(char *name) {
+    time_t now;
+    int id;
+
+    users_lock();
+    now = time(NULL);
+    id = user_table_find(&USERS, name);
+    if (id != 0) {
+        if (!is_expired_user_locked(&USERS.users[id], now)) {
+            users_unlock();
+            return -1;
+        }
+        /* The name's free again, drop the expired user holding onto it. */
+        user_table_remove(&USERS, id);
+    }
+
+    id = user_table_alloc(&USERS, now);
+    if (id == 0) {
+        users_unlock();
+        return 0;
+    }
+    user_table_insert(&USERS, id, name, now);
+    wal_log_user(&WAL, id, now, name);
+    users_unlock();
+    return id;
+}
+
+int is_expired_user(int user_id) {
+    int expired;
+    users_lock();
+    if (user_id <= 0 || user_id >= USERS.users_len) {
+        expired = 1;
+    } else {
+        expired = is_expired_user_locked(&USERS.users[user_id], time(NULL));
+    }
+    users_unlock();
+    return expired;
+}
+
+int is_name_reserved(char *name) {
+    int reserved;
+    users_lock();
+    reserved = is_name_reserved_locked(name);
+    users_unlock();
+    return reserved;
+}
+
+void refresh_user(int user_id) {
+    users_lock();
+    if (user_id > 0 && user_id < USERS.users_len &&
+        USERS.users[user_id].name != NULL) {
+        user_table_touch(&USERS, user_id, time(NULL));
+    }
+    users_unlock();
+}
+
+/* Returns the bucket for the kind and id, with its tokens refilled up to
+ * now. A new bucket is full. The buckets are kept in a fixed-size table
+ * where each key hashes to a set of RISKYCHAT_LIMIT_WAYS slots, so looking
+ * one up only ever touches those. A bucket that has refilled completely is
+ * the same as no bucket, so its slot can be taken by a new one, and if the
+ * set is all in use, the one looked at least recently is evicted. The
+ * buckets looked at just now are left alone, so a request's two buckets
+ * can't evict each other. Should be called with LIMITS_LOCK held. */
+static struct rate_bucket *rate_bucket_get(enum limit_kind kind,
+                                           unsigned long id, double now) {
+    struct rate_bucket *set, *bucket, *victim;
+    struct rate_limit *limit;
+    unsigned long hash;
+    int i, idle;
+
+    hash = ((id ^ ((unsigned long)kind << 28)) * 2654435761UL) & 0xFFFFFFFFUL;
+    set = &RATE_BUCKETS[(hash >> 16) % (RISKYCHAT_LIMIT_BUCKETS /
+                                        RISKYCHAT_LIMIT_WAYS) *
+                        RISKYCHAT_LIMIT_WAYS];
+    victim = NULL;
+    for (i = 0; i < RISKYCHAT_LIMIT_WAYS; i++) {
+        bucket = &set[i];
+        limit = &LIMITS[bucket->kind];
+        if (bucket->kind == kind && bucket->id == id) {
+            bucket->tokens += (now - bucket->last) * limit->per_second;
+            if (bucket->tokens > limit->burst) bucket->tokens = limit->burst;
+            bucket->last = now;
+            return bucket;
+        }
+        if (bucket->last == now && bucket->kind != LIMIT_NONE) continue;
+        idle = bucket->kind == LIMIT_NONE || limit->per_second == 0 ||
+            bucket->tokens + (now - bucket->last) * limit->per_second >=
+            limit->burst;
+        if (victim == NULL || idle || (victim->kind != LIMIT_NONE &&
+                                       bucket->last < victim->last)) {
+            victim = bucket;
+            if (idle) break;
+        }
+    }
+    /* Only if the whole set was looked at at once, which is unlikely. */
+    if (victim == NULL) victim = &set[0];
+
+    victim->kind = kind;
+    victim->id = id;
+    victim->tokens = LIMITS[kind].burst;
+    victim->last = now;
+    return victim;
+}
+
+/* Takes a token from the user's bucket of user_kind and the address's
+ * bucket of address_kind, if both have one. A kind without a limit, or
+ * LIMIT_NONE, or a user id that isn't logged in, always has one. Returns 1
+ * if the request can go ahead, 0 if it's over the limit. */
+static int rate_limit(enum limit_kind user_kind, int user_id,
+                      enum limit_kind address_kind, unsigned long address) {
+    struct rate_bucket *user, *addr;
+    double now;
+    int allowed;
+
+    if (LIMITS[user_kind].per_second == 0 || user_id <= 0) {
+        user_kind = LIMIT_NONE;
+    }
+    if (LIMITS[address_kind].per_second == 0) address_kind = LIMIT_NONE;
+    if (user_kind == LIMIT_NONE && address_kind == LIMIT_NONE) return 1;
+
+    limits_lock();
+    now = monotonic_time();
+    user = user_kind == LIMIT_NONE ? NULL :
+        rate_bucket_get(user_kind, (unsigned long)user_id, now);
+    addr = address_kind == LIMIT_NONE ? NULL :
+        rate_bucket_get(address_kind, address, now);
+    allowed = (user == NULL || user->tokens >= 1) &&
+        (addr == NULL || addr->tokens >= 1);
+    if (allowed) {
+        if (user != NULL) user->tokens--;
+        if (addr != NULL) addr->tokens--;
+    }
+    limits_unlock();
+    return allowed;
+}
+
+/* Applies the records in data to the users and posts, like they were
+ * applied when they were logged. Returns how many bytes from the start were
+ * intact records, the rest is a torn write or garbage. */
+static size_t wal_replay(char *data, size_t len,
+                         unsigned long *users, unsigned long *posts) {
+    size_t offset, record_len, name_len;
+    unsigned long id;
+    time_t now;
+    char *record, *name;
+
+    for (offset = 0; len - offset >= 8; offset += 8 + record_len) {
+        record_len = get_u32(&data[offset]);
+        record = &data[offset + 8];
+        if (record_len == 0 || record_len > len - offset - 8 ||
+            crc32_update(0, record, record_len) !=
+            get_u32(&data[offset + 4])) {
+            break;
+        }
+        id = record_len >= 9 ? get_u32(&record[1]) : 0;
+        now = record_len >= 9 ? (time_t)get_u32(&record[5]) : 0;
+        if (record[0] == 'U' && id > 0 &&
+            id < (unsigned long)USERS.max_users) {
+            name_len = record_len - 9;
+            name = malloc(name_len + 1);
+            if (name == NULL) {
+                perror("error when allocating name");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(name, &record[9], name_len);
+            name[name_len] = '\0';
+            user_table_restore(&USERS, id, name, now);
+            (*users)++;
+        } else if (record[0] == 'P' && record_len >= 13 &&
+                   get_u32(&record[9]) <= record_len - 13) {
+            name_len = get_u32(&record[9]);
+            append_post(&LOBBY, id, &record[13], name_len,
+                        &record[13 + name_len], record_len - 13 - name_len,
+                        now);
+            if (id > 0 && id < (unsigned long)USERS.users_len &&
+                USERS.users[id].name != NULL) {
+                user_table_touch(&USERS, id, now);
+            }
+            (*posts)++;
+        } else {
+            break;
+        }
+    }
+    return offset;
+}
+
+/* Returns the path of a file in the data directory, named by format with
+ * the generation filled in. The path should be freed. */
+static char *data_path(char *dir, char *format, unsigned long generation) {
+    char *path;
+    size_t dir_len;
 
-                /* Start reading from the next post. */
-                posts_index += 3;
-                post_start = posts_index;
+    dir_len = strlen(dir);
+    path = malloc(dir_len + strlen(format) + 24);
+    if (path == NULL) {
+        perror("error when allocating a path");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    sprintf(&path[dir_len + 1], format, generation);
+    return path;
+}
+
+/* Reads the file from the current position to the end into a new buffer,
+ * and writes the length into *len. Returns NULL on error. */
+static char *read_file(int fd, size_t *len) {
+    size_t allocated_len;
+    ssize_t result;
+    char *data, *new_data;
 
-                /* Chunk terminator: \r\n */
-                section_start = target_len;
-                result = write_chunk_terminator(fd, written_len, section_start);
-                if (result == -1) return -1;
-                target_len += result;
+    data = NULL;
+    *len = allocated_len = 0;
+    for (;;) {
+        if (*len == allocated_len) {
+            allocated_len = allocated_len == 0 ? 65536 : allocated_len * 2;
+            new_data = realloc(data, allocated_len);
+            if (new_data == NULL) {
+                free(data);
+                return NULL;
             }
+            data = new_data;
+        }
+        result = read(fd, &data[*len], allocated_len - *len);
+        if (result == -1 && errno == EINTR) continue;
+        if (result == -1) {
+            free(data);
+            return NULL;
         }
+        if (result == 0) return data;
+        *len += result;
+    }
+}
 
-        /* Chunk length: 123\r\n */
-        section_start = target_len;
-        result = write_chunk_length(fd, sizeof static_response_chat_tail - 1,
-                                    written_len, section_start);
-        if (result == -1) return -1;
-        target_len += result;
-
-        /* Chunk body: ... */
-        section_start = target_len;
-        target_len += sizeof static_response_chat_tail - 1;
-        while (*written_len < target_len) {
-            result = send(fd, &static_response_chat_tail[*written_len -
-                                                         section_start],
-                          target_len - *written_len, 0);
-            if (result == -1) return -1;
-            else *written_len += result;
+/* Deletes the logs from before the generation, since its snapshot has
+ * everything in them. There are at most two: the one the snapshot was
+ * taken from, and one more if the previous snapshot never got written. */
+static void wal_remove_old(char *dir, unsigned long generation) {
+    unsigned long i;
+    char *path;
+
+    for (i = 1; i <= 2 && i <= generation; i++) {
+        path = data_path(dir, RISKYCHAT_WAL_NAME, generation - i);
+        remove(path);
+        free(path);
+    }
+}
+
+/* Replays the generation's log, if there is one, cutting off anything after
+ * the last intact record. The log is left open in *fd, positioned for
+ * appending, or *fd is -1 if there's no log. Returns 0 on success, -1 on
+ * error. */
+static int wal_replay_file(struct wal *wal, unsigned long generation,
+                           int *fd) {
+    size_t len, valid_len;
+    unsigned long users, posts;
+    char *path, *data;
+
+    path = data_path(wal->dir, RISKYCHAT_WAL_NAME, generation);
+    *fd = open(path, O_RDWR | O_BINARY);
+    if (*fd == -1) {
+        free(path);
+        if (errno == ENOENT) return 0;
+        perror("could not open the write-ahead log");
+        return -1;
+    }
+    data = read_file(*fd, &len);
+    if (data == NULL) {
+        perror("could not read the write-ahead log");
+        free(path);
+        return -1;
+    }
+
+    users = posts = 0;
+    valid_len = wal_replay(data, len, &users, &posts);
+    free(data);
+    wal->appended += users + posts;
+    if (valid_len < len) {
+        fprintf(stderr, "cut off %lu bytes of torn records from %s\n",
+                (unsigned long)(len - valid_len), path);
+        if (ftruncate(*fd, (long)valid_len) == -1) {
+            perror("could not truncate the write-ahead log");
+            free(path);
             return -1;
         }
+    }
+    if (lseek(*fd, (long)valid_len, SEEK_SET) == -1) {
+        perror("could not seek in the write-ahead log");
+        free(path);
+        return -1;
+    }
+    if (users > 0 || posts > 0) {
+        printf("Recovered %lu users and %lu posts from %s.\n",
+               users, posts, path);
+    }
+    free(path);
+    return 0;
+}
+
+/* Lays out the users and posts as a snapshot: a header, an index entry for
+ * each post and user, the texts the entries point into, and the rendered
+ * posts of the chat page. Everything is in the same 32-bit little-endian
+ * integers as the log, offsets into the texts are from the start of the
+ * texts. The users are in refresh order, so they expire in the same order
+ * after they're loaded. Also starts the log generation that comes after the
+ * snapshot. Only the users are copied with the users locked, the posts with
+ * just the lobby read-locked, which holds up posting there but not reading,
+ * and the chat page after letting go of that too, from a reference to its
+ * buffer. Returns NULL if the new log couldn't be started. */
+static char *snapshot_build(struct snapshot *snapshot, size_t *image_len) {
+    struct post *post;
+    struct shared_buf *cache;
+    char *image, *entry, *texts, *users;
+    size_t users_len, names_len, texts_len, cache_start, cache_len, name_len;
+    size_t offset, posts_offset, users_offset, texts_offset, cache_offset;
+    unsigned long i, first_seq, posts_len, events_len;
+    int id;
+
+    users_lock();
+    if (wal_rotate(&WAL) == -1) {
+        users_unlock();
+        return NULL;
+    }
+    snapshot->generation = WAL.generation;
+    snapshot->last_appended = WAL.appended;
+    users_len = names_len = 0;
+    for (id = USERS.oldest; id != 0; id = USERS.users[id].newer) {
+        users_len++;
+        names_len += strlen(USERS.users[id].name);
+    }
+    /* The user entries, followed by the names, which go first in the
+     * texts. */
+    users = malloc(users_len * SNAPSHOT_USER_LEN + names_len);
+    if (users == NULL && users_len > 0) {
+        perror("error when allocating a snapshot");
+        exit(EXIT_FAILURE);
+    }
+    entry = users;
+    texts = &users[users_len * SNAPSHOT_USER_LEN];
+    offset = 0;
+    for (id = USERS.oldest; id != 0; id = USERS.users[id].newer) {
+        name_len = strlen(USERS.users[id].name);
+        put_u32(&entry[0], id);
+        put_u32(&entry[4], (unsigned long)USERS.users[id].refresh_time);
+        put_u32(&entry[8], offset);
+        put_u32(&entry[12], name_len);
+        memcpy(&texts[offset], USERS.users[id].name, name_len);
+        offset += name_len;
+        entry += SNAPSHOT_USER_LEN;
+    }
+    /* Posting takes the users first, so nothing gets posted in between, and
+     * the posts are the ones from before the new log too. */
+    posts_read_lock();
+    users_unlock();
+
+    first_seq = LOBBY.log.first_seq;
+    posts_len = LOBBY.log.posts_len;
+    events_len = LOBBY.log.events_len;
+    texts_len = names_len;
+    for (i = 0; i < posts_len; i++) {
+        post = post_log_get(&LOBBY.log, i);
+        texts_len += post->name_len + post->content_len + post->event_len;
+    }
+    cache = LOBBY.cache.posts;
+    shared_buf_ref(cache);
+    cache_start = LOBBY.cache.start;
+    cache_len = cache->len - cache_start;
+    posts_offset = SNAPSHOT_HEADER_LEN;
+    users_offset = posts_offset + posts_len * SNAPSHOT_POST_LEN;
+    texts_offset = users_offset + users_len * SNAPSHOT_USER_LEN;
+    cache_offset = texts_offset + texts_len;
+    *image_len = cache_offset + cache_len;
+    image = malloc(*image_len);
+    if (image == NULL) {
+        perror("error when allocating a snapshot");
+        exit(EXIT_FAILURE);
+    }
+
+    if (users_len > 0) {
+        memcpy(&image[users_offset], users,
+               users_len * SNAPSHOT_USER_LEN + names_len);
+    }
+    free(users);
+    texts = &image[texts_offset];
+    offset = names_len;
+    entry = &image[posts_offset];
+    for (i = 0; i < posts_len; i++) {
+        post = post_log_get(&LOBBY.log, i);
+        put_u32(&entry[0], post->seq);
+        put_u32(&entry[4], (unsigned long)post->time);
+        put_u32(&entry[8], post->author_id);
+        put_u32(&entry[12], offset);
+        put_u32(&entry[16], post->name_len);
+        put_u32(&entry[20], post->content_len);
+        memcpy(&texts[offset], post->name, post->name_len);
+        offset += post->name_len;
+        memcpy(&texts[offset], post->content, post->content_len);
+        offset += post->content_len;
+        put_u32(&entry[24], offset);
+        put_u32(&entry[28], post->event_len);
+        put_u32(&entry[32], post->event_start);
+        put_u32(&entry[36], post->rendered_len);
+        if (post->event_len > 0) {
+            memcpy(&texts[offset], post->event, post->event_len);
+            offset += post->event_len;
+        }
+        entry += SNAPSHOT_POST_LEN;
+    }
+    posts_unlock();
+    /* New posts only go after the part of the buffer that was there. */
+    memcpy(&image[cache_offset], &cache->data[cache_start], cache_len);
+    shared_buf_unref(cache);
 
-        /* Chunk terminator: \r\n */
-        section_start = target_len;
-        result = write_chunk_terminator(fd, written_len, section_start);
-        if (result == -1) return -1;
-        target_len += result;
+    memcpy(image, RISKYCHAT_SNAPSHOT_MAGIC, 8);
+    put_u32(&image[8], snapshot->generation);
+    put_u32(&image[12], first_seq);
+    put_u32(&image[16], posts_len);
+    put_u32(&image[20], events_len);
+    put_u32(&image[24], users_len);
+    put_u32(&image[28], posts_offset);
+    put_u32(&image[32], users_offset);
+    put_u32(&image[36], texts_offset);
+    put_u32(&image[40], texts_len);
+    put_u32(&image[44], cache_offset);
+    put_u32(&image[48], cache_len);
+    put_u32(&image[52], (unsigned long)time(NULL));
+    put_u32(&image[56], 0);
+    put_u32(&image[60], crc32_update(0, image, 60));
+    return image;
+}
 
-        /* Chunk length: 0\r\n */
-        section_start = target_len;
-        result = write_chunk_length(fd, 0, written_len, section_start);
-        if (result == -1) return -1;
-        target_len += result;
+/* Checks that the snapshot's header and index are sane, and puts its users
+ * and posts in place. The posts and the chat page are left pointing into
+ * the snapshot, only the names of the users are copied. If the snapshot has
+ * more posts than --max-posts allows now, the oldest ones are skipped.
+ * Returns 0 on success, -1 if the snapshot is corrupt. */
+static int snapshot_restore(char *map, size_t len,
+                            unsigned long *generation) {
+    struct arena_block *block;
+    struct shared_buf *cache;
+    struct post *post;
+    char *entry, *name;
+    unsigned long i, posts_len, users_len, skip, id;
+    size_t posts_offset, users_offset, texts_offset, texts_len;
+    size_t cache_offset, cache_len, text, name_len, content_len, skipped_len;
 
-        /* Chunk terminator: \r\n */
-        section_start = target_len;
-        result = write_chunk_terminator(fd, written_len, section_start);
-        if (result == -1) return -1;
-        target_len += result;
+    if (len < SNAPSHOT_HEADER_LEN ||
+        memcmp(map, RISKYCHAT_SNAPSHOT_MAGIC, 8) != 0 ||
+        get_u32(&map[60]) != crc32_update(0, map, 60)) {
+        return -1;
+    }
+    posts_len = get_u32(&map[16]);
+    users_len = get_u32(&map[24]);
+    posts_offset = get_u32(&map[28]);
+    users_offset = get_u32(&map[32]);
+    texts_offset = get_u32(&map[36]);
+    texts_len = get_u32(&map[40]);
+    cache_offset = get_u32(&map[44]);
+    cache_len = get_u32(&map[48]);
+    if (posts_offset != SNAPSHOT_HEADER_LEN ||
+        users_offset != posts_offset + posts_len * SNAPSHOT_POST_LEN ||
+        texts_offset != users_offset + users_len * SNAPSHOT_USER_LEN ||
+        cache_offset != texts_offset + texts_len ||
+        cache_offset + cache_len != len) {
+        return -1;
+    }
+    skipped_len = 0;
+    for (i = 0; i < posts_len; i++) {
+        entry = &map[posts_offset + i * SNAPSHOT_POST_LEN];
+        text = get_u32(&entry[12]);
+        name_len = get_u32(&entry[16]);
+        content_len = get_u32(&entry[20]);
+        skipped_len += get_u32(&entry[36]);
+        if (text > texts_len || texts_len - text < name_len + content_len ||
+            get_u32(&entry[24]) > texts_len ||
+            texts_len - get_u32(&entry[24]) < get_u32(&entry[28]) ||
+            skipped_len > cache_len) {
+            return -1;
+        }
+    }
+    for (i = 0; i < users_len; i++) {
+        entry = &map[users_offset + i * SNAPSHOT_USER_LEN];
+        id = get_u32(&entry[0]);
+        text = get_u32(&entry[8]);
+        if (id == 0 || id >= (unsigned long)USERS.max_users ||
+            text > texts_len || texts_len - text < get_u32(&entry[12])) {
+            return -1;
+        }
+    }
+
+    /* The texts become the log's first arena block. It's full, so the
+     * next post starts a new block, and it's never written into. */
+    block = malloc(sizeof *block);
+    if (block == NULL) {
+        perror("error when allocating a post arena block");
+        exit(EXIT_FAILURE);
+    }
+    block->next = NULL;
+    block->len = block->allocated_len = texts_len;
+    block->data = &map[texts_offset];
+    LOBBY.log.first_block = LOBBY.log.last_block = block;
+    LOBBY.log.arena_len += texts_len;
+
+    skip = posts_len > LOBBY.log.allocated_posts_len ?
+        posts_len - LOBBY.log.allocated_posts_len : 0;
+    skipped_len = 0;
+    for (i = 0; i < posts_len; i++) {
+        entry = &map[posts_offset + i * SNAPSHOT_POST_LEN];
+        if (i < skip) {
+            skipped_len += get_u32(&entry[36]);
+            continue;
+        }
+        post = post_log_get(&LOBBY.log, LOBBY.log.posts_len++);
+        post->seq = get_u32(&entry[0]);
+        post->time = (time_t)get_u32(&entry[4]);
+        post->author_id = get_u32(&entry[8]);
+        text = get_u32(&entry[12]);
+        post->name = &block->data[text];
+        post->name_len = get_u32(&entry[16]);
+        post->content = &block->data[text + post->name_len];
+        post->content_len = get_u32(&entry[20]);
+        post->block = block;
+        post->rendered_len = get_u32(&entry[36]);
+        post->event = &block->data[get_u32(&entry[24])];
+        post->event_len = get_u32(&entry[28]);
+        post->event_start = get_u32(&entry[32]);
+        LOBBY.log.text_len += post->name_len + post->content_len;
+    }
+    LOBBY.log.first_seq = get_u32(&map[12]) + skip;
+    LOBBY.log.events_len = get_u32(&map[20]);
+
+    /* Likewise, the chat page is replaced by a copy on the next post. */
+    cache = malloc(sizeof *cache);
+    if (cache == NULL) {
+        perror("error when allocating a shared buffer");
+        exit(EXIT_FAILURE);
     }
+    cache->refs = 1;
+    cache->len = cache->allocated_len = cache_len;
+    cache->data = &map[cache_offset];
+    shared_buf_unref(LOBBY.cache.posts);
+    LOBBY.cache.posts = cache;
+    LOBBY.cache.start = skipped_len;
 
+    for (i = 0; i < users_len; i++) {
+        entry = &map[users_offset + i * SNAPSHOT_USER_LEN];
+        name_len = get_u32(&entry[12]);
+        name = malloc(name_len + 1);
+        if (name == NULL) {
+            perror("error when allocating name");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(name, &map[texts_offset + get_u32(&entry[8])], name_len);
+        name[name_len] = '\0';
+        user_table_restore(&USERS, get_u32(&entry[0]), name,
+                           (time_t)get_u32(&entry[4]));
+    }
+    *generation = get_u32(&map[8]);
+    printf("Loaded %lu users and %lu posts from the snapshot.\n",
+           users_len, LOBBY.log.posts_len);
     return 0;
 }
 
-/* Returns 1 if the strings are equal, 0 if not. */
-static int eq_ignore_whitespace(char *a, char *b) {
-    int counter_a = 0, counter_b = 0;
-    while (a[counter_a] != '\0' && b[counter_b] != '\0') {
-        while (a[counter_a] == ' ') counter_a++;
-        while (b[counter_b] == ' ') counter_b++;
-        if (a[counter_a] != b[counter_b]) return 0;
-        if (a[counter_a] == '\0') break;
-        counter_a++;
-        counter_b++;
+/* Maps the snapshot in dir into memory, if there is one, and loads it. Its
+ * generation is written into *generation, 0 if there's no snapshot. Returns
+ * 0 on success, -1 on error. */
+static int snapshot_load(struct snapshot *snapshot, char *dir,
+                         unsigned long *generation) {
+    char *path, *map;
+    long file_len;
+    size_t len;
+    int fd;
+
+    *generation = 0;
+    path = data_path(dir, RISKYCHAT_SNAPSHOT_NAME, 0);
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        free(path);
+        if (errno == ENOENT) return 0;
+        perror("could not open the snapshot");
+        return -1;
     }
-    return 1;
+    file_len = lseek(fd, 0, SEEK_END);
+    len = file_len > 0 ? (size_t)file_len : 0;
+#ifdef RISKYCHAT_USE_MMAP
+    /* Private and writable, so the posts' arena block can be treated like
+     * any other. Nothing's written into it, but if something was, it'd stay
+     * out of the file. */
+    map = len == 0 ? NULL : mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) map = NULL;
+#else
+    map = lseek(fd, 0, SEEK_SET) == -1 ? NULL : read_file(fd, &len);
+#endif
+    file_close(fd);
+    if (map == NULL) {
+        perror("could not load the snapshot");
+        free(path);
+        return -1;
+    }
+    snapshot->map = map;
+    snapshot->map_len = len;
+    if (snapshot_restore(map, len, generation) == -1) {
+        fprintf(stderr, "the snapshot %s is corrupt\n", path);
+        free(path);
+        return -1;
+    }
+    free(path);
+    return 0;
 }
 
-void decode_percent(char *buffer, size_t *buffer_len) {
-    char tol_buf[64], c;
-    int i;
-    for (i = 0; i < *buffer_len; i++) {
-        if (buffer[i] == '+') buffer[i] = ' ';
-        else if (buffer[i] == '%' &&
-                 buffer[i + 1] != '\0' && buffer[i + 2] != '\0') {
-            tol_buf[0] = buffer[i + 1];
-            tol_buf[1] = buffer[i + 2];
-            tol_buf[2] = '\0';
-            c = (char)strtol(tol_buf, NULL, 16);
-            buffer[i] = c;
-            memmove(&buffer[i + 1], &buffer[i + 3], *buffer_len - (i + 3));
-            *buffer_len -= 2;
-            buffer[*buffer_len] = '\0';
+/* Loads the snapshot in dir, if there is one, and replays the logs written
+ * after it. New records are appended to the newest log, or a new one. Should
+ * be called before the workers start. Returns 0 on success, -1 on error. */
+static int wal_open(struct wal *wal, char *dir) {
+    unsigned long generation;
+    char *path;
+    int fd, next_fd;
+
+    wal->dir = dir;
+    if (snapshot_load(&SNAPSHOT, dir, &generation) == -1) return -1;
+    gzip_cache_rebuild(&LOBBY.gzip, &LOBBY.cache, &LOBBY.log);
+    wal_remove_old(dir, generation);
+    if (wal_replay_file(wal, generation, &fd) == -1 ||
+        wal_replay_file(wal, generation + 1, &next_fd) == -1) {
+        return -1;
+    }
+    user_table_rebuild_free(&USERS);
+    wal->synced = wal->appended;
+
+    /* If the server stopped while a snapshot was being written, the next
+     * generation's log was already started. */
+    if (next_fd != -1) {
+        if (fd != -1) file_close(fd);
+        fd = next_fd;
+        generation++;
+    }
+    if (fd == -1) {
+        path = data_path(dir, RISKYCHAT_WAL_NAME, generation);
+        fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0644);
+        free(path);
+        if (fd == -1) {
+            perror("could not create the write-ahead log");
+            return -1;
+        }
+    }
+    wal->fd = fd;
+    wal->generation = generation;
+    return 0;
+}
+
+/* Commits the current log, and moves on to the next generation's. Should be
+ * called with the users locked, so nothing is logged in between. Returns 0
+ * on success, -1 on error. */
+static int wal_rotate(struct wal *wal) {
+    char *path;
+    int fd;
+
+    wal_commit(wal);
+    path = data_path(wal->dir, RISKYCHAT_WAL_NAME, wal->generation + 1);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    free(path);
+    if (fd == -1) {
+        perror("could not start a new write-ahead log");
+        return -1;
+    }
+    commit_lock();
+    file_close(wal->fd);
+    wal->fd = fd;
+    wal->generation++;
+    commit_unlock();
+    return 0;
+}
+
+/* Commits whatever is left, and closes the log. */
+static void wal_close(struct wal *wal) {
+    if (wal->fd != -1) {
+        wal_commit(wal);
+        file_close(wal->fd);
+    }
+    free(wal->buf);
+    free(wal->spare);
+    memset(wal, 0, sizeof *wal);
+    wal->fd = -1;
+}
+
+/* Writes the snapshot image into a temporary file, and once that's on disk,
+ * moves it over the previous snapshot. The logs before its generation can
+ * then be deleted. */
+static void snapshot_write(struct snapshot *snapshot) {
+    char *path, *tmp_path;
+    FILE *file;
+    int ok;
+#ifndef _WIN32
+    int dir_fd;
+#endif
+
+    path = data_path(WAL.dir, RISKYCHAT_SNAPSHOT_NAME, 0);
+    tmp_path = data_path(WAL.dir, RISKYCHAT_SNAPSHOT_NAME ".tmp", 0);
+    file = fopen(tmp_path, "wb");
+    ok = file != NULL &&
+        fwrite(snapshot->image, 1, snapshot->image_len, file) ==
+        snapshot->image_len &&
+        fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (file != NULL && fclose(file) != 0) ok = 0;
+#ifdef _WIN32
+    /* Renaming doesn't replace files on Windows. */
+    if (ok) remove(path);
+#endif
+    if (ok && rename(tmp_path, path) == 0) {
+#ifndef _WIN32
+        /* The rename is only durable once the directory is synced. */
+        dir_fd = open(WAL.dir, O_RDONLY);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
         }
+#endif
+        wal_remove_old(WAL.dir, snapshot->generation);
+    } else {
+        perror("error when writing a snapshot");
+        remove(tmp_path);
+    }
+    free(path);
+    free(tmp_path);
+    free(snapshot->image);
+    snapshot->image = NULL;
+}
+
+/* Builds the snapshot and writes it out. Runs in its own thread when taken
+ * in the background. */
+static void *snapshot_run(void *arg) {
+    struct snapshot *snapshot;
+
+    snapshot = arg;
+    snapshot->image = snapshot_build(snapshot, &snapshot->image_len);
+    if (snapshot->image != NULL) snapshot_write(snapshot);
+    snapshot_lock();
+    snapshot->written = 1;
+    snapshot_unlock();
+    return NULL;
+}
+
+/* Takes a snapshot of the users and posts, and starts a new log for what
+ * comes after it. Both happen in the background if asked to (and there are
+ * threads to do it with), see snapshot_build for what that holds up. */
+static void snapshot_take(struct snapshot *snapshot, int background) {
+    snapshot->written = 0;
+#ifdef RISKYCHAT_THREADS
+    if (background && pthread_create(&snapshot->thread, NULL,
+                                     snapshot_run, snapshot) == 0) {
+        snapshot->writing = 1;
+        return;
+    }
+#endif
+    (void)background;
+    snapshot_run(snapshot);
+}
+
+/* Waits for the snapshot being written in the background, if there is one. */
+static void snapshot_finish(struct snapshot *snapshot) {
+#ifdef RISKYCHAT_THREADS
+    if (snapshot->writing) {
+        pthread_join(snapshot->thread, NULL);
+        snapshot->writing = 0;
     }
+#else
+    (void)snapshot;
+#endif
 }
 
-void add_new_post(char *buffer, size_t buffer_len, int user_id) {
-    char *name;
-    int name_len;
+/* Takes a snapshot in the background every interval seconds, if anything has
+ * been logged since the last one, and the last one has been written. */
+static void snapshot_tick(struct snapshot *snapshot, time_t now) {
+    unsigned long appended;
+    int written;
 
-    if (user_id <= 0 || user_id >= USERS_LEN) {
+    if (snapshot->writing) {
+        snapshot_lock();
+        written = snapshot->written;
+        snapshot_unlock();
+        if (!written) return;
+        snapshot_finish(snapshot);
+    }
+    if (snapshot->last_time == 0) snapshot->last_time = now;
+    if (snapshot->interval == 0 ||
+        now - snapshot->last_time < snapshot->interval) {
         return;
     }
+    snapshot->last_time = now;
+    wal_lock();
+    appended = WAL.appended;
+    wal_unlock();
+    if (appended != snapshot->last_appended) snapshot_take(snapshot, 1);
+}
 
-    name = USERS[user_id].name;
-    name_len = strlen(name);
+static void snapshot_unmap(struct snapshot *snapshot) {
+    if (snapshot->map == NULL) return;
+#ifdef RISKYCHAT_USE_MMAP
+    munmap(snapshot->map, snapshot->map_len);
+#else
+    free(snapshot->map);
+#endif
+    snapshot->map = NULL;
+}
 
-    /* Skip over "content=" */
-    buffer_len -= 8;
-    if (buffer_len < 0) return;
-    buffer += 8;
 
-    /* Un-percent-encode */
-    decode_percent(buffer, &buffer_len);
+static void wheel_init(struct timer_wheel *wheel, time_t now) {
+    int level, i;
 
-    POSTS_LEN += sizeof "<name>[" - 1;
-    POSTS_LEN += name_len;
-    POSTS_LEN += sizeof "]: </name>" - 1;
-    POSTS_LEN += buffer_len;
-    POSTS_LEN += sizeof ";;;" - 1;
-    POSTS = realloc(POSTS, POSTS_LEN + 1);
-    if (POSTS == NULL) {
-        perror("error when expanding global post buffer");
-        exit(EXIT_FAILURE);
+    wheel->now = now;
+    for (level = 0; level < 2; level++) {
+        for (i = 0; i < RISKYCHAT_WHEEL_SLOTS; i++) {
+            wheel->slots[level][i].next = &wheel->slots[level][i];
+            wheel->slots[level][i].prev = &wheel->slots[level][i];
+        }
     }
-    strcat(POSTS, "<name>[");
-    strcat(POSTS, name);
-    strcat(POSTS, "]: </name>");
-    strcat(POSTS, buffer);
-    strcat(POSTS, ";;;");
 }
 
-int add_user(char *name) {
-    time_t t;
-    int i;
+static void timer_remove(struct timer *timer) {
+    if (timer->next == NULL) return;
+    timer->next->prev = timer->prev;
+    timer->prev->next = timer->next;
+    timer->next = timer->prev = NULL;
+}
 
-    if (USERS_LEN >= RISKYCHAT_MAX_USERS) {
-        return 0;
+/* Puts the timer in the slot for its deadline, taking it out of wherever
+ * it was. Deadlines that have already passed are due right away. */
+static void timer_add(struct timer_wheel *wheel, struct timer *timer,
+                      time_t deadline) {
+    struct timer *slot;
+    unsigned long at, span;
+
+    timer_remove(timer);
+    timer->deadline = deadline;
+    if (deadline < wheel->now) deadline = wheel->now;
+    at = (unsigned long)deadline;
+    span = RISKYCHAT_WHEEL_SLOTS;
+    if (deadline - wheel->now < (long)span) {
+        slot = &wheel->slots[0][at % span];
+    } else if (deadline - wheel->now < (long)(span * span)) {
+        slot = &wheel->slots[1][at / span % span];
     } else {
-        t = time(NULL);
-        for (i = 1; i < USERS_LEN; i++) {
-            if (t - USERS[i].refresh_time > RISKYCHAT_TIMEOUT) {
-                USERS[i].refresh_time = t;
-                free(USERS[i].name);
-                USERS[i].name = name;
-                return i;
-            }
-        }
-        i = USERS_LEN++;
-        USERS = realloc(USERS, sizeof USERS[0] * USERS_LEN);
-        if (USERS == NULL) {
-            perror("error when allocating users");
-            exit(EXIT_FAILURE);
-        }
-        USERS[i].refresh_time = t;
-        USERS[i].name = name;
-        return i;
+        slot = &wheel->slots[1][((unsigned long)wheel->now / span + span - 1) %
+                                span];
     }
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
 }
 
-int is_expired_user(int user_id) {
-    if (user_id <= 0 || user_id >= USERS_LEN) {
-        return 1;
-    }
-    return time(NULL) - USERS[user_id].refresh_time > RISKYCHAT_TIMEOUT;
-}
+/* Moves every timer in the slot to where it belongs now. */
+static void wheel_cascade(struct timer_wheel *wheel, struct timer *slot) {
+    struct timer *timer;
 
-int is_name_reserved(char *name) {
-    int i;
-    for (i = 1; i < USERS_LEN; i++) {
-        if (time(NULL) - USERS[i].refresh_time <= RISKYCHAT_TIMEOUT &&
-            strcmp(USERS[i].name, name) == 0) {
-            return 1;
-        }
+    while (slot->next != slot) {
+        timer = slot->next;
+        timer_add(wheel, timer, timer->deadline);
     }
-    return 0;
 }
 
-void refresh_user(int user_id) {
-    if (user_id > 0 && user_id < USERS_LEN) {
-        USERS[user_id].refresh_time = time(NULL);
+/* Takes the next timer that's due by now off the wheel and returns it, or
+ * returns NULL when there are none left. The wheel is turned a second at a
+ * time, cascading the second level as its slots come up. */
+static struct timer *wheel_expire(struct timer_wheel *wheel, time_t now) {
+    struct timer *slot, *timer;
+    unsigned long span;
+
+    span = RISKYCHAT_WHEEL_SLOTS;
+    /* After a jump in the clock, one turn of the second level is enough to
+     * see every timer. */
+    if (now - wheel->now > (long)(span * span)) {
+        wheel->now = now - (long)(span * span);
+    }
+    for (;;) {
+        slot = &wheel->slots[0][(unsigned long)wheel->now % span];
+        while (slot->next != slot) {
+            timer = slot->next;
+            if (timer->deadline <= wheel->now) {
+                timer_remove(timer);
+                return timer;
+            }
+            timer_add(wheel, timer, timer->deadline);
+        }
+        if (wheel->now >= now) return NULL;
+        wheel->now++;
+        if ((unsigned long)wheel->now % span == 0) {
+            wheel_cascade(wheel, &wheel->slots[1][(unsigned long)wheel->now /
+                                                  span % span]);
+        }
     }
 }
 
 
 /* pubfuncs: Functions used in main(). */
 
-static int connect_socket(char *addr, char *port) {
-    int fd;
+static int connect_socket(char *addr, char *port, int reuse_port) {
+    int fd, enable;
     struct sockaddr_in sa;
-    struct timeval timeout;
 
     fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (fd == INVALID_SOCKET) {
@@ -722,6 +5520,21 @@ static int connect_socket(char *addr, char *port) {
         return -1;
     }
 
+#ifdef SO_REUSEPORT
+    enable = 1;
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                                 &enable, sizeof enable) == SOCKET_ERROR) {
+        perror("setting SO_REUSEPORT failed");
+        return -1;
+    }
+#else
+    (void)enable;
+    if (reuse_port) {
+        fprintf(stderr, "SO_REUSEPORT is not supported on this platform\n");
+        return -1;
+    }
+#endif
+
     memset(&sa, 0, sizeof sa);
     sa.sin_family = AF_INET;
     sa.sin_port = htons(atoi(port));
@@ -736,133 +5549,274 @@ static int connect_socket(char *addr, char *port) {
         return -1;
     }
 
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
-                   &timeout, sizeof timeout) == SOCKET_ERROR) {
-        perror("setting the socket recv timeout failed");
-    }
-    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
-                   &timeout, sizeof timeout) == SOCKET_ERROR) {
-        perror("setting the socket recv timeout failed");
+    if (set_nonblocking(fd) == -1) {
+        perror("making the socket non-blocking failed");
+        return -1;
     }
 
     return fd;
 }
 
-/* Returns 0 when the connection is closed, -1 otherwise.
- * This should keep being called if the return value is -1. */
-static int handle_connection(struct connection_ctx *ctx) {
-    ssize_t result, name_len;
-    char buf[128];
-    char *token, *key, *value, *name;
+/* Returns 0 on success, -1 on error. */
+static int set_nonblocking(int fd) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(fd, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags;
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
 
-    switch (ctx->stage) {
-    case 0:
-        /* Read the status line. */
-        result = read_line(ctx->connect_fd, &ctx->buffer,
-                           &ctx->buffer_len, &ctx->read_len);
-        if (result == -1) {
+/* Returns 1 if the last socket error just means "try again later". */
+static int socket_would_block(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Returns 0 on success, -1 on error. */
+static int loop_init(struct event_loop *loop, int listen_fd, int wake_fd) {
+#ifdef RISKYCHAT_USE_EPOLL
+    struct epoll_event event;
+#endif
+
+    loop->listen_fd = listen_fd;
+    loop->wake_fd = wake_fd;
+    loop->accepting = 0;
+#ifdef RISKYCHAT_USE_EPOLL
+    loop->epoll_fd = epoll_create(RISKYCHAT_MAX_EVENTS);
+    if (loop->epoll_fd == -1) {
+        perror("creating the epoll instance failed");
+        return -1;
+    }
+    if (wake_fd != -1) {
+        memset(&event, 0, sizeof event);
+        event.events = EPOLLIN;
+        event.data.ptr = loop; /* The loop itself marks the wake pipe. */
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+            perror("watching the wake pipe failed");
             return -1;
         }
-        token = strtok(ctx->buffer, " ");
-        if (token != NULL && strcmp("GET", token) == 0) {
-            ctx->method = GET;
-            if (RISKYCHAT_VERBOSE >= 2) printf("GET ");
-        } else if (token != NULL && strcmp("HEAD", token) == 0) {
-            ctx->method = HEAD;
-            if (RISKYCHAT_VERBOSE >= 2) printf("HEAD ");
-        } else if (token != NULL && strcmp("POST", token) == 0) {
-            ctx->method = POST;
-            if (RISKYCHAT_VERBOSE >= 2) printf("POST ");
-        } else {
-            ctx->stage = 3;
-            goto respond_400;
-        }
-        token = strtok(NULL, " ");
-        if (token != NULL && strcmp("/", token) == 0) {
-            ctx->requested_resource = RESOURCE_INDEX;
-            if (RISKYCHAT_VERBOSE >= 2) printf("/ ");
-        } else if (token != NULL && strcmp("/post", token) == 0) {
-            ctx->requested_resource = RESOURCE_NEW_POST;
-            if (RISKYCHAT_VERBOSE >= 2) printf("/post ");
-        } else if (token != NULL && strcmp("/login", token) == 0) {
-            ctx->requested_resource = RESOURCE_LOGIN;
-            if (RISKYCHAT_VERBOSE >= 2) printf("/login ");
+    }
+#else
+    loop->pollfds_len = RISKYCHAT_MAX_CONNECTIONS + 2;
+    loop->pollfds = malloc(loop->pollfds_len * sizeof loop->pollfds[0]);
+    if (loop->pollfds == NULL) {
+        perror("error allocating the poll array");
+        return -1;
+    }
+#endif
+    loop_set_accepting(loop, 1);
+    return 0;
+}
+
+static void loop_free(struct event_loop *loop) {
+#ifdef RISKYCHAT_USE_EPOLL
+    close(loop->epoll_fd);
+#else
+    free(loop->pollfds);
+#endif
+}
+
+static void loop_set_accepting(struct event_loop *loop, int accepting) {
+#ifdef RISKYCHAT_USE_EPOLL
+    struct epoll_event event;
+#endif
+
+    if (loop->accepting == accepting) return;
+    loop->accepting = accepting;
+
+#ifdef RISKYCHAT_USE_EPOLL
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; /* NULL marks the listening socket. */
+    if (epoll_ctl(loop->epoll_fd, accepting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                  loop->listen_fd, &event) == -1) {
+        perror("error while toggling the listening socket");
+    }
+#endif
+}
+
+/* Sets the events the connection is waiting on, registering it if it isn't
+ * yet. Returns 0 on success, -1 on error. */
+static int loop_watch(struct event_loop *loop, struct connection_ctx *ctx,
+                      int events) {
+#ifdef RISKYCHAT_USE_EPOLL
+    struct epoll_event event;
+    int op;
+
+    if (ctx->events == events) return 0;
+    op = ctx->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    memset(&event, 0, sizeof event);
+    event.events = ((events & EVENT_READ) ? EPOLLIN : 0) |
+        ((events & EVENT_WRITE) ? EPOLLOUT : 0);
+    event.data.ptr = ctx;
+    if (epoll_ctl(loop->epoll_fd, op, ctx->connect_fd, &event) == -1) {
+        return -1;
+    }
+#else
+    (void)loop;
+#endif
+    ctx->events = events;
+    return 0;
+}
+
+/* Sleeps until at least one connection or the listening socket is ready, or
+ * until timeout_ms has passed. The ready connections are written into the
+ * ready array (which should fit RISKYCHAT_MAX_EVENTS entries), accept_ready
+ * is set if there are new connections to accept, and woken if the wake pipe
+ * is readable. Returns the amount of ready connections, or -1 on error
+ * (EINTR included). */
+static int loop_wait(struct event_loop *loop,
+                     struct connection_ctx **connections, int connections_len,
+                     struct connection_ctx **ready, int *accept_ready,
+                     int *woken, int timeout_ms) {
+    int i, count, ready_len;
+#ifdef RISKYCHAT_USE_EPOLL
+    (void)connections;
+    (void)connections_len;
+
+    *accept_ready = 0;
+    *woken = 0;
+    count = epoll_wait(loop->epoll_fd, loop->events,
+                       RISKYCHAT_MAX_EVENTS, timeout_ms);
+    if (count == -1) return -1;
+
+    ready_len = 0;
+    for (i = 0; i < count; i++) {
+        if (loop->events[i].data.ptr == NULL) {
+            *accept_ready = 1;
+        } else if (loop->events[i].data.ptr == loop) {
+            *woken = 1;
         } else {
-            ctx->stage = 3;
-            goto respond_404;
+            ready[ready_len++] = loop->events[i].data.ptr;
         }
+    }
+    return ready_len;
+#else
+    int pollfds_len, offset, wake_i;
 
-        /* Reset the line length after processing the statusline. */
-        ctx->read_len = 0;
-        ctx->stage++;
+    *accept_ready = 0;
+    *woken = 0;
+    pollfds_len = 0;
+    if (loop->accepting) {
+        loop->pollfds[0].fd = loop->listen_fd;
+        loop->pollfds[0].events = POLLIN;
+        loop->pollfds[0].revents = 0;
+        pollfds_len++;
+    }
+    wake_i = -1;
+    if (loop->wake_fd != -1) {
+        wake_i = pollfds_len;
+        loop->pollfds[wake_i].fd = loop->wake_fd;
+        loop->pollfds[wake_i].events = POLLIN;
+        loop->pollfds[wake_i].revents = 0;
+        pollfds_len++;
+    }
+    offset = pollfds_len;
+    for (i = 0; i < connections_len; i++) {
+        loop->pollfds[pollfds_len].fd = connections[i]->connect_fd;
+        loop->pollfds[pollfds_len].events =
+            ((connections[i]->events & EVENT_READ) ? POLLIN : 0) |
+            ((connections[i]->events & EVENT_WRITE) ? POLLOUT : 0);
+        loop->pollfds[pollfds_len].revents = 0;
+        pollfds_len++;
+    }
+
+    count = poll(loop->pollfds, pollfds_len, timeout_ms);
+    if (count == -1) return -1;
+
+    if (loop->accepting && loop->pollfds[0].revents != 0) {
+        *accept_ready = 1;
+    }
+    if (wake_i != -1 && loop->pollfds[wake_i].revents != 0) {
+        *woken = 1;
+    }
+    ready_len = 0;
+    for (i = offset; i < pollfds_len &&
+             ready_len < RISKYCHAT_MAX_EVENTS; i++) {
+        if (loop->pollfds[i].revents != 0) {
+            ready[ready_len++] = connections[i - offset];
+        }
+    }
+    return ready_len;
+#endif
+}
+
+/* Returns 0 when the connection is closed, 1 when it's streaming events and
+ * has sent everything so far, 2 when the response is waiting for the
+ * write-ahead log to be committed, -1 otherwise.
+ * This should keep being called if the return value is not 0. */
+static int handle_connection(struct connection_ctx *ctx) {
+    ssize_t result;
+    size_t name_len, body_len;
+    char buf[128];
+    char *name, *body, *query;
+    struct room *room;
 
+next_request:
+    switch (ctx->stage) {
+    case 0:
     case 1:
-        /* Read the headers. */
+    case 2:
+        /* Parse what's already in the buffer before asking for more, there
+         * might be a pipelined request waiting. */
         for (;;) {
-            result = read_line(ctx->connect_fd, &ctx->buffer,
-                               &ctx->buffer_len, &ctx->read_len);
-            if (result == -1) {
-                return -1;
-            }
-
-            token = strtok(ctx->buffer, ":");
-            if (token != NULL && strcmp("Content-Length", token) == 0) {
-                token = strtok(NULL, ":");
-                ctx->expected_content_length = atoi(token);
-                if (RISKYCHAT_VERBOSE >= 2)
-                    printf("(%ld) ", ctx->expected_content_length);
-            } else if (token != NULL && strcmp("Cookie", token) == 0) {
-                token = strtok(NULL, ":");
-                key = strtok(token, "=");
-                while (key != NULL) {
-                    value = strtok(NULL, ";");
-                    if (eq_ignore_whitespace("riskyid", key)) {
-                        ctx->user_id = atoi(value);
-                        break;
-                    }
-                    key = strtok(NULL, "=");
-                }
+            /* The request is timed from its first bytes, not from when the
+             * connection started waiting for it. */
+            if (ctx->stage == 0 && ctx->scan_len == 0 &&
+                ctx->read_len > ctx->request_start) {
+                ctx->request_time = ctx->stage_start = monotonic_time();
             }
-
-            /* The end of the header section is marked by an empty line. */
-            if (ctx->buffer != NULL && strcmp("\r\n", ctx->buffer) == 0) {
-                ctx->read_len = 0;
+            result = parse_request(ctx);
+            if (result != 0) end_stage(ctx, LATENCY_PARSE);
+            if (result == 1) {
                 break;
+            } else if (result == -1) {
+                /* No telling where this request ends, so don't try to find
+                 * the next one. */
+                ctx->stage = 3;
+                ctx->method = GET;
+                ctx->keep_alive = 0;
+                goto respond_400;
             }
 
-            /* Reset the line length after processing the line. */
-            ctx->read_len = 0;
+            result = fill_buffer(ctx);
+            if (result == -1) return -1;
+            /* Hanging up between requests is the normal way to go, and
+             * there's no one to respond to otherwise either. */
+            if (result == 0) goto cleanup;
         }
-        ctx->stage++;
-
-    case 2:
-        /* Read the body, when needed. */
-        if (ctx->method == POST && ctx->expected_content_length > 0) {
-            if (RISKYCHAT_VERBOSE >= 2) printf("br");
-            if (ctx->buffer_len < ctx->expected_content_length + 1) {
-                ctx->buffer_len = ctx->expected_content_length + 1;
-                ctx->buffer = realloc(ctx->buffer, ctx->buffer_len);
-                if (ctx->buffer == NULL) {
-                    perror("error when allocating buffer for user response");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            while (ctx->read_len < ctx->expected_content_length) {
-                result = recv(ctx->connect_fd, &ctx->buffer[ctx->read_len],
-                              ctx->expected_content_length, 0);
-                if (result == -1) return -1;
-                else ctx->read_len += result;
-            }
-            ctx->buffer[ctx->expected_content_length] = '\0';
-            if (RISKYCHAT_VERBOSE >= 2)
-                printf("\b\b(%ld bytes read) ", ctx->expected_content_length);
+        if (RISKYCHAT_VERBOSE >= 2) {
+            printf("%s %.*s (%ld) ",
+                   ctx->method == GET ? "GET" :
+                   ctx->method == HEAD ? "HEAD" : "POST",
+                   (int)ctx->target.len,
+                   &ctx->buffer[ctx->request_start + ctx->target.start],
+                   ctx->expected_content_length);
         }
-        ctx->stage++;
 
     case 3:
-        /* Respond. */
+        /* Respond, by queueing up the response. */
+        body = &ctx->buffer[ctx->request_start + ctx->body_start];
+        body_len = ctx->expected_content_length;
+        if (ctx->requests_handled + 1 >= KEEPALIVE_REQUESTS) {
+            ctx->keep_alive = 0;
+        }
+        /* When shedding, the first request of a connection without a user
+         * is turned away: someone who isn't chatting yet can wait more
+         * easily than the users already are. */
+        if (ctx->metrics->shedding && ctx->user_id == 0 &&
+            ctx->requests_handled == 0 &&
+            ctx->requested_resource != RESOURCE_METRICS) {
+            ctx->keep_alive = 0;
+            goto respond_503;
+        }
         switch (ctx->requested_resource) {
         case RESOURCE_INDEX:
             if (ctx->method == GET || ctx->method == HEAD) {
@@ -870,30 +5824,89 @@ static int handle_connection(struct connection_ctx *ctx) {
                     goto respond_login;
                 else goto respond_chat;
             } else break;
+        case RESOURCE_ARCHIVE:
+            if (ctx->method == GET || ctx->method == HEAD) {
+                if (ctx->user_id == 0 || is_expired_user(ctx->user_id))
+                    goto respond_login;
+                else goto respond_archive;
+            } else break;
+        case RESOURCE_API_POSTS:
+            if (ctx->method == GET || ctx->method == HEAD) {
+                if (ctx->user_id == 0 || is_expired_user(ctx->user_id))
+                    goto respond_403;
+                else goto respond_api_posts;
+            } else break;
+        case RESOURCE_EVENTS:
+            if (ctx->method == GET || ctx->method == HEAD) {
+                if (ctx->user_id == 0 || is_expired_user(ctx->user_id))
+                    goto respond_403;
+                else goto respond_events;
+            } else break;
+        case RESOURCE_METRICS:
+            if (ctx->method == GET || ctx->method == HEAD) {
+                goto respond_metrics;
+            } else break;
         case RESOURCE_NEW_POST:
             if (ctx->method == POST) {
-                add_new_post(ctx->buffer, ctx->expected_content_length,
-                             ctx->user_id);
+                if (!rate_limit(LIMIT_USER_POSTS, ctx->user_id,
+                                LIMIT_ADDRESS_POSTS, ctx->peer_addr)) {
+                    goto respond_429;
+                }
+                add_new_post(body, body_len, ctx->user_id);
                 refresh_user(ctx->user_id);
+                ctx->wal_record = wal_wait_record(&WAL);
                 goto respond_redirect_to_chat;
             } else break;
+        case RESOURCE_ROOM:
+            if (ctx->method == GET || ctx->method == HEAD) {
+                if (ctx->user_id == 0 || is_expired_user(ctx->user_id))
+                    goto respond_login;
+                else goto respond_room;
+            } else break;
+        case RESOURCE_ROOM_POST:
+            if (ctx->method == POST) {
+                if (!rate_limit(LIMIT_USER_POSTS, ctx->user_id,
+                                LIMIT_ADDRESS_POSTS, ctx->peer_addr)) {
+                    goto respond_429;
+                }
+                /* Only logged in users get to make rooms. */
+                if (ctx->user_id == 0 || is_expired_user(ctx->user_id)) {
+                    goto respond_redirect_to_room;
+                }
+                name = &ctx->buffer[ctx->request_start + ctx->target.start];
+                name_len = room_name_len(&name[3], ctx->target.len - 3);
+                room = room_open(&name[3], name_len, 1);
+                if (room == NULL) goto respond_503;
+                post_to_room(room, body, body_len, ctx->user_id);
+                room_close(room);
+                refresh_user(ctx->user_id);
+                goto respond_redirect_to_room;
+            } else break;
         case RESOURCE_LOGIN:
             if (ctx->method == POST) {
                 if (ctx->user_id == 0 || is_expired_user(ctx->user_id)) {
-                    decode_percent(ctx->buffer, &ctx->read_len);
-                    name_len = strlen(ctx->buffer) - 5;
+                    if (!rate_limit(LIMIT_NONE, 0, LIMIT_ADDRESS_LOGINS,
+                                    ctx->peer_addr)) {
+                        goto respond_429;
+                    }
+                    body = form_value(body, body_len, "name", &name_len);
+                    if (body == NULL) name_len = 0;
                     name = malloc(name_len + 1);
                     if (name == NULL) {
                         perror("error when allocating name");
                         exit(EXIT_FAILURE);
                     }
-                    memcpy(name, &ctx->buffer[5], name_len);
+                    if (name_len > 0) memcpy(name, body, name_len);
                     name[name_len] = '\0';
-                    if (is_name_reserved(name)) {
+                    ctx->user_id = add_user(name);
+                    if (ctx->user_id == -1) {
+                        free(name);
+                        ctx->user_id = 0;
                         goto respond_login;
-                    } else {
-                        ctx->user_id = add_user(name);
+                    } else if (ctx->user_id == 0) {
+                        free(name);
                     }
+                    ctx->wal_record = wal_wait_record(&WAL);
                 }
                 goto respond_add_user;
             } else break;
@@ -901,93 +5914,502 @@ static int handle_connection(struct connection_ctx *ctx) {
             goto respond_404;
         }
         goto respond_400;
+
+    case 4:
+        /* Keep sending the queued response. */
+        goto send_response;
+
+    case 5:
+        /* Nothing more is expected from a subscriber, but reading tells when
+         * it hangs up. */
+        do {
+            result = recv(ctx->connect_fd, buf, sizeof buf, 0);
+            if (result > 0) ctx->metrics->bytes_in += result;
+        } while (result > 0);
+        if (result == 0) goto cleanup;
+        if (!socket_would_block()) return -1;
+        return stream_events(ctx, 0);
     }
 
 respond_login:
-    result = write_http_response(ctx->connect_fd, &ctx->written_len,
-                                 "200 OK", sizeof "200 OK" - 1,
-                                 static_response_login,
-                                 sizeof static_response_login - 1,
-                                 ctx->method == HEAD, "");
-    if (result == -1) return -1;
+    queue_static_response(&ctx->out, REPLY_LOGIN, ctx->method == HEAD,
+                          ctx->keep_alive, ctx->accept_gzip);
+    ctx->status = STATUS_200;
     if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with login\n");
-    goto cleanup;
+    goto send_response;
 
 respond_redirect_to_chat:
-    result = write_http_response(ctx->connect_fd, &ctx->written_len,
-                                 "303 See Other", sizeof "303 See Other" - 1,
-                                 "", 0, ctx->method == HEAD,
-                                 "Location: /\r\n");
-    if (result == -1) return -1;
+    queue_static_response(&ctx->out, REPLY_REDIRECT_TO_CHAT,
+                          ctx->method == HEAD, ctx->keep_alive, 0);
+    ctx->status = STATUS_303;
     if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with login\n");
-    goto cleanup;
+    goto send_response;
 
 respond_add_user:
-    snprintf(buf, sizeof buf, "Location: /\r\nSet-Cookie: riskyid=%d\r\n",
-             ctx->user_id);
-    result = write_http_response(ctx->connect_fd, &ctx->written_len,
-                                 "303 See Other", sizeof "303 See Other" - 1,
-                                 "", 0, ctx->method == HEAD, buf);
-    if (result == -1) return -1;
+    queue_set_cookie_response(&ctx->out, ctx->user_id, ctx->keep_alive);
+    ctx->status = STATUS_303;
     if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with login\n");
-    goto cleanup;
+    goto send_response;
 
 respond_chat:
-    result = write_http_chat_response(ctx->connect_fd, &ctx->written_len,
-                                      ctx->method == HEAD);
-    if (result == -1) return -1;
+    queue_http_chat_response(&ctx->out, &LOBBY, ctx->method == HEAD,
+                             ctx->keep_alive, ctx->accept_gzip);
+    ctx->status = STATUS_200;
     if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with chat\n");
-    goto cleanup;
+    goto send_response;
+
+respond_room:
+    name = &ctx->buffer[ctx->request_start + ctx->target.start + 3];
+    name_len = room_name_len(name, ctx->target.len - 3);
+    room = room_open(name, name_len, 0);
+    if (room != NULL) {
+        queue_http_chat_response(&ctx->out, room, ctx->method == HEAD,
+                                 ctx->keep_alive, ctx->accept_gzip);
+        room_close(room);
+    } else {
+        queue_http_empty_room_response(&ctx->out, name, name_len,
+                                       ctx->method == HEAD, ctx->keep_alive);
+    }
+    ctx->status = STATUS_200;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with room\n");
+    goto send_response;
+
+respond_redirect_to_room:
+    name = &ctx->buffer[ctx->request_start + ctx->target.start + 3];
+    name_len = room_name_len(name, ctx->target.len - 3);
+    sprintf(buf, "Location: /r/%.*s\r\n", (int)name_len, name);
+    queue_http_response(&ctx->out, "303 See Other", NULL, 0, 1,
+                        ctx->keep_alive, buf);
+    ctx->status = STATUS_303;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with room redirect\n");
+    goto send_response;
+
+respond_archive:
+    query = &ctx->buffer[ctx->request_start + ctx->query.start];
+    ctx->status =
+        queue_http_archive_response(&ctx->out,
+                                    parse_query_number(query, ctx->query.len,
+                                                       "page", 0),
+                                    ctx->method == HEAD, ctx->keep_alive);
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with archive\n");
+    goto send_response;
+
+respond_api_posts:
+    query = &ctx->buffer[ctx->request_start + ctx->query.start];
+    queue_http_api_posts_response(&ctx->out,
+                                  parse_query_number(query, ctx->query.len,
+                                                     "since", 0),
+                                  parse_query_number(query, ctx->query.len,
+                                                     "limit",
+                                                     RISKYCHAT_API_LIMIT),
+                                  ctx->method == HEAD, ctx->keep_alive);
+    ctx->status = STATUS_200;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with posts\n");
+    goto send_response;
+
+respond_metrics:
+    queue_http_metrics_response(&ctx->out, ctx->method == HEAD,
+                                ctx->keep_alive);
+    ctx->status = STATUS_200;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with metrics\n");
+    goto send_response;
+
+respond_events:
+    ctx->status = STATUS_200;
+    if (ctx->method == HEAD) {
+        outq_push(&ctx->out, static_response_events_head,
+                  sizeof static_response_events_head - 1, 0);
+        ctx->keep_alive = 0;
+        goto send_response;
+    }
+    start_event_stream(ctx);
+    count_response(ctx);
+    log_access(ctx);
+    ctx->stage = 5;
+    /* Nothing more is read into the buffer, so the pool can have it. */
+    release_buffer(ctx);
+    ctx->request_start = ctx->read_len = 0;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with events\n");
+    return stream_events(ctx, 0);
 
 respond_400:
-    result = write_http_response(ctx->connect_fd, &ctx->written_len,
-                                 "400 Bad Request",
-                                 sizeof "400 Bad Request" - 1,
-                                 static_response_400,
-                                 sizeof static_response_400 - 1,
-                                 ctx->method == HEAD, "");
-    if (result == -1) return -1;
+    queue_static_response(&ctx->out, REPLY_400, ctx->method == HEAD,
+                          ctx->keep_alive, ctx->accept_gzip);
+    ctx->status = STATUS_400;
     if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with 400\n");
-    goto cleanup;
+    goto send_response;
+
+respond_403:
+    queue_static_response(&ctx->out, REPLY_403, ctx->method == HEAD,
+                          ctx->keep_alive, ctx->accept_gzip);
+    ctx->status = STATUS_403;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with 403\n");
+    goto send_response;
 
 respond_404:
-    result = write_http_response(ctx->connect_fd, &ctx->written_len,
-                                 "404 Not Found",
-                                 sizeof "404 Not Found" - 1,
-                                 static_response_404,
-                                 sizeof static_response_404 - 1,
-                                 ctx->method == HEAD, "");
-    if (result == -1) return -1;
+    queue_static_response(&ctx->out, REPLY_404, ctx->method == HEAD,
+                          ctx->keep_alive, ctx->accept_gzip);
+    ctx->status = STATUS_404;
     if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with 404\n");
-    goto cleanup;
+    goto send_response;
+
+respond_429:
+    queue_static_response(&ctx->out, REPLY_429, ctx->method == HEAD,
+                          ctx->keep_alive, ctx->accept_gzip);
+    ctx->status = STATUS_429;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with 429\n");
+    goto send_response;
+
+respond_503:
+    queue_static_response(&ctx->out, REPLY_503, ctx->method == HEAD,
+                          ctx->keep_alive, ctx->accept_gzip);
+    ctx->status = STATUS_503;
+    if (RISKYCHAT_VERBOSE >= 2) printf("<- responded with 503\n");
+    goto send_response;
+
+send_response:
+    /* The response is only built once, after that it's just sent. */
+    if (ctx->stage == 3) count_response(ctx);
+    ctx->stage = 4;
+    if (ctx->wal_record != 0 && !wal_is_synced(&WAL, ctx->wal_record)) {
+        return 2;
+    }
+    result = outq_flush(ctx->connect_fd, &ctx->out,
+                        &ctx->metrics->bytes_out);
+    if (result == -1) return -1;
+    end_stage(ctx, LATENCY_WRITE);
+    log_access(ctx);
+
+    ctx->requests_handled++;
+    if (ctx->keep_alive) {
+        /* Anything pipelined after this request is still unread. */
+        reset_connection(ctx);
+        goto next_request;
+    }
 
 cleanup:
     cleanup_connection(ctx);
     return 0;
 }
 
+/* Sends the subscriber what it hasn't gotten yet: the headers, then the
+ * events, with a heartbeat in between if asked to. A subscriber that falls
+ * too far behind is dropped. Returns 0 when the connection is closed, 1
+ * when everything has been sent, and -1 otherwise, like handle_connection. */
+static int stream_events(struct connection_ctx *ctx, int heartbeat) {
+    int result;
+
+    if (outq_flush(ctx->connect_fd, &ctx->out,
+                   &ctx->metrics->bytes_out) == -1) {
+        return -1;
+    }
+    /* A heartbeat can't go in the middle of an event. */
+    if (heartbeat && ctx->event_offset == 0) {
+        ctx->heartbeat_len = sizeof static_event_heartbeat - 1;
+    }
+    posts_read_lock();
+    result = write_events(ctx);
+    posts_unlock();
+    if (result == 0) {
+        if (RISKYCHAT_VERBOSE >= 2) printf("dropped a slow subscriber\n");
+        cleanup_connection(ctx);
+    }
+    return result;
+}
+
+/* Acts on what handle_connection or stream_events returned: drops the
+ * connection if it's closed, or waits for whatever it needs next. */
+static void settle_connection(struct worker *worker,
+                              struct connection_ctx *ctx, int result) {
+    if (result != 0 && ctx->stage == 5 && ctx->subscriber_index == -1) {
+        ctx->subscriber_index = worker->subscribers_len;
+        worker->subscribers[worker->subscribers_len++] = ctx;
+    }
+
+    if (result == 0) {
+        drop_connection(worker, ctx);
+    } else if (result == 2) {
+        /* Sent after the next commit, see commit_connections, which is at
+         * most a tick away, so there's no deadline meanwhile. */
+        set_timeout(worker, ctx, TIMEOUT_NONE);
+        if (!ctx->committing) {
+            ctx->committing = 1;
+            worker->committing[worker->committing_len++] = ctx;
+        }
+    } else if (result == 1) {
+        /* A subscriber that's all caught up, only its hanging up is left to
+         * be noticed. */
+        loop_watch(&worker->loop, ctx, EVENT_READ);
+        set_timeout(worker, ctx, TIMEOUT_NONE);
+    } else if (socket_would_block()) {
+        /* Wait for whatever the current stage needs next. */
+        loop_watch(&worker->loop, ctx, ctx->stage >= 3 ?
+                   EVENT_WRITE : EVENT_READ);
+        if (ctx->stage >= 3) {
+            set_timeout(worker, ctx, TIMEOUT_WRITE);
+        } else if (ctx->stage == 2) {
+            set_timeout(worker, ctx, TIMEOUT_BODY);
+        } else if (ctx->requests_handled > 0 && ctx->stage == 0 &&
+                   ctx->read_len == ctx->request_start) {
+            set_timeout(worker, ctx, TIMEOUT_IDLE);
+        } else {
+            set_timeout(worker, ctx, TIMEOUT_HEADER);
+        }
+    } else {
+#ifdef _WIN32
+        fprintf(stderr, "error while handling connection: %d\n",
+                WSAGetLastError());
+#else
+        perror("error while handling connection");
+#endif
+        cleanup_connection(ctx);
+        drop_connection(worker, ctx);
+    }
+}
+
+/* Sends the posts added since the last broadcast to all of the worker's
+ * subscribers, and a heartbeat if asked to, in one pass. Each post's event
+ * was rendered once when it was posted, so this is just a writev per
+ * subscriber. Goes backwards, since dropping a subscriber moves the last one
+ * in its place. */
+static void broadcast_events(struct worker *worker, int heartbeat) {
+    int i;
+
+    if (heartbeat) worker->last_heartbeat = time(NULL);
+    for (i = worker->subscribers_len - 1; i >= 0; i--) {
+        settle_connection(worker, worker->subscribers[i],
+                          stream_events(worker->subscribers[i], heartbeat));
+    }
+}
+
+/* Tells every worker to broadcast the new posts. A full pipe means the
+ * worker has a wake-up coming already, so that's not an error. */
+static void wake_workers(void) {
+#ifndef _WIN32
+    int i;
+    ssize_t result;
+
+    for (i = 0; i < WORKERS_LEN; i++) {
+        result = write(WORKERS[i].wake_fds[1], "", 1);
+        (void)result;
+    }
+#endif
+}
+
+/* Commits the write-ahead log, and lets the connections whose responses
+ * were waiting for it send them: they're watched for writing, so the next
+ * wait hands them right back to handle_connection. */
+static void commit_connections(struct worker *worker) {
+    struct connection_ctx *ctx;
+    int i;
+
+    wal_commit(&WAL);
+    for (i = 0; i < worker->committing_len; i++) {
+        ctx = worker->committing[i];
+        ctx->committing = 0;
+        loop_watch(&worker->loop, ctx, EVENT_WRITE);
+    }
+    worker->committing_len = 0;
+}
+
+/* Clears out the previous request, keeping the buffer around for the next,
+ * along with anything that was pipelined after the previous request. */
+static void reset_connection(struct connection_ctx *ctx) {
+    ctx->request_start += ctx->body_start + ctx->expected_content_length;
+    if (ctx->request_start >= ctx->read_len) {
+        ctx->request_start = 0;
+        ctx->read_len = 0;
+        /* Nothing pipelined, so there's no need to hold onto a buffer
+         * until the next request shows up. */
+        if (ctx->buffer != NULL) release_buffer(ctx);
+    }
+    ctx->parse_len = 0;
+    ctx->scan_len = 0;
+    ctx->body_start = 0;
+    ctx->user_id = 0;
+    ctx->stage = 0;
+    ctx->method = GET;
+    ctx->requested_resource = UNKNOWN_RESOURCE;
+    ctx->expected_content_length = 0;
+    ctx->keep_alive = 0;
+    ctx->accept_gzip = 0;
+    ctx->last_event_id = 0;
+    ctx->wal_record = 0;
+}
+
+/* Gives the connection a deadline for what it's waiting on: the headers,
+ * the body, room to write more of the response, or the next request on a
+ * kept-alive connection. The header, body and idle deadlines are set once
+ * per request, so trickling in a byte at a time doesn't push them back,
+ * but the write deadline is moved along as long as the response moves. */
+static void set_timeout(struct worker *worker, struct connection_ctx *ctx,
+                        enum timeout_kind kind) {
+    long seconds;
+
+    if (kind == ctx->timeout && kind != TIMEOUT_WRITE &&
+        ctx->timeout_request == ctx->requests_handled) {
+        return;
+    }
+    switch (kind) {
+    case TIMEOUT_HEADER: seconds = RISKYCHAT_HEADER_TIMEOUT; break;
+    case TIMEOUT_BODY: seconds = RISKYCHAT_BODY_TIMEOUT; break;
+    case TIMEOUT_WRITE: seconds = RISKYCHAT_WRITE_TIMEOUT; break;
+    case TIMEOUT_IDLE: seconds = KEEPALIVE_TIMEOUT; break;
+    default:
+        timer_remove(&ctx->timer);
+        ctx->timeout = TIMEOUT_NONE;
+        return;
+    }
+    ctx->timeout = kind;
+    ctx->timeout_request = ctx->requests_handled;
+    timer_add(&worker->wheel, &ctx->timer, time(NULL) + seconds);
+}
+
+/* Closes the worker's connections whose deadlines have passed. The ones
+ * that were in the middle of sending a request get a 408 first, if there's
+ * room for it in the socket, and idle or stuck ones are just closed. */
+static void expire_connections(struct worker *worker, time_t now) {
+    struct static_response *response;
+    struct connection_ctx *ctx;
+    struct timer *timer;
+    ssize_t sent;
+
+    response = &STATIC_RESPONSES[REPLY_408][0][0][0];
+    while ((timer = wheel_expire(&worker->wheel, now)) != NULL) {
+        ctx = timer->ctx;
+        if (RISKYCHAT_VERBOSE >= 2) {
+            printf("connection timed out in stage %d\n", ctx->stage);
+        }
+        if (ctx->timeout == TIMEOUT_HEADER || ctx->timeout == TIMEOUT_BODY) {
+            sent = send(ctx->connect_fd, response->data, response->len, 0);
+            if (sent > 0) worker->metrics.bytes_out += sent;
+            worker->metrics.requests[ctx->requested_resource][ctx->method]
+                [STATUS_408]++;
+            ctx->status = STATUS_408;
+            ctx->response_len = sent > 0 ? sent : 0;
+            log_access(ctx);
+        }
+        cleanup_connection(ctx);
+        drop_connection(worker, ctx);
+    }
+}
+
+/* Answers a connection there's no room for with a 503 and closes it. The
+ * request isn't read, but whatever has arrived of it is drained, since
+ * closing with unread data resets the connection, which can lose the
+ * response before the client gets to read it. */
+static void reject_connection(struct worker *worker, int connect_fd) {
+    struct static_response *response;
+    char drain[512];
+    ssize_t sent;
+    int i;
+
+    response = &STATIC_RESPONSES[REPLY_503][0][0][0];
+    sent = send(connect_fd, response->data, response->len, 0);
+    if (sent > 0) worker->metrics.bytes_out += sent;
+    worker->metrics.rejected++;
+    if (RISKYCHAT_VERBOSE >= 2) printf("rejected a connection with 503\n");
+    shutdown(connect_fd, SHUT_WR);
+    for (i = 0; i < 4; i++) {
+        if (recv(connect_fd, drain, sizeof drain, 0) <= 0) break;
+    }
+    close(connect_fd);
+}
+
+/* Counts the worker's connections in each stage, for the metrics. */
+static void tally_stages(struct worker *worker) {
+    int stages[6], i;
+
+    memset(stages, 0, sizeof stages);
+    for (i = 0; i < worker->connections_len; i++) {
+        stages[worker->connections[i]->stage]++;
+    }
+    memcpy(worker->metrics.stages, stages, sizeof stages);
+}
+
 static void cleanup_connection(struct connection_ctx *ctx) {
-    free(ctx->buffer);
+    outq_clear(&ctx->out);
+    /* The chunk array stays with the slot for its next connection, and so
+     * does the scratch buffer, unless some big response stretched it. */
+    if (ctx->out.allocated_scratch_len > RISKYCHAT_MAX_KEPT_SCRATCH) {
+        free(ctx->out.scratch);
+        ctx->out.scratch = NULL;
+        ctx->out.allocated_scratch_len = 0;
+    }
+    if (ctx->buffer != NULL) release_buffer(ctx);
     shutdown(ctx->connect_fd, SHUT_RDWR);
     close(ctx->connect_fd);
 }
 
 static void remove_connection(struct connection_ctx **connections,
-                       int *connections_len, int i) {
+                              int *connections_len, int i) {
     if (i == *connections_len - 1) {
         (*connections_len)--;
     } else {
-        (*connections)[i] = (*connections)[*connections_len - 1];
+        connections[i] = connections[*connections_len - 1];
+        connections[i]->index = i;
         (*connections_len)--;
     }
 }
 
+/* Forgets about a connection that has been cleaned up, and frees it. */
+static void drop_connection(struct worker *worker,
+                            struct connection_ctx *ctx) {
+    int i;
+
+    timer_remove(&ctx->timer);
+    i = ctx->subscriber_index;
+    if (i != -1) {
+        worker->subscribers[i] =
+            worker->subscribers[--worker->subscribers_len];
+        worker->subscribers[i]->subscriber_index = i;
+    }
+    remove_connection(worker->connections, &worker->connections_len,
+                      ctx->index);
+    free_connection(worker, ctx);
+}
+
+/* Takes a free slot from the slab for a new connection. The worker should
+ * have room for it. */
+static struct connection_ctx *alloc_connection(struct worker *worker,
+                                               int connect_fd) {
+    struct connection_ctx *ctx;
+    struct out_queue out;
+
+    ctx = worker->free_ctx;
+    worker->free_ctx = ctx->next_free;
+    out = ctx->out;
+    memset(ctx, 0, sizeof *ctx);
+    ctx->out.chunks = out.chunks;
+    ctx->out.allocated_chunks_len = out.allocated_chunks_len;
+    ctx->out.scratch = out.scratch;
+    ctx->out.allocated_scratch_len = out.allocated_scratch_len;
+    ctx->connect_fd = connect_fd;
+    ctx->index = worker->connections_len;
+    ctx->subscriber_index = -1;
+    ctx->pool = &worker->pool;
+    ctx->metrics = &worker->metrics;
+    ctx->access = &worker->access;
+    ctx->timer.ctx = ctx;
+    return ctx;
+}
+
+static void free_connection(struct worker *worker,
+                            struct connection_ctx *ctx) {
+    ctx->next_free = worker->free_ctx;
+    worker->free_ctx = ctx;
+}
+
 #ifndef _WIN32
 static void handle_terminate(int sig) {
     if (sig == SIGINT || sig == SIGTERM) {
         SERVER_TERMINATED = 1;
     }
 }
+
+static void handle_hangup(int sig) {
+    if (sig == SIGHUP) ACCESS_LOG_REOPEN = 1;
+}
 #endif
 
 static void printf_clear_line(void) {
@@ -996,7 +6418,30 @@ static void printf_clear_line(void) {
     printf("%c[2K", 27);
 }
 
+static char *usage_options[] = {
+    "  --workers <n>  Serve with n threads, each with its own socket.",
+    "  --keepalive-requests <n>  Close connections after n requests.",
+    "  --keepalive-timeout <s>  Close connections idle for s seconds.",
+    "  --shed-lag <ms>  Turn new clients away when lagging ms (0: never).",
+    "  --max-posts <n>  Keep at most n posts in memory.",
+    "  --max-post-bytes <n>  Keep at most n bytes of posts (0: any).",
+    "  --max-post-age <s>  Drop posts older than s seconds (0: never).",
+    "  --post-limit <n>  Let each user post n times a minute (0: any).",
+    "  --login-limit <n>  Let each address log in n times a minute.",
+    "  --archive <file>  Save dropped posts in file, see /archive.",
+    "  --access-log <file>  Log each request in file, reopened on SIGHUP.",
+    "  --data-dir <dir>  Log users and posts in dir, and recover them.",
+    "  --sync <policy>  Sync the log always, batched (per tick) or none.",
+    "  --snapshot-interval <s>  Snapshot the data dir every s seconds.",
+    NULL
+};
+
 static void print_usage(char *program_name) {
-    fprintf(stderr, "Usage: %s [<address> <port>]\nExample: %s 127.0.0.1 8000\n",
+    int i;
+    fprintf(stderr, "Usage: %s [<address> <port>] [options]\n"
+            "Example: %s 127.0.0.1 8000 --workers 4\nOptions:\n",
             program_name, program_name);
+    for (i = 0; usage_options[i] != NULL; i++) {
+        fprintf(stderr, "%s\n", usage_options[i]);
+    }
 }
@@ -0,0 +1,671 @@
+/* A load generator for Risky Chat.
+ * Copyright (C) 2020  Jens Pitkanen <jens.pitkanen@helsinki.fi>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Drives a Risky Chat server with a mix of logins, posts and page views over
+ * a number of kept-alive connections, and prints the throughput and latency
+ * of each as JSON. Build it like the server, e.g.:
+ *   cc -O2 -o riskyload riskyload.c && ./riskyload 127.0.0.1 8000
+ *
+ * The load is open-loop: requests are scheduled at a fixed rate, whether or
+ * not the server keeps up, and each request's latency is measured from when
+ * it was scheduled, not from when a connection was free to send it. So a
+ * server that falls behind shows up in the latencies, instead of just
+ * slowing the load down. Requests that were scheduled but never got a
+ * connection by the end are reported as missed.
+ *
+ * Sections, as in riskychat.c: "decls:", "main:", "privfuncs:". This only
+ * builds on POSIX systems. */
+
+#define _POSIX_C_SOURCE 200112L
+#define RISKYLOAD_HOST "127.0.0.1"
+#define RISKYLOAD_PORT "8000"
+#define RISKYLOAD_CONNECTIONS 16
+#define RISKYLOAD_RATE 1000
+#define RISKYLOAD_DURATION 10
+#define RISKYLOAD_GRACE 5
+#define RISKYLOAD_POST_BYTES 64
+#define RISKYLOAD_MAX_POST_BYTES 1024
+#define RISKYLOAD_MAX_HEAD 8192
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+/* decls: Declarations used by the rest of the program. */
+
+enum endpoint {
+    ENDPOINT_LOGIN, ENDPOINT_POST, ENDPOINT_VIEW, ENDPOINTS_LEN
+};
+
+enum conn_state {
+    CONN_CLOSED, CONN_CONNECTING, CONN_SENDING, CONN_RECEIVING, CONN_IDLE
+};
+
+/* The latencies of one endpoint's requests, in seconds. */
+struct samples {
+    double *latencies;
+    unsigned long len;
+    unsigned long allocated_len;
+    unsigned long errors; /* Failed connections and 4xx/5xx responses. */
+};
+
+/* A connection to the server, with the one request it has in flight. */
+struct conn {
+    int fd;
+    enum conn_state state;
+    int id;
+    char cookie[32]; /* The riskyid cookie's value, empty until logged in. */
+    unsigned long logins;
+    /* The request, and when it was scheduled. Unrecorded requests are the
+     * logins that every connection does before the clock starts. */
+    enum endpoint endpoint;
+    int record;
+    double scheduled;
+    char request[512 + RISKYLOAD_MAX_POST_BYTES];
+    size_t request_len;
+    size_t sent;
+    /* The response's status line and headers, and how much of its body
+     * is still to come, or -1 while the headers are coming in. */
+    char head[RISKYLOAD_MAX_HEAD];
+    size_t head_len;
+    long body_left;
+    int status;
+    int server_closes;
+};
+
+static char *ENDPOINT_NAMES[ENDPOINTS_LEN] = { "login", "post", "view" };
+static int MIX[ENDPOINTS_LEN] = { 1, 10, 89 };
+static int POST_BYTES = RISKYLOAD_POST_BYTES;
+static int ACCEPT_GZIP = 0;
+static struct sockaddr_in SERVER;
+static struct samples SAMPLES[ENDPOINTS_LEN];
+
+static double monotonic_time(void);
+static enum endpoint pick_endpoint(void);
+static void start_request(struct conn *conn, enum endpoint endpoint,
+                          int record, double scheduled);
+static int conn_events(struct conn *conn);
+static void handle_conn(struct conn *conn, short revents, double now);
+static void record_sample(enum endpoint endpoint, double latency,
+                          int failed);
+static void print_report(int connections_len, double rate, double duration,
+                         double elapsed, unsigned long missed);
+static void print_usage(char *program_name);
+
+
+/* main: The main function */
+
+int main(int argc, char **argv) {
+    int i, j, connections_len, positional_len, idle, busy, ready;
+    char *addr, *port, *positional[2], *end, *mix, *part;
+    double rate, duration, start, now, until, deadline;
+    unsigned long scheduled, issued, due, total;
+    struct conn *conns;
+    struct pollfd *pollfds;
+    long timeout_ms;
+
+    connections_len = RISKYLOAD_CONNECTIONS;
+    rate = RISKYLOAD_RATE;
+    duration = RISKYLOAD_DURATION;
+    positional_len = 0;
+    positional[0] = positional[1] = NULL;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections_len = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || connections_len < 1) {
+                fprintf(stderr, "--connections should be at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = strtod(argv[++i], &end);
+            if (*end != '\0' || rate <= 0) {
+                fprintf(stderr, "--rate should be more than 0\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = strtod(argv[++i], &end);
+            if (*end != '\0' || duration <= 0) {
+                fprintf(stderr, "--duration should be more than 0\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            mix = argv[++i];
+            for (part = mix, j = 0; j < ENDPOINTS_LEN; j++) {
+                MIX[j] = strtol(part, &end, 10);
+                if (end == part || MIX[j] < 0 ||
+                    *end != (j + 1 < ENDPOINTS_LEN ? ':' : '\0')) {
+                    break;
+                }
+                part = end + 1;
+            }
+            if (j < ENDPOINTS_LEN ||
+                MIX[ENDPOINT_LOGIN] + MIX[ENDPOINT_POST] +
+                MIX[ENDPOINT_VIEW] == 0) {
+                fprintf(stderr, "--mix should be login:post:view weights, "
+                        "e.g. 1:10:89\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--post-bytes") == 0 && i + 1 < argc) {
+            POST_BYTES = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || POST_BYTES < 1 ||
+                POST_BYTES > RISKYLOAD_MAX_POST_BYTES) {
+                fprintf(stderr, "--post-bytes should be between 1 and %d\n",
+                        RISKYLOAD_MAX_POST_BYTES);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--gzip") == 0) {
+            ACCEPT_GZIP = 1;
+        } else if (argv[i][0] != '-' && positional_len < 2) {
+            positional[positional_len++] = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (positional_len == 0) {
+        addr = RISKYLOAD_HOST;
+        port = RISKYLOAD_PORT;
+    } else if (positional_len == 2) {
+        addr = positional[0];
+        port = positional[1];
+    } else {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    memset(&SERVER, 0, sizeof SERVER);
+    SERVER.sin_family = AF_INET;
+    SERVER.sin_port = htons(atoi(port));
+    SERVER.sin_addr.s_addr = inet_addr(addr);
+    signal(SIGPIPE, SIG_IGN);
+    srand(1);
+
+    conns = calloc(connections_len, sizeof conns[0]);
+    pollfds = malloc(connections_len * sizeof pollfds[0]);
+    if (conns == NULL || pollfds == NULL) {
+        perror("error allocating the connections");
+        return 1;
+    }
+    for (i = 0; i < connections_len; i++) {
+        conns[i].fd = -1;
+        conns[i].id = i;
+    }
+
+    /* Every connection logs in first, so the measured posts and page views
+     * have a user to go with them. These aren't timed. */
+    now = monotonic_time();
+    for (i = 0; i < connections_len; i++) {
+        start_request(&conns[i], ENDPOINT_LOGIN, 0, now);
+    }
+
+    /* Requests are scheduled every 1/rate seconds from start, request n at
+     * start + n / rate. Once the logins are done, each pass sends the ones
+     * that are due to the free connections, oldest first. */
+    start = until = 0;
+    scheduled = issued = total = 0;
+    deadline = now + RISKYLOAD_GRACE * 4;
+    for (;;) {
+        now = monotonic_time();
+        idle = busy = 0;
+        for (i = 0; i < connections_len; i++) {
+            if (conns[i].state == CONN_IDLE ||
+                conns[i].state == CONN_CLOSED) {
+                idle++;
+            } else {
+                busy++;
+            }
+        }
+
+        if (start == 0 && busy == 0) {
+            for (i = j = 0; i < connections_len; i++) {
+                if (conns[i].cookie[0] != '\0') j++;
+            }
+            fprintf(stderr, "%d of %d connections logged in, sending %.0f "
+                    "requests per second for %.0f seconds.\n",
+                    j, connections_len, rate, duration);
+            start = now;
+            until = start + duration;
+            total = (unsigned long)(duration * rate);
+            deadline = until + RISKYLOAD_GRACE;
+        }
+        if (start != 0) {
+            due = (unsigned long)((now - start) * rate) + 1;
+            if (now >= until || due > total) due = total;
+            if (scheduled < due) scheduled = due;
+            for (i = 0; i < connections_len && issued < scheduled; i++) {
+                if (conns[i].state == CONN_IDLE ||
+                    conns[i].state == CONN_CLOSED) {
+                    start_request(&conns[i], pick_endpoint(), 1,
+                                  start + issued / rate);
+                    issued++;
+                    busy++;
+                }
+            }
+            if (now >= until && (busy == 0 || now >= deadline)) break;
+        } else if (now >= deadline) {
+            fprintf(stderr, "The logins didn't finish in time.\n");
+            return 1;
+        }
+
+        /* Sleep until something happens or the next request is due. */
+        timeout_ms = 100;
+        if (start != 0 && now < until && issued >= scheduled) {
+            timeout_ms = (long)((start + issued / rate - now) * 1000);
+            if (timeout_ms < 0) timeout_ms = 0;
+            if (timeout_ms > 100) timeout_ms = 100;
+        }
+        for (i = 0; i < connections_len; i++) {
+            pollfds[i].fd = conns[i].fd;
+            pollfds[i].events = conn_events(&conns[i]);
+            pollfds[i].revents = 0;
+        }
+        ready = poll(pollfds, connections_len, (int)timeout_ms);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("error while waiting for the connections");
+            return 1;
+        }
+        now = monotonic_time();
+        for (i = 0; i < connections_len && ready > 0; i++) {
+            if (pollfds[i].revents != 0) {
+                handle_conn(&conns[i], pollfds[i].revents, now);
+                ready--;
+            }
+        }
+    }
+
+    /* Whatever's still in flight past the grace period failed. */
+    now = monotonic_time();
+    for (i = 0; i < connections_len; i++) {
+        if (conns[i].state != CONN_IDLE && conns[i].state != CONN_CLOSED &&
+            conns[i].record) {
+            record_sample(conns[i].endpoint, now - conns[i].scheduled, 1);
+        }
+        if (conns[i].fd != -1) close(conns[i].fd);
+    }
+    print_report(connections_len, rate, duration, now - start,
+                 total - issued);
+
+    for (i = 0; i < ENDPOINTS_LEN; i++) free(SAMPLES[i].latencies);
+    free(conns);
+    free(pollfds);
+    return 0;
+}
+
+
+/* privfuncs: The rest. */
+
+/* Returns the seconds since some fixed point, for timing things. */
+static double monotonic_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Picks the next request by the --mix weights. */
+static enum endpoint pick_endpoint(void) {
+    int total, pick, i;
+
+    total = MIX[ENDPOINT_LOGIN] + MIX[ENDPOINT_POST] + MIX[ENDPOINT_VIEW];
+    pick = rand() % total;
+    for (i = 0; i < ENDPOINTS_LEN - 1; i++) {
+        if (pick < MIX[i]) break;
+        pick -= MIX[i];
+    }
+    return (enum endpoint)i;
+}
+
+/* Opens a new non-blocking connection to the server. Returns 0 if it's on
+ * its way, -1 on error. */
+static int conn_open(struct conn *conn) {
+    int flags;
+
+    conn->fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (conn->fd == -1) return -1;
+    flags = fcntl(conn->fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    if (connect(conn->fd, (struct sockaddr *)&SERVER, sizeof SERVER) == -1 &&
+        errno != EINPROGRESS) {
+        return -1;
+    }
+    conn->state = CONN_CONNECTING;
+    return 0;
+}
+
+static void conn_close(struct conn *conn) {
+    if (conn->fd != -1) close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_CLOSED;
+}
+
+/* Renders the request, and starts sending it, connecting first if the
+ * connection isn't open. A login picks a new name each time. */
+static void start_request(struct conn *conn, enum endpoint endpoint,
+                          int record, double scheduled) {
+    char content[RISKYLOAD_MAX_POST_BYTES + 1], cookie[64], body[128];
+    char *gzip;
+    int i;
+
+    cookie[0] = '\0';
+    if (conn->cookie[0] != '\0') {
+        sprintf(cookie, "Cookie: riskyid=%s\r\n", conn->cookie);
+    }
+    gzip = ACCEPT_GZIP ? "Accept-Encoding: gzip\r\n" : "";
+    if (endpoint == ENDPOINT_LOGIN) {
+        sprintf(body, "name=load%d_%lu", conn->id, conn->logins++);
+        conn->request_len = sprintf(conn->request,
+                                    "POST /login HTTP/1.1\r\n"
+                                    "Content-Length: %lu\r\n%s\r\n%s",
+                                    (unsigned long)strlen(body), cookie,
+                                    body);
+    } else if (endpoint == ENDPOINT_POST) {
+        for (i = 0; i < POST_BYTES; i++) content[i] = 'a' + i % 26;
+        content[POST_BYTES] = '\0';
+        conn->request_len = sprintf(conn->request,
+                                    "POST /post HTTP/1.1\r\n"
+                                    "Content-Length: %d\r\n%s\r\n"
+                                    "content=%s",
+                                    POST_BYTES + 8, cookie, content);
+    } else {
+        conn->request_len = sprintf(conn->request,
+                                    "GET / HTTP/1.1\r\n%s%s\r\n",
+                                    cookie, gzip);
+    }
+    conn->endpoint = endpoint;
+    conn->record = record;
+    conn->scheduled = scheduled;
+    conn->sent = 0;
+    conn->head_len = 0;
+    conn->body_left = -1;
+    conn->server_closes = 0;
+    if (conn->state == CONN_CLOSED) {
+        if (conn_open(conn) == -1) {
+            if (record) record_sample(endpoint, 0, 1);
+            conn_close(conn);
+        }
+    } else {
+        conn->state = CONN_SENDING;
+    }
+}
+
+/* Returns the poll events the connection is waiting for. */
+static int conn_events(struct conn *conn) {
+    switch (conn->state) {
+    case CONN_CONNECTING:
+    case CONN_SENDING:
+        return POLLOUT;
+    case CONN_RECEIVING:
+        return POLLIN;
+    default:
+        return 0;
+    }
+}
+
+/* Parses the status line and the headers that matter, once they're all in.
+ * Returns 0 on success, -1 if the response doesn't make sense. */
+static int parse_head(struct conn *conn, size_t head_len) {
+    char *line, *line_end, *end, *value, *digits;
+
+    end = &conn->head[head_len];
+    if (sscanf(conn->head, "HTTP/1.%*d %d", &conn->status) != 1) return -1;
+    conn->body_left = -1;
+    for (line = conn->head; line < end; line = line_end + 1) {
+        line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) break;
+        value = memchr(line, ':', line_end - line);
+        if (value == NULL) continue;
+        for (value++; *value == ' '; value++);
+        if (strncmp(line, "Content-Length:", 15) == 0) {
+            conn->body_left = strtol(value, NULL, 10);
+        } else if (strncmp(line, "Connection: close", 17) == 0) {
+            conn->server_closes = 1;
+        } else if (strncmp(line, "Set-Cookie: riskyid=", 20) == 0) {
+            value += 8;
+            for (digits = value; *digits >= '0' && *digits <= '9';
+                 digits++);
+            if (digits - value < (long)sizeof conn->cookie) {
+                memcpy(conn->cookie, value, digits - value);
+                conn->cookie[digits - value] = '\0';
+            }
+        }
+    }
+    return conn->body_left == -1 ? -1 : 0;
+}
+
+/* Ends the request in flight, successfully or not. */
+static void finish_request(struct conn *conn, double now, int failed) {
+    if (conn->record) {
+        record_sample(conn->endpoint, now - conn->scheduled,
+                      failed || conn->status >= 400);
+    }
+    if (failed || conn->server_closes) {
+        conn_close(conn);
+    } else {
+        conn->state = CONN_IDLE;
+    }
+}
+
+/* Moves the connection along: finishes connecting, sends the request, and
+ * reads the response, which is only looked at up to the end of its
+ * headers, the body is just counted. */
+static void handle_conn(struct conn *conn, short revents, double now) {
+    static char buf[65536];
+    ssize_t result;
+    size_t copy_len;
+    char *head_end;
+    int error;
+    socklen_t error_len;
+
+    if (conn->state == CONN_CONNECTING) {
+        error = 0;
+        error_len = sizeof error;
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error,
+                       &error_len) == -1 || error != 0) {
+            finish_request(conn, now, 1);
+            return;
+        }
+        conn->state = CONN_SENDING;
+    }
+
+    if (conn->state == CONN_SENDING) {
+        result = send(conn->fd, &conn->request[conn->sent],
+                      conn->request_len - conn->sent, 0);
+        if (result == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                finish_request(conn, now, 1);
+            }
+            return;
+        }
+        conn->sent += result;
+        if (conn->sent == conn->request_len) conn->state = CONN_RECEIVING;
+        return;
+    }
+
+    if (conn->state != CONN_RECEIVING || !(revents & (POLLIN | POLLHUP))) {
+        return;
+    }
+    for (;;) {
+        result = recv(conn->fd, buf, sizeof buf, 0);
+        if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (result <= 0) {
+            finish_request(conn, now, 1);
+            return;
+        }
+        if (conn->body_left == -1) {
+            copy_len = sizeof conn->head - 1 - conn->head_len;
+            if (copy_len > (size_t)result) copy_len = result;
+            memcpy(&conn->head[conn->head_len], buf, copy_len);
+            conn->head[conn->head_len + copy_len] = '\0';
+            head_end = strstr(conn->head, "\r\n\r\n");
+            if (head_end == NULL) {
+                conn->head_len += copy_len;
+                if (conn->head_len == sizeof conn->head - 1) {
+                    finish_request(conn, now, 1);
+                    return;
+                }
+                continue;
+            }
+            head_end += 4;
+            if (parse_head(conn, head_end - conn->head) == -1) {
+                finish_request(conn, now, 1);
+                return;
+            }
+            /* Whatever came after the headers is the start of the body. */
+            result -= head_end - &conn->head[conn->head_len];
+            conn->head_len = head_end - conn->head;
+        }
+        conn->body_left -= result;
+        if (conn->body_left <= 0) {
+            finish_request(conn, now, conn->body_left < 0);
+            return;
+        }
+    }
+}
+
+static void record_sample(enum endpoint endpoint, double latency,
+                          int failed) {
+    struct samples *s;
+    double *new_latencies;
+    unsigned long new_len;
+
+    s = &SAMPLES[endpoint];
+    if (failed) {
+        s->errors++;
+        return;
+    }
+    if (s->len == s->allocated_len) {
+        new_len = s->allocated_len == 0 ? 1024 : s->allocated_len * 2;
+        new_latencies = realloc(s->latencies,
+                                new_len * sizeof s->latencies[0]);
+        if (new_latencies == NULL) {
+            perror("error when expanding the latency samples");
+            exit(EXIT_FAILURE);
+        }
+        s->latencies = new_latencies;
+        s->allocated_len = new_len;
+    }
+    s->latencies[s->len++] = latency;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Returns the q-quantile of the sorted latencies in milliseconds, or 0 if
+ * there are none. */
+static double quantile_ms(double *sorted, unsigned long len, double q) {
+    unsigned long i;
+
+    if (len == 0) return 0;
+    i = (unsigned long)(q * len);
+    if (i >= len) i = len - 1;
+    return sorted[i] * 1000;
+}
+
+static void print_samples(char *name, double *sorted, unsigned long len,
+                          unsigned long errors, double elapsed, int last) {
+    printf("    \"%s\": {\"requests\": %lu, \"errors\": %lu, "
+           "\"throughput\": %.1f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+           "\"p999_ms\": %.3f, \"max_ms\": %.3f}%s\n",
+           name, len, errors, len / elapsed, quantile_ms(sorted, len, 0.5),
+           quantile_ms(sorted, len, 0.99), quantile_ms(sorted, len, 0.999),
+           len > 0 ? sorted[len - 1] * 1000 : 0, last ? "" : ",");
+}
+
+/* Prints the report as JSON: the settings, how many scheduled requests
+ * never got sent, and the throughput (successful responses per second) and
+ * latency percentiles per endpoint and in total. */
+static void print_report(int connections_len, double rate, double duration,
+                         double elapsed, unsigned long missed) {
+    double *all;
+    unsigned long all_len, errors;
+    int i;
+
+    all_len = errors = 0;
+    for (i = 0; i < ENDPOINTS_LEN; i++) {
+        all_len += SAMPLES[i].len;
+        errors += SAMPLES[i].errors;
+    }
+    all = malloc((all_len + 1) * sizeof all[0]);
+    if (all == NULL) {
+        perror("error allocating the report");
+        exit(EXIT_FAILURE);
+    }
+    all_len = 0;
+    for (i = 0; i < ENDPOINTS_LEN; i++) {
+        memcpy(&all[all_len], SAMPLES[i].latencies,
+               SAMPLES[i].len * sizeof all[0]);
+        all_len += SAMPLES[i].len;
+        qsort(SAMPLES[i].latencies, SAMPLES[i].len, sizeof all[0],
+              compare_doubles);
+    }
+    qsort(all, all_len, sizeof all[0], compare_doubles);
+
+    printf("{\n  \"connections\": %d,\n  \"rate\": %.1f,\n"
+           "  \"duration\": %.1f,\n  \"elapsed\": %.3f,\n"
+           "  \"mix\": {\"login\": %d, \"post\": %d, \"view\": %d},\n"
+           "  \"gzip\": %s,\n  \"missed\": %lu,\n  \"endpoints\": {\n",
+           connections_len, rate, duration, elapsed, MIX[ENDPOINT_LOGIN],
+           MIX[ENDPOINT_POST], MIX[ENDPOINT_VIEW],
+           ACCEPT_GZIP ? "true" : "false", missed);
+    for (i = 0; i < ENDPOINTS_LEN; i++) {
+        print_samples(ENDPOINT_NAMES[i], SAMPLES[i].latencies,
+                      SAMPLES[i].len, SAMPLES[i].errors, elapsed,
+                      i == ENDPOINTS_LEN - 1);
+    }
+    printf("  },\n  \"total\": {\n");
+    print_samples("all", all, all_len, errors, elapsed, 1);
+    printf("  }\n}\n");
+    free(all);
+}
+
+static char *usage_options[] = {
+    "  --connections <n>  Spread the requests over n connections.",
+    "  --rate <r>  Schedule r requests per second.",
+    "  --duration <s>  Keep scheduling requests for s seconds.",
+    "  --mix <l:p:v>  Weights of logins, posts and page views.",
+    "  --post-bytes <n>  Send n bytes of content per post.",
+    "  --gzip  Ask for the page gzipped.",
+    NULL
+};
+
+static void print_usage(char *program_name) {
+    int i;
+    fprintf(stderr, "Usage: %s [<address> <port>] [options]\n"
+            "Example: %s 127.0.0.1 8000 --rate 5000 --connections 64\n"
+            "Options:\n", program_name, program_name);
+    for (i = 0; usage_options[i] != NULL; i++) {
+        fprintf(stderr, "%s\n", usage_options[i]);
+    }
+}